@@ -0,0 +1,626 @@
+/*
+ *  arrow.c  --  Apache Arrow C Data Interface export
+ */
+
+
+#include "arrow.h"
+
+#include "column.h"
+#include "binary.h"
+#include "datetime.h"
+
+#include <string.h>
+#include <limits.h>
+
+
+#define UNIX_EPOCH_DAYS    10957                  /* 2000-01-01 - 1970-01-01 */
+#define UNIX_EPOCH_USECS   946684800000000LL
+
+
+/* How a column is exported. */
+enum arrow_kind {
+    AK_BOOL, AK_INT16, AK_INT32, AK_INT64, AK_UINT32, AK_FLOAT32, AK_FLOAT64,
+    AK_DATE32, AK_TIMESTAMP, AK_TIMESTAMPTZ, AK_BINARY, AK_UTF8
+};
+
+static const char *const arrow_formats[] = {
+    "b", "s", "i", "l", "I", "f", "g", "tdD", "tsu:", "tsu:UTC", "z", "u"
+};
+
+struct arrow_batch {
+    const void         *buffers[ 1];
+    struct ArrowArray  *children[ 1];       /* actually n */
+};
+
+struct arrow_column {
+    const void *buffers[ 3];
+};
+
+struct arrow_schema_batch {
+    struct ArrowSchema *children[ 1];       /* actually n */
+};
+
+struct arrow_fill {
+    struct pgresult_data *r;
+    struct ArrowArray    *array;
+};
+
+struct arrow_buf {
+    char  *p;
+    size_t len;
+    size_t cap;
+};
+
+
+extern void pg_arrow_export( struct pgresult_data *r,
+                             struct ArrowSchema *schema, struct ArrowArray *array);
+static enum arrow_kind arrow_kind_of( Oid typ);
+static void  arrow_check( struct pgresult_data *r);
+static void  arrow_schema( struct pgresult_data *r, struct ArrowSchema *schema);
+static void  arrow_schema_release( struct ArrowSchema *schema);
+static void  arrow_child_schema_release( struct ArrowSchema *schema);
+static void  arrow_array_init( struct pgresult_data *r, struct ArrowArray *array);
+static void  arrow_array_release( struct ArrowArray *array);
+static void  arrow_child_array_release( struct ArrowArray *array);
+static VALUE arrow_fill_run( VALUE arg);
+static void  arrow_column( struct pgresult_data *r, int col, struct ArrowArray *a);
+static void *arrow_alloc( size_t size);
+static void  arrow_buf_cat( struct arrow_buf *b, const char *p, size_t l);
+
+static VALUE pgresult_export_arrow( VALUE self, VALUE schema, VALUE array);
+static VALUE pgresult_to_arrow( VALUE self);
+static VALUE to_arrow_run( VALUE arg);
+static VALUE to_arrow_end( VALUE arg);
+
+
+static ID id_import;
+
+
+
+/*
+ * Fill the Arrow structs +schema+ and +array+ with a struct typed record
+ * batch of the result.  The consumer owns them afterwards and has to call
+ * their +release+ callbacks.
+ */
+void
+pg_arrow_export( struct pgresult_data *r,
+                 struct ArrowSchema *schema, struct ArrowArray *array)
+{
+    struct arrow_fill f;
+    int state;
+
+    schema->release = NULL;
+    array->release  = NULL;
+    arrow_check( r);
+    arrow_schema( r, schema);
+    f.r     = r;
+    f.array = array;
+    rb_protect( &arrow_fill_run, (VALUE) &f, &state);
+    if (state) {
+        if (array->release != NULL)
+            array->release( array);
+        schema->release( schema);
+        rb_jump_tag( state);
+    }
+}
+
+enum arrow_kind
+arrow_kind_of( Oid typ)
+{
+    switch (typ) {
+    case BOOLOID:        return AK_BOOL;
+    case INT2OID:        return AK_INT16;
+    case INT4OID:        return AK_INT32;
+    case INT8OID:        return AK_INT64;
+    case OIDOID:         return AK_UINT32;
+    case FLOAT4OID:      return AK_FLOAT32;
+    case FLOAT8OID:      return AK_FLOAT64;
+    case DATEOID:        return AK_DATE32;
+    case TIMESTAMPOID:   return AK_TIMESTAMP;
+    case TIMESTAMPTZOID: return AK_TIMESTAMPTZ;
+    case BYTEAOID:       return AK_BINARY;
+    default:             return AK_UTF8;
+    }
+}
+
+/*
+ * String columns are passed as they come, so they have to be UTF-8
+ * text.  Binary values of other types than these have no text to pass.
+ */
+void
+arrow_check( struct pgresult_data *r)
+{
+    struct pgconn_data *c;
+    const char *enc;
+    int n, i, utf8;
+    Oid typ;
+
+    utf8 = 0;
+    for (i = 0, n = PQnfields( r->res); i < n; ++i) {
+        typ = PQftype( r->res, i);
+        if (arrow_kind_of( typ) != AK_UTF8)
+            continue;
+        utf8 = 1;
+        if (PQfformat( r->res, i) != 0 && typ != TEXTOID && typ != VARCHAROID &&
+                typ != BPCHAROID && typ != NAMEOID && typ != JSONOID)
+            rb_raise( rb_ePgError,
+                "Column \"%s\" of type %u cannot be exported in binary format.",
+                PQfname( r->res, i), typ);
+    }
+    if (!utf8)
+        return;
+    c = get_pgconn( r->conn);
+    enc = pg_encoding_to_char( PQclientEncoding( c->conn));
+    if (strcmp( enc, "UTF8") != 0)
+        rb_raise( rb_ePgError, "Client encoding is %s, Arrow needs UTF8.", enc);
+}
+
+
+void
+arrow_schema( struct pgresult_data *r, struct ArrowSchema *schema)
+{
+    struct arrow_schema_batch *b;
+    struct ArrowSchema *ch;
+    int n, i;
+
+    n = PQnfields( r->res);
+    b = arrow_alloc( sizeof (struct arrow_schema_batch) +
+                     n * (sizeof (struct ArrowSchema *) + sizeof (struct ArrowSchema)));
+    ch = (struct ArrowSchema *) (b->children + (n > 0 ? n : 1));
+    for (i = 0; i < n; ++i, ++ch) {
+        const char *name;
+
+        name = PQfname( r->res, i);
+        memset( ch, 0, sizeof *ch);
+        ch->format       = arrow_formats[ arrow_kind_of( PQftype( r->res, i))];
+        ch->name         = ch->private_data = strdup( name != NULL ? name : "");
+        ch->flags        = ARROW_FLAG_NULLABLE;
+        ch->release      = &arrow_child_schema_release;
+        b->children[ i]  = ch;
+    }
+    memset( schema, 0, sizeof *schema);
+    schema->format       = "+s";
+    schema->name         = "";
+    schema->n_children   = n;
+    schema->children     = b->children;
+    schema->release      = &arrow_schema_release;
+    schema->private_data = b;
+}
+
+void
+arrow_schema_release( struct ArrowSchema *schema)
+{
+    int64_t i;
+
+    for (i = 0; i < schema->n_children; ++i)
+        if (schema->children[ i]->release != NULL)
+            schema->children[ i]->release( schema->children[ i]);
+    free( schema->private_data);
+    schema->release = NULL;
+}
+
+void
+arrow_child_schema_release( struct ArrowSchema *schema)
+{
+    free( schema->private_data);
+    schema->release = NULL;
+}
+
+
+void
+arrow_array_init( struct pgresult_data *r, struct ArrowArray *array)
+{
+    struct arrow_batch *b;
+    struct ArrowArray *ch;
+    int n, i;
+
+    n = PQnfields( r->res);
+    b = arrow_alloc( sizeof (struct arrow_batch) +
+                     n * (sizeof (struct ArrowArray *) + sizeof (struct ArrowArray)));
+    b->buffers[ 0] = NULL;
+    ch = (struct ArrowArray *) (b->children + (n > 0 ? n : 1));
+    for (i = 0; i < n; ++i, ++ch) {
+        memset( ch, 0, sizeof *ch);
+        b->children[ i] = ch;
+    }
+    memset( array, 0, sizeof *array);
+    array->length       = PQntuples( r->res);
+    array->n_buffers    = 1;
+    array->buffers      = b->buffers;
+    array->n_children   = n;
+    array->children     = b->children;
+    array->release      = &arrow_array_release;
+    array->private_data = b;
+}
+
+void
+arrow_array_release( struct ArrowArray *array)
+{
+    int64_t i;
+
+    for (i = 0; i < array->n_children; ++i)
+        if (array->children[ i]->release != NULL)
+            array->children[ i]->release( array->children[ i]);
+    free( array->private_data);
+    array->release = NULL;
+}
+
+void
+arrow_child_array_release( struct ArrowArray *array)
+{
+    struct arrow_column *p;
+    int i;
+
+    p = array->private_data;
+    for (i = 0; i < 3; ++i)
+        free( (void *) p->buffers[ i]);
+    free( p);
+    array->release = NULL;
+}
+
+
+VALUE
+arrow_fill_run( VALUE arg)
+{
+    struct arrow_fill *f = (struct arrow_fill *) arg;
+    int n, i;
+
+    arrow_array_init( f->r, f->array);
+    for (i = 0, n = PQnfields( f->r->res); i < n; ++i)
+        arrow_column( f->r, i, f->array->children[ i]);
+    return Qnil;
+}
+
+void
+arrow_column( struct pgresult_data *r, int col, struct ArrowArray *a)
+{
+    struct arrow_column *p;
+    unsigned char *valid;
+    enum arrow_kind kind;
+    Oid typ;
+    int bin, m, j;
+    long nulls;
+
+    p = arrow_alloc( sizeof *p);
+    p->buffers[ 0] = p->buffers[ 1] = p->buffers[ 2] = NULL;
+    a->length       = m = PQntuples( r->res);
+    a->n_buffers    = 2;
+    a->buffers      = p->buffers;
+    a->release      = &arrow_child_array_release;
+    a->private_data = p;
+
+    typ  = PQftype( r->res, col);
+    bin  = PQfformat( r->res, col);
+    kind = arrow_kind_of( typ);
+    p->buffers[ 0] = valid = arrow_alloc( (m + 7) / 8);
+    memset( valid, 0, (m + 7) / 8);
+    nulls = 0;
+
+    switch (kind) {
+    case AK_INT64:
+        {
+            long long *v;
+
+            p->buffers[ 1] = v = arrow_alloc( (size_t) m * sizeof *v);
+            nulls = pg_column_int64( r, col, v, valid);
+        }
+        break;
+    case AK_INT16:
+    case AK_INT32:
+    case AK_UINT32:
+        {
+            long long *t;
+            VALUE tv;
+
+            t = ALLOCV_N( long long, tv, m > 0 ? m : 1);
+            nulls = pg_column_int64( r, col, t, valid);
+            if (kind == AK_INT16) {
+                int16_t *v;
+
+                p->buffers[ 1] = v = arrow_alloc( (size_t) m * sizeof *v);
+                for (j = 0; j < m; ++j)
+                    v[ j] = (int16_t) t[ j];
+            } else {
+                int32_t *v;
+
+                p->buffers[ 1] = v = arrow_alloc( (size_t) m * sizeof *v);
+                for (j = 0; j < m; ++j)
+                    v[ j] = (int32_t) t[ j];
+            }
+            ALLOCV_END( tv);
+        }
+        break;
+    case AK_FLOAT64:
+        {
+            double *v;
+
+            p->buffers[ 1] = v = arrow_alloc( (size_t) m * sizeof *v);
+            nulls = pg_column_float64( r, col, v, valid);
+        }
+        break;
+    case AK_FLOAT32:
+        {
+            double *t;
+            float *v;
+            VALUE tv;
+
+            t = ALLOCV_N( double, tv, m > 0 ? m : 1);
+            nulls = pg_column_float64( r, col, t, valid);
+            p->buffers[ 1] = v = arrow_alloc( (size_t) m * sizeof *v);
+            for (j = 0; j < m; ++j)
+                v[ j] = (float) t[ j];
+            ALLOCV_END( tv);
+        }
+        break;
+    case AK_BOOL:
+        {
+            unsigned char *v;
+            const char *s;
+
+            p->buffers[ 1] = v = arrow_alloc( (m + 7) / 8);
+            memset( v, 0, (m + 7) / 8);
+            for (j = 0; j < m; ++j) {
+                if (PQgetisnull( r->res, j, col)) {
+                    ++nulls;
+                    continue;
+                }
+                valid[ j >> 3] |= 1 << (j & 7);
+                s = PQgetvalue( r->res, j, col);
+                if (bin ? *s != 0 : *s == 't')
+                    v[ j >> 3] |= 1 << (j & 7);
+            }
+        }
+        break;
+    case AK_DATE32:
+        {
+            int32_t *v;
+            const char *s;
+            long d;
+            int l;
+
+            p->buffers[ 1] = v = arrow_alloc( (size_t) m * sizeof *v);
+            for (j = 0; j < m; ++j) {
+                v[ j] = 0;
+                if (PQgetisnull( r->res, j, col)) {
+                    ++nulls;
+                    continue;
+                }
+                valid[ j >> 3] |= 1 << (j & 7);
+                s = PQgetvalue( r->res, j, col);
+                l = PQgetlength( r->res, j, col);
+                if (bin)
+                    d = pg_get_int32( s);
+                else if (strcmp( s, "infinity") == 0)
+                    d = INT32_MAX;
+                else if (strcmp( s, "-infinity") == 0)
+                    d = INT32_MIN;
+                else if (!pg_iso_date( s, l, &d))
+                    rb_raise( rb_ePgError, "Dates must be in ISO DateStyle: %s", s);
+                v[ j] = d == INT32_MAX || d == INT32_MIN ? (int32_t) d :
+                                            (int32_t) (d + UNIX_EPOCH_DAYS);
+            }
+        }
+        break;
+    case AK_TIMESTAMP:
+    case AK_TIMESTAMPTZ:
+        {
+            int64_t *v;
+            const char *s;
+            long long t;
+            long usecs, off;
+            int l;
+
+            p->buffers[ 1] = v = arrow_alloc( (size_t) m * sizeof *v);
+            for (j = 0; j < m; ++j) {
+                v[ j] = 0;
+                if (PQgetisnull( r->res, j, col)) {
+                    ++nulls;
+                    continue;
+                }
+                valid[ j >> 3] |= 1 << (j & 7);
+                s = PQgetvalue( r->res, j, col);
+                l = PQgetlength( r->res, j, col);
+                if (bin) {
+                    t = pg_get_int64( s);
+                    v[ j] = t == INT64_MAX || t == INT64_MIN ? t : t + UNIX_EPOCH_USECS;
+                } else if (strcmp( s, "infinity") == 0)
+                    v[ j] = INT64_MAX;
+                else if (strcmp( s, "-infinity") == 0)
+                    v[ j] = INT64_MIN;
+                else if (pg_iso_timestamp( s, l, kind == AK_TIMESTAMPTZ,
+                                           &t, &usecs, &off))
+                    v[ j] = t * 1000000 + usecs;
+                else
+                    rb_raise( rb_ePgError, "Timestamps must be in ISO DateStyle: %s", s);
+            }
+        }
+        break;
+    case AK_BINARY:
+    case AK_UTF8:
+        {
+            struct arrow_buf b;
+            int32_t *o;
+            const char *s;
+            size_t l;
+
+            /* arrow_check() refused binary values that are not text. */
+            a->n_buffers = 3;
+            p->buffers[ 1] = o = arrow_alloc( ((size_t) m + 1) * sizeof *o);
+            b.p = NULL, b.len = b.cap = 0;
+            o[ 0] = 0;
+            for (j = 0; j < m; ++j) {
+                if (PQgetisnull( r->res, j, col))
+                    ++nulls;
+                else {
+                    valid[ j >> 3] |= 1 << (j & 7);
+                    s = PQgetvalue( r->res, j, col);
+                    l = PQgetlength( r->res, j, col);
+                    if (kind == AK_BINARY && !bin) {
+                        unsigned char *u;
+
+                        u = PQunescapeBytea( (const unsigned char *) s, &l);
+                        if (u == NULL)
+                            rb_raise( rb_eNoMemError, "Unescaping bytea failed.");
+                        arrow_buf_cat( &b, (const char *) u, l);
+                        PQfreemem( u);
+                    } else
+                        arrow_buf_cat( &b, s, l);
+                    /* Released from here if anything raises. */
+                    p->buffers[ 2] = b.p;
+                    if (b.len > INT32_MAX)
+                        rb_raise( rb_ePgError, "Column too large for Arrow export.");
+                }
+                o[ j + 1] = (int32_t) b.len;
+            }
+            if (b.p == NULL)
+                p->buffers[ 2] = arrow_alloc( 1);
+        }
+        break;
+    }
+
+    a->null_count = nulls;
+    if (nulls == 0) {
+        free( valid);
+        p->buffers[ 0] = NULL;
+    }
+}
+
+void *
+arrow_alloc( size_t size)
+{
+    void *p;
+
+    p = malloc( size > 0 ? size : 1);
+    if (p == NULL)
+        rb_raise( rb_eNoMemError, "Failed to allocate %lu bytes.", (unsigned long) size);
+    return p;
+}
+
+void
+arrow_buf_cat( struct arrow_buf *b, const char *p, size_t l)
+{
+    if (b->len + l > b->cap) {
+        size_t cap;
+        char *q;
+
+        for (cap = b->cap ? b->cap : 256; cap < b->len + l; cap *= 2)
+            ;
+        q = realloc( b->p, cap);
+        if (q == NULL)
+            rb_raise( rb_eNoMemError, "Failed to allocate %lu bytes.", (unsigned long) cap);
+        b->p   = q;
+        b->cap = cap;
+    }
+    memcpy( b->p + b->len, p, l);
+    b->len += l;
+}
+
+
+/*
+ * call-seq:
+ *    res.export_arrow( schema_ptr, array_ptr)  ->  self
+ *
+ * Fill the Apache Arrow C Data Interface structs at the addresses
+ * +schema_ptr+ and +array_ptr+ with the result as a record batch.  The
+ * values are taken from the result buffers without creating Ruby
+ * objects; the caller owns the structs afterwards.
+ *
+ *   Column type             Arrow type
+ *   ---------------------   --------------------------------------
+ *   bool                    boolean
+ *   smallint, int, bigint   int16, int32, int64
+ *   oid                     uint32
+ *   real, double            float32, float64
+ *   date                    date32
+ *   timestamp[tz]           timestamp[us] (with time zone "UTC")
+ *   bytea                   binary
+ *   everything else         utf8, the text PostgreSQL sends
+ *
+ * Strings are passed as they are, so the client encoding has to be
+ * +UTF8+.  Results in binary format are refused if they have columns
+ * of the last kind other than text, varchar, char, name and json.
+ * Dates and timestamps require the +ISO+ +DateStyle+.  Infinite values
+ * become the extreme values of the Arrow type, like PostgreSQL stores
+ * them.
+ */
+VALUE
+pgresult_export_arrow( VALUE self, VALUE schema, VALUE array)
+{
+    struct pgresult_data *r;
+    uintptr_t s, a;
+
+    TypedData_Get_Struct( self, struct pgresult_data, &pgresult_data_data_type, r);
+    s = (uintptr_t) NUM2ULL( schema);
+    a = (uintptr_t) NUM2ULL( array);
+    if (s == 0 || a == 0)
+        rb_raise( rb_eArgError, "Null pointer.");
+    pg_arrow_export( r, (struct ArrowSchema *) s, (struct ArrowArray *) a);
+    return self;
+}
+
+/*
+ * call-seq:
+ *    res.to_arrow  ->  record_batch
+ *
+ * The result as an <code>Arrow::RecordBatch</code>.  Requires the
+ * +red-arrow+ library to be loaded.  See Pg::Result#export_arrow.
+ */
+VALUE
+pgresult_to_arrow( VALUE self)
+{
+    struct pgresult_data *r;
+    struct ArrowSchema s;
+    struct ArrowArray a;
+    VALUE args[ 3];
+
+    TypedData_Get_Struct( self, struct pgresult_data, &pgresult_data_data_type, r);
+    if (!rb_const_defined( rb_cObject, rb_intern( "Arrow")))
+        rb_raise( rb_ePgError, "Load red-arrow first.");
+    pg_arrow_export( r, &s, &a);
+    args[ 0] = (VALUE) &s;
+    args[ 1] = (VALUE) &a;
+    args[ 2] = Qnil;
+    return rb_ensure( &to_arrow_run, (VALUE) args, &to_arrow_end, (VALUE) args);
+}
+
+VALUE
+to_arrow_run( VALUE arg)
+{
+    VALUE *args = (VALUE *) arg;
+    VALUE schema;
+
+    schema = rb_funcall( rb_path2class( "Arrow::Schema"), id_import, 1,
+                            ULL2NUM( (uintptr_t) args[ 0]));
+    return rb_funcall( rb_path2class( "Arrow::RecordBatch"), id_import, 2,
+                            ULL2NUM( (uintptr_t) args[ 1]), schema);
+}
+
+VALUE
+to_arrow_end( VALUE arg)
+{
+    VALUE *args = (VALUE *) arg;
+    struct ArrowSchema *s = (struct ArrowSchema *) args[ 0];
+    struct ArrowArray  *a = (struct ArrowArray  *) args[ 1];
+
+    /* Whatever was not moved by the import. */
+    if (s->release != NULL)
+        s->release( s);
+    if (a->release != NULL)
+        a->release( a);
+    return Qnil;
+}
+
+
+void
+Init_pgsql_arrow( void)
+{
+#ifdef RDOC_NEEDS_THIS
+    rb_cPgResult = rb_define_class_under( rb_mPg, "Result", rb_cObject);
+#endif
+
+    rb_define_method( rb_cPgResult, "export_arrow", &pgresult_export_arrow, 2);
+    rb_define_method( rb_cPgResult, "to_arrow", &pgresult_to_arrow, 0);
+
+    id_import = rb_intern( "import");
+}
+
@@ -0,0 +1,54 @@
+/*
+ *  arrow.h  --  Apache Arrow C Data Interface export
+ */
+
+#ifndef __ARROW_H
+#define __ARROW_H
+
+#include "result.h"
+
+#include <stdint.h>
+
+
+#ifndef ARROW_C_DATA_INTERFACE
+#define ARROW_C_DATA_INTERFACE
+
+#define ARROW_FLAG_DICTIONARY_ORDERED 1
+#define ARROW_FLAG_NULLABLE 2
+#define ARROW_FLAG_MAP_KEYS_SORTED 4
+
+struct ArrowSchema {
+    const char *format;
+    const char *name;
+    const char *metadata;
+    int64_t flags;
+    int64_t n_children;
+    struct ArrowSchema **children;
+    struct ArrowSchema *dictionary;
+    void (*release)( struct ArrowSchema *);
+    void *private_data;
+};
+
+struct ArrowArray {
+    int64_t length;
+    int64_t null_count;
+    int64_t offset;
+    int64_t n_buffers;
+    int64_t n_children;
+    const void **buffers;
+    struct ArrowArray **children;
+    struct ArrowArray *dictionary;
+    void (*release)( struct ArrowArray *);
+    void *private_data;
+};
+
+#endif
+
+
+extern void pg_arrow_export( struct pgresult_data *r,
+                             struct ArrowSchema *schema, struct ArrowArray *array);
+
+extern void Init_pgsql_arrow( void);
+
+#endif
+
@@ -0,0 +1,687 @@
+/*
+ *  binary.c  --  PostgreSQL binary representation of values
+ */
+
+
+#include "binary.h"
+
+#include "conn_quote.h"
+#include "result.h"
+#include "json.h"
+
+#include <math.h>
+
+
+#define POSTGRES_EPOCH_JDATE   2451545
+#define POSTGRES_EPOCH_UNIX    946684800LL
+#define USECS_PER_SEC          1000000LL
+
+#define NUMERIC_POS            0x0000
+#define NUMERIC_NEG            0x4000
+#define NUMERIC_NAN            0xC000
+#define NUMERIC_PINF           0xD000
+#define NUMERIC_NINF           0xF000
+
+
+extern void  pg_put_int16( VALUE buf, int v);
+extern void  pg_put_int32( VALUE buf, long v);
+extern void  pg_put_int64( VALUE buf, long long v);
+
+extern VALUE pg_binary_value( struct pgconn_data *c, const char *p, int l, Oid typ, int typmod);
+static void  binary_check_len( int l, int expected);
+static VALUE binary_numeric( struct pgconn_data *c, const char *p, int l, int typmod);
+static void  numeric_group( char *g, int d);
+extern VALUE pg_binary_date( long d);
+extern VALUE pg_binary_timestamp( long long t, int tz);
+static VALUE binary_uuid( const char *p, int l);
+static VALUE binary_array( struct pgconn_data *c, const char *p, int l, int typmod);
+static VALUE binary_array_dim( struct pgconn_data *c, const char **p, const char *e,
+                                const long *dims, int ndim, Oid elem, int typmod);
+
+extern void  pg_binary_put( VALUE conn, VALUE buf, VALUE obj, Oid typ);
+extern void  pg_binary_put_row( VALUE conn, VALUE buf, VALUE ary, VALUE types);
+static Oid   binary_guess_type( VALUE obj);
+static void  binary_put_numeric( VALUE buf, VALUE obj);
+static void  binary_put_numeric_str( VALUE buf, const char *s, long l);
+static void  binary_put_date( VALUE buf, VALUE obj);
+static void  binary_put_timestamp( VALUE buf, VALUE obj, int tz);
+
+
+const long long pg_pow10[ 19] = {
+    1LL,                   10LL,                   100LL,
+    1000LL,                10000LL,                100000LL,
+    1000000LL,             10000000LL,             100000000LL,
+    1000000000LL,          10000000000LL,          100000000000LL,
+    1000000000000LL,       10000000000000LL,       100000000000000LL,
+    1000000000000000LL,    10000000000000000LL,    100000000000000000LL,
+    1000000000000000000LL
+};
+
+const char pg_binary_header[ PG_BINARY_HEADER_LEN] =
+    "PGCOPY\n\377\r\n\0" "\0\0\0\0" "\0\0\0\0";
+
+static VALUE rb_cBigDecimal;
+
+static ID id_jd;
+static ID id_to_s;
+static ID id_to_time;
+static ID id_to_date;
+static ID id_utc_offset;
+
+
+
+void
+pg_put_int16( VALUE buf, int v)
+{
+    char b[ 2];
+
+    b[ 0] = (v >> 8) & 0xff;
+    b[ 1] =  v       & 0xff;
+    rb_str_buf_cat( buf, b, sizeof b);
+}
+
+void
+pg_put_int32( VALUE buf, long v)
+{
+    char b[ 4];
+
+    b[ 0] = (v >> 24) & 0xff;
+    b[ 1] = (v >> 16) & 0xff;
+    b[ 2] = (v >>  8) & 0xff;
+    b[ 3] =  v        & 0xff;
+    rb_str_buf_cat( buf, b, sizeof b);
+}
+
+void
+pg_put_int64( VALUE buf, long long v)
+{
+    pg_put_int32( buf, (long) (v >> 32));
+    pg_put_int32( buf, (long) (v & 0xffffffffLL));
+}
+
+
+
+/*
+ * Make a Ruby object out of a value in PostgreSQL's binary
+ * representation.  Types that are not known here will be returned as
+ * binary Strings.
+ */
+VALUE
+pg_binary_value( struct pgconn_data *c, const char *p, int l, Oid typ, int typmod)
+{
+    switch (typ) {
+    case BOOLOID:
+        binary_check_len( l, 1);
+        return *p ? Qtrue : Qfalse;
+    case INT2OID:
+        binary_check_len( l, 2);
+        return INT2FIX( pg_get_int16( p));
+    case INT4OID:
+        binary_check_len( l, 4);
+        return LONG2NUM( pg_get_int32( p));
+    case OIDOID:
+        binary_check_len( l, 4);
+        return ULONG2NUM( (unsigned long) pg_get_int32( p) & 0xffffffffUL);
+    case INT8OID:
+        binary_check_len( l, 8);
+        return LL2NUM( pg_get_int64( p));
+    case FLOAT4OID:
+        {
+            union { int i; float f; } u;
+
+            binary_check_len( l, 4);
+            u.i = (int) pg_get_int32( p);
+            return rb_float_new( u.f);
+        }
+    case FLOAT8OID:
+        {
+            union { long long i; double f; } u;
+
+            binary_check_len( l, 8);
+            u.i = pg_get_int64( p);
+            return rb_float_new( u.f);
+        }
+    case NUMERICOID:
+        return binary_numeric( c, p, l, typmod);
+    case DATEOID:
+        binary_check_len( l, 4);
+        return pg_binary_date( pg_get_int32( p));
+    case TIMESTAMPOID:
+    case TIMESTAMPTZOID:
+        binary_check_len( l, 8);
+        return pg_binary_timestamp( pg_get_int64( p), typ == TIMESTAMPTZOID);
+    case UUIDOID:
+        return binary_uuid( p, l);
+    case TEXTOID:
+    case VARCHAROID:
+    case BPCHAROID:
+    case NAMEOID:
+        return pgconn_mkstringn( c, p, l);
+    case JSONBOID:
+        if (l < 1 || *p != 1)
+            rb_raise( rb_ePgError, "Unsupported jsonb format version.");
+        ++p, --l;
+        /* fall through */
+    case JSONOID:
+        if (c != NULL && c->decode_json)
+            return pg_json_parse( c, p, l);
+        return pgconn_mkstringn( c, p, l);
+    case BYTEAOID:
+        return rb_str_new( p, l);
+    default:
+        if (pg_array_element( typ) != InvalidOid)
+            return binary_array( c, p, l, typmod);
+        return rb_str_new( p, l);
+    }
+}
+
+void
+binary_check_len( int l, int expected)
+{
+    if (l != expected)
+        rb_raise( rb_ePgError, "Malformed binary value (length %d, expected %d).",
+                                l, expected);
+}
+
+VALUE
+binary_numeric( struct pgconn_data *c, const char *p, int l, int typmod)
+{
+    int ndigits, weight, sign, dscale;
+    VALUE str;
+    char *s, *b;
+    int i, n;
+
+    if (l < 8)
+        binary_check_len( l, 8);
+    ndigits = pg_get_int16( p);
+    weight  = pg_get_int16( p + 2);
+    sign    = pg_get_int16( p + 4) & 0xffff;
+    dscale  = pg_get_int16( p + 6);
+    if (ndigits < 0 || l != 8 + 2 * ndigits || dscale < 0)
+        binary_check_len( l, 8 + 2 * (ndigits > 0 ? ndigits : 0));
+    p += 8;
+
+    switch (sign) {
+    case NUMERIC_NAN:  return pg_numeric_text( c, "NaN",       3, -1);
+    case NUMERIC_PINF: return pg_numeric_text( c, "Infinity",  8, -1);
+    case NUMERIC_NINF: return pg_numeric_text( c, "-Infinity", 9, -1);
+    default:           break;
+    }
+
+    /* Small enough to skip the text representation. */
+    if (4 * (weight + 1) + dscale <= 18) {
+        long long m;
+        VALUE r;
+        int e;
+
+        for (m = 0, i = 0; i < ndigits; ++i) {
+            e = 4 * (weight - i) + dscale;
+            if (e >= 0)
+                m += pg_get_int16( p + 2 * i) * pg_pow10[ e];
+            else if (e > -4)
+                m += pg_get_int16( p + 2 * i) / pg_pow10[ -e];
+        }
+        if (sign == NUMERIC_NEG)
+            m = -m;
+        r = pg_numeric_value( c, m, dscale, typmod);
+        if (r != Qundef)
+            return r;
+    }
+
+    n = (weight >= 0 ? (weight + 1) * 4 : 1) + dscale + 8;
+    str = rb_str_buf_new( n);
+    b = s = RSTRING_PTR( str);
+    if (sign == NUMERIC_NEG)
+        *s++ = '-';
+    if (weight < 0)
+        *s++ = '0';
+    else
+        for (i = 0; i <= weight; ++i) {
+            char g[ 4];
+            int k;
+
+            numeric_group( g, i < ndigits ? pg_get_int16( p + 2 * i) : 0);
+            for (k = 0; i == 0 && k < 3 && g[ k] == '0'; ++k)
+                ;
+            memcpy( s, g + k, 4 - k);
+            s += 4 - k;
+        }
+    if (dscale > 0) {
+        *s++ = '.';
+        for (i = weight + 1, n = dscale; n > 0; ++i, n -= 4) {
+            char g[ 4];
+
+            numeric_group( g, i >= 0 && i < ndigits ? pg_get_int16( p + 2 * i) : 0);
+            memcpy( s, g, n < 4 ? n : 4);
+            s += n < 4 ? n : 4;
+        }
+    }
+    *s = '\0';
+    {
+        VALUE r;
+
+        r = pg_numeric_text( c, b, s - b, typmod);
+        RB_GC_GUARD( str);
+        return r;
+    }
+}
+
+void
+numeric_group( char *g, int d)
+{
+    int k;
+
+    for (k = 3; k >= 0; --k, d /= 10)
+        g[ k] = '0' + d % 10;
+}
+
+VALUE
+pg_binary_date( long d)
+{
+    if (d == 0x7fffffffL)
+        return rb_float_new( HUGE_VAL);
+    if (d == -0x7fffffffL - 1)
+        return rb_float_new( -HUGE_VAL);
+    return rb_funcall( rb_cDate, id_jd, 1, LONG2NUM( d + POSTGRES_EPOCH_JDATE));
+}
+
+VALUE
+pg_binary_timestamp( long long t, int tz)
+{
+    struct timespec ts;
+    long long s, u;
+
+    if (t == 0x7fffffffffffffffLL)
+        return rb_float_new( HUGE_VAL);
+    if (t == -0x7fffffffffffffffLL - 1)
+        return rb_float_new( -HUGE_VAL);
+    s = t / USECS_PER_SEC;
+    u = t % USECS_PER_SEC;
+    if (u < 0)
+        u += USECS_PER_SEC, --s;
+    ts.tv_sec  = (time_t) (s + POSTGRES_EPOCH_UNIX);
+    ts.tv_nsec = (long) u * 1000;
+    return rb_time_timespec_new( &ts, tz ? INT_MAX : INT_MAX - 1);
+}
+
+VALUE
+binary_uuid( const char *p, int l)
+{
+    static const char hex[] = "0123456789abcdef";
+    char b[ 36], *s;
+    int i;
+
+    binary_check_len( l, 16);
+    for (s = b, i = 0; i < 16; ++i) {
+        if (i == 4 || i == 6 || i == 8 || i == 10)
+            *s++ = '-';
+        *s++ = hex[ (p[ i] >> 4) & 0xf];
+        *s++ = hex[  p[ i]       & 0xf];
+    }
+    return rb_usascii_str_new( b, sizeof b);
+}
+
+
+#define ARRAY_MAXDIM  6
+
+VALUE
+binary_array( struct pgconn_data *c, const char *p, int l, int typmod)
+{
+    long dims[ ARRAY_MAXDIM];
+    int ndim, i;
+    Oid elem;
+    const char *e;
+    VALUE r;
+
+    if (l < 12)
+        binary_check_len( l, 12);
+    ndim = pg_get_int32( p);
+    elem = (Oid) pg_get_int32( p + 8);
+    if (ndim < 0 || ndim > ARRAY_MAXDIM || l < 12 + 8 * ndim)
+        rb_raise( rb_ePgError, "Malformed binary array.");
+    if (ndim == 0)
+        return rb_ary_new();
+    for (i = 0; i < ndim; ++i)
+        dims[ i] = pg_get_int32( p + 12 + 8 * i);
+    e = p + l;
+    p += 12 + 8 * ndim;
+    r = binary_array_dim( c, &p, e, dims, ndim, elem, typmod);
+    if (p != e)
+        rb_raise( rb_ePgError, "Malformed binary array.");
+    return r;
+}
+
+VALUE
+binary_array_dim( struct pgconn_data *c, const char **p, const char *e,
+                    const long *dims, int ndim, Oid elem, int typmod)
+{
+    VALUE ary;
+    long i;
+    int len;
+
+    ary = rb_ary_new2( *dims);
+    for (i = 0; i < *dims; ++i) {
+        if (ndim > 1) {
+            rb_ary_push( ary, binary_array_dim( c, p, e, dims + 1, ndim - 1, elem, typmod));
+            continue;
+        }
+        if (e - *p < 4)
+            rb_raise( rb_ePgError, "Malformed binary array.");
+        len = pg_get_int32( *p);
+        *p += 4;
+        if (len < 0) {
+            rb_ary_push( ary, Qnil);
+            continue;
+        }
+        if (e - *p < len)
+            rb_raise( rb_ePgError, "Malformed binary array.");
+        rb_ary_push( ary, pg_binary_value( c, *p, len, elem, typmod));
+        *p += len;
+    }
+    return ary;
+}
+
+
+
+/*
+ * Append a value in binary representation, preceded by its length,
+ * to +buf+.  If +typ+ is +InvalidOid+, the type will be guessed from the
+ * object's class.
+ */
+void
+pg_binary_put( VALUE conn, VALUE buf, VALUE obj, Oid typ)
+{
+    if (NIL_P( obj)) {
+        pg_put_int32( buf, -1);
+        return;
+    }
+    if (typ == InvalidOid)
+        typ = binary_guess_type( obj);
+    switch (typ) {
+    case BOOLOID:
+        pg_put_int32( buf, 1);
+        rb_str_buf_cat( buf, RTEST( obj) ? "\1" : "\0", 1);
+        break;
+    case INT2OID:
+        pg_put_int32( buf, 2);
+        pg_put_int16( buf, NUM2SHORT( obj));
+        break;
+    case INT4OID:
+        pg_put_int32( buf, 4);
+        pg_put_int32( buf, NUM2INT( obj));
+        break;
+    case OIDOID:
+        pg_put_int32( buf, 4);
+        pg_put_int32( buf, (long) NUM2UINT( obj));
+        break;
+    case INT8OID:
+        pg_put_int32( buf, 8);
+        pg_put_int64( buf, NUM2LL( obj));
+        break;
+    case FLOAT4OID:
+        {
+            union { int i; float f; } u;
+
+            u.f = (float) NUM2DBL( obj);
+            pg_put_int32( buf, 4);
+            pg_put_int32( buf, u.i);
+        }
+        break;
+    case FLOAT8OID:
+        {
+            union { long long i; double f; } u;
+
+            u.f = NUM2DBL( obj);
+            pg_put_int32( buf, 8);
+            pg_put_int64( buf, u.i);
+        }
+        break;
+    case NUMERICOID:
+        binary_put_numeric( buf, obj);
+        break;
+    case DATEOID:
+        binary_put_date( buf, obj);
+        break;
+    case TIMESTAMPOID:
+    case TIMESTAMPTZOID:
+        binary_put_timestamp( buf, obj, typ == TIMESTAMPTZOID);
+        break;
+    case BYTEAOID:
+        StringValue( obj);
+        pg_put_int32( buf, RSTRING_LEN( obj));
+        rb_str_buf_cat( buf, RSTRING_PTR( obj), RSTRING_LEN( obj));
+        break;
+    default:
+        {
+            VALUE s;
+
+            s = pgconn_encode_in4out( get_pgconn( conn), pgconn_stringize( conn, obj));
+            pg_put_int32( buf, RSTRING_LEN( s));
+            rb_str_buf_cat( buf, RSTRING_PTR( s), RSTRING_LEN( s));
+        }
+        break;
+    }
+}
+
+/*
+ * Append a binary COPY tuple.  +types+ may be an array of OIDs or +nil+.
+ */
+void
+pg_binary_put_row( VALUE conn, VALUE buf, VALUE ary, VALUE types)
+{
+    VALUE a;
+    long i, l;
+
+    a = rb_check_array_type( ary);
+    if (NIL_P( a))
+        rb_raise( rb_eArgError, "Row is not an array.");
+    l = RARRAY_LEN( a);
+    pg_put_int16( buf, (int) l);
+    for (i = 0; i < l; ++i) {
+        VALUE t;
+
+        t = NIL_P( types) ? Qnil : rb_ary_entry( types, i);
+        pg_binary_put( conn, buf, RARRAY_AREF( a, i), NIL_P( t) ? InvalidOid : NUM2UINT( t));
+    }
+}
+
+Oid
+binary_guess_type( VALUE obj)
+{
+    switch (TYPE( obj)) {
+    case T_TRUE:
+    case T_FALSE:
+        return BOOLOID;
+    case T_FIXNUM:
+    case T_BIGNUM:
+        return INT8OID;
+    case T_FLOAT:
+        return FLOAT8OID;
+    case T_STRING:
+        return TEXTOID;
+    default:
+        break;
+    }
+    if (rb_obj_is_kind_of( obj, rb_cTime))
+        return TIMESTAMPTZOID;
+    if (rb_obj_is_kind_of( obj, rb_cDateTime))
+        return TIMESTAMPTZOID;
+    if (rb_obj_is_kind_of( obj, rb_cDate))
+        return DATEOID;
+    if (rb_obj_is_kind_of( obj, rb_cBigDecimal))
+        return NUMERICOID;
+    return InvalidOid;
+}
+
+void
+binary_put_numeric( VALUE buf, VALUE obj)
+{
+    VALUE str;
+
+    if (rb_obj_is_kind_of( obj, rb_cBigDecimal)) {
+        VALUE f = rb_str_new2( "F");
+        str = rb_funcall( obj, id_to_s, 1, f);
+    } else if (rb_obj_is_kind_of( obj, rb_cNumeric) || TYPE( obj) == T_STRING)
+        str = rb_obj_as_string( obj);
+    else
+        rb_raise( rb_eTypeError, "Not a numeric value: %"PRIsVALUE, obj);
+    binary_put_numeric_str( buf, RSTRING_PTR( str), RSTRING_LEN( str));
+    RB_GC_GUARD( str);
+}
+
+/*
+ * Convert a decimal number like "-123.4500" or "1.5e+20" to
+ * PostgreSQL's base 10000 representation.
+ */
+void
+binary_put_numeric_str( VALUE buf, const char *s, long l)
+{
+    char *digits;
+    int n, pp, dscale, sign, weight, lead;
+    int ndigits, i, g;
+    short *groups;
+    VALUE dv, gv;
+
+    while (l && ISSPACE( *s))
+        ++s, --l;
+    while (l && ISSPACE( s[ l - 1]))
+        --l;
+
+    if (l == 3 && strncasecmp( s, "NaN", 3) == 0) {
+        pg_put_int32( buf, 8);
+        pg_put_int16( buf, 0); pg_put_int16( buf, 0);
+        pg_put_int16( buf, NUMERIC_NAN); pg_put_int16( buf, 0);
+        return;
+    }
+    sign = NUMERIC_POS;
+    if (l && (*s == '-' || *s == '+')) {
+        if (*s == '-')
+            sign = NUMERIC_NEG;
+        ++s, --l;
+    }
+    if (l == 8 && strncasecmp( s, "Infinity", 8) == 0) {
+        pg_put_int32( buf, 8);
+        pg_put_int16( buf, 0); pg_put_int16( buf, 0);
+        pg_put_int16( buf, sign == NUMERIC_NEG ? NUMERIC_NINF : NUMERIC_PINF);
+        pg_put_int16( buf, 0);
+        return;
+    }
+
+    digits = ALLOCV_N( char, dv, l + 1);
+    n = 0, pp = -1;
+    for (; l && (ISDIGIT( *s) || *s == '.'); ++s, --l) {
+        if (*s == '.') {
+            if (pp >= 0)
+                break;
+            pp = n;
+        } else
+            digits[ n++] = *s - '0';
+    }
+    if (pp < 0)
+        pp = n;
+    dscale = n - pp;
+    if (l && (*s == 'e' || *s == 'E')) {
+        char *e;
+        long x;
+
+        x = strtol( s + 1, &e, 10);
+        l -= e - s, s = e;
+        pp += x;
+        dscale -= x;
+    }
+    if (n == 0 || l > 0) {
+        ALLOCV_END( dv);
+        rb_raise( rb_eArgError, "Not a numeric value.");
+    }
+    if (dscale < 0)
+        dscale = 0;
+
+    while (n && *digits == 0)
+        ++digits, --n, --pp;
+    while (n && digits[ n - 1] == 0)
+        --n;
+    if (n == 0) {
+        pg_put_int32( buf, 8);
+        pg_put_int16( buf, 0); pg_put_int16( buf, 0);
+        pg_put_int16( buf, NUMERIC_POS); pg_put_int16( buf, dscale);
+        ALLOCV_END( dv);
+        return;
+    }
+
+    /* The first digit has the power pp-1; find its base 10000 group. */
+    weight = (pp - 1 >= 0) ? (pp - 1) / 4 : -((-(pp - 1) + 3) / 4);
+    lead = 4 * weight + 3 - (pp - 1);
+    ndigits = (lead + n + 3) / 4;
+    groups = ALLOCV_N( short, gv, ndigits > 0 ? ndigits : 1);
+    for (i = 0, g = 0; i < ndigits * 4; ++i) {
+        int k = i - lead;
+        g = g * 10 + (k >= 0 && k < n ? digits[ k] : 0);
+        if (i % 4 == 3)
+            groups[ i / 4] = g, g = 0;
+    }
+    while (ndigits && groups[ ndigits - 1] == 0)
+        --ndigits;
+
+    pg_put_int32( buf, 8 + 2 * ndigits);
+    pg_put_int16( buf, ndigits);
+    pg_put_int16( buf, weight);
+    pg_put_int16( buf, sign);
+    pg_put_int16( buf, dscale);
+    for (i = 0; i < ndigits; ++i)
+        pg_put_int16( buf, groups[ i]);
+    ALLOCV_END( gv);
+    ALLOCV_END( dv);
+}
+
+void
+binary_put_date( VALUE buf, VALUE obj)
+{
+    long d;
+
+    if (TYPE( obj) == T_FLOAT && isinf( RFLOAT_VALUE( obj)))
+        d = RFLOAT_VALUE( obj) > 0 ? 0x7fffffffL : -0x7fffffffL - 1;
+    else {
+        if (!rb_obj_is_kind_of( obj, rb_cDate))
+            obj = rb_funcall( obj, id_to_date, 0);
+        d = NUM2LONG( rb_funcall( obj, id_jd, 0)) - POSTGRES_EPOCH_JDATE;
+    }
+    pg_put_int32( buf, 4);
+    pg_put_int32( buf, d);
+}
+
+void
+binary_put_timestamp( VALUE buf, VALUE obj, int tz)
+{
+    long long t;
+
+    if (TYPE( obj) == T_FLOAT && isinf( RFLOAT_VALUE( obj)))
+        t = RFLOAT_VALUE( obj) > 0 ? 0x7fffffffffffffffLL : -0x7fffffffffffffffLL - 1;
+    else {
+        struct timespec ts;
+
+        if (!rb_obj_is_kind_of( obj, rb_cTime))
+            obj = rb_funcall( obj, id_to_time, 0);
+        ts = rb_time_timespec( obj);
+        t = ((long long) ts.tv_sec - POSTGRES_EPOCH_UNIX) * USECS_PER_SEC + ts.tv_nsec / 1000;
+        if (!tz)
+            t += NUM2LL( rb_funcall( obj, id_utc_offset, 0)) * USECS_PER_SEC;
+    }
+    pg_put_int32( buf, 8);
+    pg_put_int64( buf, t);
+}
+
+
+
+void
+Init_pgsql_binary( void)
+{
+    rb_cBigDecimal = rb_const_get( rb_cObject, rb_intern( "BigDecimal"));
+    rb_global_variable( &rb_cBigDecimal);
+
+    id_jd         = rb_intern( "jd");
+    id_to_s       = rb_intern( "to_s");
+    id_to_time    = rb_intern( "to_time");
+    id_to_date    = rb_intern( "to_date");
+    id_utc_offset = rb_intern( "utc_offset");
+}
+
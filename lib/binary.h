@@ -0,0 +1,56 @@
+/*
+ *  binary.h  --  PostgreSQL binary representation of values
+ */
+
+#ifndef __BINARY_H
+#define __BINARY_H
+
+#include "conn.h"
+
+
+#define PG_BINARY_HEADER_LEN  19
+
+
+static inline int
+pg_get_int16( const char *p)
+{
+    return (short) (((unsigned char) p[ 0] << 8) | (unsigned char) p[ 1]);
+}
+
+static inline long
+pg_get_int32( const char *p)
+{
+    return (int) (((unsigned long) (unsigned char) p[ 0] << 24) |
+                  ((unsigned long) (unsigned char) p[ 1] << 16) |
+                  ((unsigned long) (unsigned char) p[ 2] <<  8) |
+                   (unsigned long) (unsigned char) p[ 3]);
+}
+
+static inline long long
+pg_get_int64( const char *p)
+{
+    return (long long) (((unsigned long long) (unsigned long) pg_get_int32( p) << 32) |
+                        ((unsigned long long) pg_get_int32( p + 4) & 0xffffffffULL));
+}
+
+
+extern const long long pg_pow10[ 19];
+
+
+extern void  pg_put_int16( VALUE buf, int v);
+extern void  pg_put_int32( VALUE buf, long v);
+extern void  pg_put_int64( VALUE buf, long long v);
+
+extern VALUE pg_binary_value( struct pgconn_data *c, const char *p, int l, Oid typ, int typmod);
+extern VALUE pg_binary_date( long d);
+extern VALUE pg_binary_timestamp( long long t, int tz);
+extern void  pg_binary_put( VALUE conn, VALUE buf, VALUE obj, Oid typ);
+extern void  pg_binary_put_row( VALUE conn, VALUE buf, VALUE ary, VALUE types);
+
+extern const char pg_binary_header[ PG_BINARY_HEADER_LEN];
+
+
+extern void Init_pgsql_binary( void);
+
+#endif
+
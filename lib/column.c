@@ -0,0 +1,427 @@
+/*
+ *  column.c  --  Column-wise access to results
+ */
+
+
+#include "column.h"
+
+#include "binary.h"
+#include "conn_exec.h"
+
+#include <string.h>
+#include <limits.h>
+
+
+extern int  pg_result_column( struct pgresult_data *r, VALUE col);
+extern long pg_column_int64(   struct pgresult_data *r, int col,
+                                long long *v, unsigned char *valid);
+extern long pg_column_float64( struct pgresult_data *r, int col,
+                                double *v, unsigned char *valid);
+static int  parse_int64( const char *s, int l, long long *v);
+static double binary_float64( const char *p, Oid typ);
+
+static VALUE pgresult_column( VALUE self, VALUE col);
+static VALUE column_values( struct pgresult_data *r, struct pgconn_data *c, int col);
+static VALUE pgresult_columns( VALUE self);
+static VALUE pgresult_column_packed( VALUE self, VALUE col, VALUE type);
+static VALUE pgresult_pluck( int argc, VALUE *argv, VALUE self);
+static VALUE pgresult_values_at( int argc, VALUE *argv, VALUE self);
+static VALUE result_pluck( VALUE res, int argc, const VALUE *argv, int flat);
+
+static VALUE pgconn_pluck( int argc, VALUE *argv, VALUE self);
+static VALUE pluck_run( VALUE args);
+
+
+static VALUE sym_int64;
+static VALUE sym_float64;
+
+
+
+/*
+ * A column number from an Integer or a field name.
+ */
+int
+pg_result_column( struct pgresult_data *r, VALUE col)
+{
+    int n;
+
+    if (RB_INTEGER_TYPE_P( col)) {
+        n = NUM2INT( col);
+        if (n < 0)
+            n += PQnfields( r->res);
+        if (n < 0 || n >= PQnfields( r->res))
+            rb_raise( rb_eIndexError, "Column index %d out of range.", NUM2INT( col));
+        return n;
+    }
+    if (SYMBOL_P( col))
+        col = rb_sym2str( col);
+    StringValue( col);
+    n = PQfnumber( r->res, pgconn_destring( get_pgconn( r->conn), col, NULL));
+    if (n == -1)
+        rb_raise( rb_eArgError, "Unknown field: %s", RSTRING_PTR( col));
+    return n;
+}
+
+/*
+ * Fill +v+ with the column's values as 64 bit integers and set the bits
+ * of +valid+ for the non-null ones, least significant bit first.  NULLs
+ * become 0.  Return the number of NULLs.
+ *
+ * Integer columns are read directly from the result buffer.  Other types
+ * go through the Ruby object, which must be an Integer then.
+ */
+long
+pg_column_int64( struct pgresult_data *r, int col, long long *v, unsigned char *valid)
+{
+    struct pgconn_data *c;
+    Oid typ;
+    int bin, m, j;
+    long nulls;
+    const char *p;
+
+    c   = get_pgconn( r->conn);
+    typ = PQftype( r->res, col);
+    bin = PQfformat( r->res, col);
+    m   = PQntuples( r->res);
+    memset( valid, 0, (m + 7) / 8);
+    for (nulls = 0, j = 0; j < m; ++j) {
+        if (PQgetisnull( r->res, j, col)) {
+            v[ j] = 0;
+            ++nulls;
+            continue;
+        }
+        valid[ j >> 3] |= 1 << (j & 7);
+        p = PQgetvalue( r->res, j, col);
+        switch (bin ? typ : InvalidOid) {
+        case INT2OID: v[ j] = pg_get_int16( p);                          continue;
+        case INT4OID: v[ j] = pg_get_int32( p);                          continue;
+        case OIDOID:  v[ j] = (unsigned int) pg_get_int32( p);           continue;
+        case INT8OID: v[ j] = pg_get_int64( p);                          continue;
+        default:      break;
+        }
+        if (!bin && (typ == INT2OID || typ == INT4OID || typ == INT8OID ||
+                     typ == OIDOID)) {
+            if (!parse_int64( p, PQgetlength( r->res, j, col), v + j))
+                rb_raise( rb_ePgError, "Malformed integer value: %s", p);
+            continue;
+        }
+        v[ j] = NUM2LL( pg_fetchcell( r, c, j, col));
+    }
+    return nulls;
+}
+
+/*
+ * The same for double precision values.  Text values of numeric types
+ * are converted by strtod(3), so no +BigDecimal+ gets created.
+ */
+long
+pg_column_float64( struct pgresult_data *r, int col, double *v, unsigned char *valid)
+{
+    struct pgconn_data *c;
+    Oid typ;
+    int bin, m, j, text;
+    long nulls;
+    const char *p;
+    char *e;
+
+    c   = get_pgconn( r->conn);
+    typ = PQftype( r->res, col);
+    bin = PQfformat( r->res, col);
+    m   = PQntuples( r->res);
+    switch (typ) {
+    case FLOAT4OID: case FLOAT8OID: case NUMERICOID:
+    case INT2OID:   case INT4OID:   case INT8OID:    case OIDOID:
+        text = !bin;
+        break;
+    default:
+        text = 0;
+        break;
+    }
+    memset( valid, 0, (m + 7) / 8);
+    for (nulls = 0, j = 0; j < m; ++j) {
+        if (PQgetisnull( r->res, j, col)) {
+            v[ j] = 0.0;
+            ++nulls;
+            continue;
+        }
+        valid[ j >> 3] |= 1 << (j & 7);
+        p = PQgetvalue( r->res, j, col);
+        if (text) {
+            v[ j] = strtod( p, &e);
+            if (e == p || *e != '\0')
+                rb_raise( rb_ePgError, "Malformed numeric value: %s", p);
+        } else if (bin && (typ == FLOAT4OID ||
+                        typ == FLOAT8OID || typ == INT2OID ||
+                        typ == INT4OID || typ == INT8OID || typ == OIDOID))
+            v[ j] = binary_float64( p, typ);
+        else
+            v[ j] = NUM2DBL( pg_fetchcell( r, c, j, col));
+    }
+    return nulls;
+}
+
+int
+parse_int64( const char *s, int l, long long *v)
+{
+    const char *p, *e;
+    unsigned long long u, lim;
+    int neg;
+
+    p = s, e = s + l;
+    neg = p < e && *p == '-';
+    if (neg)
+        ++p;
+    if (p >= e)
+        return 0;
+    lim = neg ? (unsigned long long) LLONG_MAX + 1 : LLONG_MAX;
+    for (u = 0; p < e; ++p) {
+        if (*p < '0' || *p > '9' || u > (lim - (*p - '0')) / 10)
+            return 0;
+        u = u * 10 + (*p - '0');
+    }
+    *v = neg ? (long long) (0 - u) : (long long) u;
+    return 1;
+}
+
+double
+binary_float64( const char *p, Oid typ)
+{
+    union { unsigned long long i; double d; } d;
+    union { unsigned int i; float f; } f;
+
+    switch (typ) {
+    case FLOAT8OID:
+        d.i = (unsigned long long) pg_get_int64( p);
+        return d.d;
+    case FLOAT4OID:
+        f.i = (unsigned int) pg_get_int32( p);
+        return f.f;
+    case INT2OID:
+        return pg_get_int16( p);
+    case INT4OID:
+        return pg_get_int32( p);
+    case OIDOID:
+        return (unsigned int) pg_get_int32( p);
+    default:
+        return (double) pg_get_int64( p);
+    }
+}
+
+
+/*
+ * call-seq:
+ *    res.column( n)      ->  ary
+ *    res.column( name)   ->  ary
+ *
+ * All values of one column.
+ *
+ *   res = conn.exec "SELECT x, x * 2 AS y FROM generate_series( 1, 3) x;"
+ *   res.column "y"       #=> [2, 4, 6]
+ */
+VALUE
+pgresult_column( VALUE self, VALUE col)
+{
+    struct pgresult_data *r;
+
+    TypedData_Get_Struct( self, struct pgresult_data, &pgresult_data_data_type, r);
+    return column_values( r, get_pgconn( r->conn), pg_result_column( r, col));
+}
+
+VALUE
+column_values( struct pgresult_data *r, struct pgconn_data *c, int col)
+{
+    VALUE ary;
+    int m, j;
+
+    m = PQntuples( r->res);
+    ary = rb_ary_new_capa( m);
+    for (j = 0; j < m; ++j)
+        rb_ary_push( ary, pg_fetchcell( r, c, j, col));
+    return ary;
+}
+
+/*
+ * call-seq:
+ *    res.columns   ->  ary
+ *
+ * One array per column, the transposed Pg::Result#rows.  Every column is
+ * decoded in one go.
+ */
+VALUE
+pgresult_columns( VALUE self)
+{
+    struct pgresult_data *r;
+    struct pgconn_data *c;
+    VALUE ary;
+    int n, i;
+
+    TypedData_Get_Struct( self, struct pgresult_data, &pgresult_data_data_type, r);
+    c = get_pgconn( r->conn);
+    n = PQnfields( r->res);
+    ary = rb_ary_new_capa( n);
+    for (i = 0; i < n; ++i)
+        rb_ary_push( ary, column_values( r, c, i));
+    return ary;
+}
+
+/*
+ * call-seq:
+ *    res.column_packed( col, :int64)     ->  [ str, validity]
+ *    res.column_packed( col, :float64)   ->  [ str, validity]
+ *
+ * A column's values as native 64 bit integers resp. doubles packed
+ * into a binary string, without creating a Ruby object per value.
+ * +validity+ is a bitmap of the non-null values, least significant bit
+ * first as Apache Arrow has it, or +nil+ if there are no NULLs.  NULLs
+ * are stored as zero.
+ *
+ *   data, valid = res.column_packed "amount", :float64
+ *   Numo::DFloat.from_binary data
+ *   IO::Buffer.for data do |b| ... end
+ */
+VALUE
+pgresult_column_packed( VALUE self, VALUE col, VALUE type)
+{
+    struct pgresult_data *r;
+    int i, m;
+    long nulls;
+    VALUE data, valid;
+
+    TypedData_Get_Struct( self, struct pgresult_data, &pgresult_data_data_type, r);
+    i = pg_result_column( r, col);
+    if (type != sym_int64 && type != sym_float64)
+        rb_raise( rb_eArgError, "Unknown packed type: %"PRIsVALUE".", type);
+    m = PQntuples( r->res);
+    data  = rb_str_new( NULL, (long) m * 8);
+    valid = rb_str_new( NULL, (m + 7) / 8);
+    if (type == sym_int64)
+        nulls = pg_column_int64( r, i, (long long *) RSTRING_PTR( data),
+                                 (unsigned char *) RSTRING_PTR( valid));
+    else
+        nulls = pg_column_float64( r, i, (double *) RSTRING_PTR( data),
+                                   (unsigned char *) RSTRING_PTR( valid));
+    return rb_assoc_new( data, nulls > 0 ? valid : Qnil);
+}
+
+
+/*
+ * call-seq:
+ *    res.pluck( col)           ->  ary
+ *    res.pluck( col, *cols)    ->  ary of arys
+ *
+ * The values of some columns over all rows, given as numbers or names.
+ * Only these columns are decoded.  With one column the result is flat,
+ * like Pg::Result#column; with more, every row is an array of the
+ * values.  No columns means all of them.
+ *
+ *   res = conn.exec "SELECT id, name, body FROM articles;"
+ *   res.pluck :id             #=> [ 1, 2, 3]
+ *   res.pluck :id, :name      #=> [ [ 1, "a"], [ 2, "b"], [ 3, "c"]]
+ */
+VALUE
+pgresult_pluck( int argc, VALUE *argv, VALUE self)
+{
+    return result_pluck( self, argc, argv, 1);
+}
+
+/*
+ * call-seq:
+ *    res.values_at( *cols)   ->  ary of arys
+ *
+ * Like Pg::Result#pluck but always an array per row, like
+ * <code>Hash#values_at</code> would return them.
+ */
+VALUE
+pgresult_values_at( int argc, VALUE *argv, VALUE self)
+{
+    return result_pluck( self, argc, argv, 0);
+}
+
+VALUE
+result_pluck( VALUE res, int argc, const VALUE *argv, int flat)
+{
+    struct pgresult_data *r;
+    struct pgconn_data *c;
+    int *cols, k, m, i, j;
+    VALUE ary, row, v;
+
+    TypedData_Get_Struct( res, struct pgresult_data, &pgresult_data_data_type, r);
+    c = get_pgconn( r->conn);
+    k = argc > 0 ? argc : PQnfields( r->res);
+    cols = ALLOCV_N( int, v, k > 0 ? k : 1);
+    for (i = 0; i < k; ++i)
+        cols[ i] = argc > 0 ? pg_result_column( r, argv[ i]) : i;
+    if (flat && k == 1)
+        ary = column_values( r, c, cols[ 0]);
+    else {
+        m = PQntuples( r->res);
+        ary = rb_ary_new_capa( m);
+        for (j = 0; j < m; ++j) {
+            row = rb_ary_new_capa( k);
+            for (i = 0; i < k; ++i)
+                rb_ary_push( row, pg_fetchcell( r, c, j, cols[ i]));
+            rb_ary_push( ary, row);
+        }
+    }
+    ALLOCV_END( v);
+    return ary;
+}
+
+
+/*
+ * call-seq:
+ *    conn.pluck( sql, bind_values, *cols)   ->  ary
+ *
+ * Run the query and return Pg::Result#pluck of its result.
+ * +bind_values+ is an array or +nil+.
+ *
+ *   conn.pluck "SELECT * FROM users WHERE age > $1;", [ 30], :email
+ */
+VALUE
+pgconn_pluck( int argc, VALUE *argv, VALUE self)
+{
+    VALUE cmd, par, cols;
+    VALUE res;
+
+    rb_scan_args( argc, argv, "2*", &cmd, &par, &cols);
+    StringValue( cmd);
+    if (!NIL_P( par)) {
+        par = rb_Array( par);
+        if (RARRAY_LEN( par) <= 0)
+            par = Qnil;
+    }
+    res = pg_statement_exec( self, cmd, par);
+    return rb_ensure( pluck_run, rb_assoc_new( res, cols), pgresult_clear, res);
+}
+
+VALUE
+pluck_run( VALUE args)
+{
+    VALUE cols;
+
+    cols = rb_ary_entry( args, 1);
+    return result_pluck( rb_ary_entry( args, 0),
+                         RARRAY_LENINT( cols), RARRAY_CONST_PTR( cols), 1);
+}
+
+
+void
+Init_pgsql_column( void)
+{
+#ifdef RDOC_NEEDS_THIS
+    rb_cPgConn   = rb_define_class_under( rb_mPg, "Conn", rb_cObject);
+    rb_cPgResult = rb_define_class_under( rb_mPg, "Result", rb_cObject);
+#endif
+
+    rb_define_method( rb_cPgResult, "column", &pgresult_column, 1);
+    rb_define_method( rb_cPgResult, "columns", &pgresult_columns, 0);
+    rb_define_method( rb_cPgResult, "column_packed", &pgresult_column_packed, 2);
+    rb_define_method( rb_cPgResult, "pluck", &pgresult_pluck, -1);
+    rb_define_method( rb_cPgResult, "values_at", &pgresult_values_at, -1);
+
+    rb_define_method( rb_cPgConn, "pluck", &pgconn_pluck, -1);
+
+    sym_int64   = ID2SYM( rb_intern( "int64"));
+    sym_float64 = ID2SYM( rb_intern( "float64"));
+}
+
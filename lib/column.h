@@ -0,0 +1,20 @@
+/*
+ *  column.h  --  Column-wise access to results
+ */
+
+#ifndef __COLUMN_H
+#define __COLUMN_H
+
+#include "result.h"
+
+
+extern int  pg_result_column( struct pgresult_data *r, VALUE col);
+extern long pg_column_int64(   struct pgresult_data *r, int col,
+                                long long *v, unsigned char *valid);
+extern long pg_column_float64( struct pgresult_data *r, int col,
+                                double *v, unsigned char *valid);
+
+extern void Init_pgsql_column( void);
+
+#endif
+
@@ -7,6 +7,8 @@
 
 #include "conn_quote.h"
 #include "conn_exec.h"
+#include "conn_copy.h"
+#include "conn_repl.h"
 
 #if defined( HAVE_HEADER_ST_H)
     #include <st.h>
@@ -20,7 +22,8 @@ static void   pgconn_mark( void *ptr);
 static void   pgconn_free( void *ptr);
 static size_t pgconn_memsize( const void *ptr);
 extern struct pgconn_data *get_pgconn( VALUE obj);
-static VALUE pgconn_encode_in4out( struct pgconn_data *ptr, VALUE str);
+extern VALUE pgconn_typemap( VALUE obj);
+extern VALUE pgconn_encode_in4out( struct pgconn_data *ptr, VALUE str);
 extern const char *pgconn_destring( struct pgconn_data *ptr, VALUE str, int *len);
 static VALUE pgconn_encode_out4in( struct pgconn_data *ptr, VALUE str);
 extern VALUE pgconn_mkstring( struct pgconn_data *ptr, const char *str);
@@ -57,6 +60,7 @@ static VALUE pgconn_tty(     VALUE self);
 static VALUE pgconn_user(    VALUE self);
 static VALUE pgconn_status(  VALUE self);
 static VALUE pgconn_error(   VALUE self);
+extern VALUE pg_conninfo( VALUE self);
 
 static VALUE pgconn_socket(  VALUE self);
 
@@ -66,9 +70,21 @@ static VALUE pgconn_untrace( VALUE self);
 static VALUE pgconn_on_notice( VALUE self);
 static void  notice_receiver( void *self, const PGresult *result);
 
+static VALUE pgconn_translate_results( VALUE self);
+static VALUE pgconn_set_translate_results( VALUE self, VALUE mode);
+static VALUE pgconn_translating( VALUE self, VALUE mode);
+static VALUE translating_restore( VALUE ary);
+static int   translate_mode( VALUE mode);
+static VALUE pgconn_numeric_mode( VALUE self);
+static VALUE pgconn_set_numeric_mode( VALUE self, VALUE mode);
+static VALUE pgconn_decode_json( VALUE self);
+static VALUE pgconn_set_decode_json( VALUE self, VALUE flag);
+
 
 VALUE rb_cPgConn;
 
+int pg_translate_default = PG_TRANSLATE_TYPED;
+
 static VALUE rb_ePgConnFailed;
 static VALUE rb_ePgConnInvalid;
 
@@ -77,6 +93,9 @@ static VALUE sym_password = Qundef;
 
 static ID id_to_s;
 
+static VALUE sym_translate_modes[ 3];
+static VALUE sym_numeric_modes[ 4];
+
 static const rb_data_type_t pgconn_data_data_type = {
     "pgsql:pgconn_data",
     { &pgconn_mark, &pgconn_free, &pgconn_memsize,},
@@ -114,6 +133,8 @@ pgconn_mark( void *ptr)
     rb_gc_mark( pd->internal);
 #endif
     rb_gc_mark( pd->notice);
+    rb_gc_mark( pd->type_map);
+    rb_gc_mark( pd->shapes);
 }
 
 void
@@ -141,6 +162,19 @@ get_pgconn( VALUE obj)
     return c;
 }
 
+/*
+ * The connection's type map or +nil+, without checking whether the
+ * connection is still open.
+ */
+VALUE
+pgconn_typemap( VALUE obj)
+{
+    struct pgconn_data *c;
+
+    TypedData_Get_Struct( obj, struct pgconn_data, &pgconn_data_data_type, c);
+    return c->type_map;
+}
+
 
 VALUE pgconn_encode_in4out( struct pgconn_data *ptr, VALUE str)
 {
@@ -214,6 +248,14 @@ pgconn_alloc( VALUE cls)
     c->internal = rb_enc_from_encoding( rb_default_internal_encoding());
 #endif
     c->notice  = Qnil;
+    c->translate    = pg_translate_default;
+    c->sent_translate = c->translate;
+    c->numeric_mode = PG_NUMERIC_BIGDECIMAL;
+    c->decode_json  = 0;
+    c->type_map     = Qnil;
+    c->shapes       = Qnil;
+    c->lsn_received = 0;
+    c->lsn_flushed  = 0;
     return obj;
 }
 
@@ -703,6 +745,30 @@ pgconn_error( VALUE self)
     return error == NULL ? Qnil : pgconn_mkstring( c, error);
 }
 
+/*
+ * The connection parameters in use, password included, as a hash for
+ * Pg::Conn.new.  Not a public method, because of the password.
+ */
+VALUE
+pg_conninfo( VALUE self)
+{
+    struct pgconn_data *c;
+    PQconninfoOption *opts, *o;
+    VALUE ret;
+
+    c = get_pgconn( self);
+    opts = PQconninfo( c->conn);
+    if (opts == NULL)
+        rb_raise( rb_ePgError, "Out of memory.");
+    ret = rb_hash_new();
+    for (o = opts; o->keyword != NULL; ++o)
+        if (o->val != NULL && *o->val != '\0')
+            rb_hash_aset( ret, ID2SYM( rb_intern( o->keyword)),
+                                            pgconn_mkstring( c, o->val));
+    PQconninfoFree( opts);
+    return ret;
+}
+
 
 
 /*
@@ -824,6 +890,196 @@ notice_receiver( void *self, const PGresult *result)
 
 
 
+/*
+ * call-seq:
+ *    conn.translate_results   ->  sym
+ *
+ * How result values will be returned.  See Pg::Conn#translate_results=.
+ */
+VALUE
+pgconn_translate_results( VALUE self)
+{
+    struct pgconn_data *c;
+
+    TypedData_Get_Struct( self, struct pgconn_data, &pgconn_data_data_type, c);
+    return sym_translate_modes[ c->translate];
+}
+
+/*
+ * call-seq:
+ *    conn.translate_results = sym
+ *
+ * Choose how result values will be returned.
+ *
+ *   :raw     ::  +String+ in the client encoding, no conversion to the
+ *                internal encoding (+false+ will do, too)
+ *   :typed   ::  an appropriate Ruby class (+true+, default)
+ *   :binary  ::  the same, but ask the server for binary representation.
+ *                This uses the extended query protocol, so a query
+ *                string may contain one statement only.  Pg::TypeMap
+ *                decoders do not apply, and values of types without a
+ *                binary decoder (e.g. +time+, +interval+, +inet+,
+ *                +hstore+, enums, composites) come as binary Strings.
+ *
+ * The mode in effect when a query is sent applies to its results.  The
+ * default for new connections is set by Pg::Result.translate_results=.
+ */
+VALUE
+pgconn_set_translate_results( VALUE self, VALUE mode)
+{
+    struct pgconn_data *c;
+
+    TypedData_Get_Struct( self, struct pgconn_data, &pgconn_data_data_type, c);
+    c->translate = translate_mode( mode);
+    return mode;
+}
+
+/*
+ * call-seq:
+ *    conn.translating( sym) { |conn| ... }   ->  obj
+ *
+ * Set Pg::Conn#translate_results for the block only.
+ *
+ *   conn.translating :raw do
+ *     conn.query "SELECT * FROM big_table;" do |row| csv << row end
+ *   end
+ */
+VALUE
+pgconn_translating( VALUE self, VALUE mode)
+{
+    struct pgconn_data *c;
+    VALUE ary;
+
+    TypedData_Get_Struct( self, struct pgconn_data, &pgconn_data_data_type, c);
+    ary = rb_ary_new3( 2, self, INT2FIX( c->translate));
+    c->translate = translate_mode( mode);
+    return rb_ensure( rb_yield, self, translating_restore, ary);
+}
+
+VALUE
+translating_restore( VALUE ary)
+{
+    struct pgconn_data *c;
+
+    TypedData_Get_Struct( rb_ary_entry( ary, 0), struct pgconn_data, &pgconn_data_data_type, c);
+    c->translate = FIX2INT( rb_ary_entry( ary, 1));
+    return Qnil;
+}
+
+int
+translate_mode( VALUE mode)
+{
+    int i;
+
+    if (mode == Qtrue)
+        return PG_TRANSLATE_TYPED;
+    if (!RTEST( mode))
+        return PG_TRANSLATE_RAW;
+    for (i = 0; i < 3 && sym_translate_modes[ i] != mode; ++i)
+        ;
+    if (i >= 3)
+        rb_raise( rb_eArgError, "Unknown translation mode: %"PRIsVALUE".", mode);
+    return i;
+}
+
+
+/*
+ * call-seq:
+ *    conn.numeric_mode   ->  sym
+ *
+ * How +NUMERIC+ values with decimal places will be returned.  See
+ * Pg::Conn#numeric_mode=.
+ */
+VALUE
+pgconn_numeric_mode( VALUE self)
+{
+    struct pgconn_data *c;
+
+    TypedData_Get_Struct( self, struct pgconn_data, &pgconn_data_data_type, c);
+    return sym_numeric_modes[ c->numeric_mode];
+}
+
+/*
+ * call-seq:
+ *    conn.numeric_mode = sym
+ *
+ * Choose the class +NUMERIC+ values with decimal places will be returned
+ * as.
+ *
+ *   :bigdecimal  ::  +BigDecimal+ (default)
+ *   :float       ::  +Float+, may lose precision
+ *   :rational    ::  +Rational+, exact
+ *   :scaled      ::  +Integer+ multiplied by <code>10 ** scale</code>,
+ *                    where +scale+ is the column's declared one, e.g.
+ *                    <code>12.5</code> in a <code>NUMERIC(18,4)</code>
+ *                    column becomes <code>125000</code>.  Columns
+ *                    without a declared scale stay +BigDecimal+.
+ *
+ * Columns of scale zero are always returned as +Integer+.  +NaN+ and the
+ * infinities become +Float+ values unless the mode is +:bigdecimal+.
+ * The mode in effect when a result is first read applies to that result.
+ *
+ *   conn.numeric_mode = :scaled
+ *   conn.select_value "SELECT 12.5::numeric(18,4);"   #=> 125000
+ */
+VALUE
+pgconn_set_numeric_mode( VALUE self, VALUE mode)
+{
+    struct pgconn_data *c;
+    int i;
+
+    TypedData_Get_Struct( self, struct pgconn_data, &pgconn_data_data_type, c);
+    if (NIL_P( mode))
+        i = PG_NUMERIC_BIGDECIMAL;
+    else
+        for (i = 0; i < 4 && sym_numeric_modes[ i] != mode; ++i)
+            ;
+    if (i >= 4)
+        rb_raise( rb_eArgError, "Unknown numeric mode: %"PRIsVALUE".", mode);
+    c->numeric_mode = i;
+    return mode;
+}
+
+
+/*
+ * call-seq:
+ *    conn.decode_json?   ->  true or false
+ *
+ * Whether +json+ and +jsonb+ values will be parsed.
+ */
+VALUE
+pgconn_decode_json( VALUE self)
+{
+    struct pgconn_data *c;
+
+    TypedData_Get_Struct( self, struct pgconn_data, &pgconn_data_data_type, c);
+    return c->decode_json ? Qtrue : Qfalse;
+}
+
+/*
+ * call-seq:
+ *    conn.decode_json = true or false
+ *
+ * When true, +json+ and +jsonb+ values will be returned as +Hash+,
+ * +Array+, +String+, +Integer+, +Float+, +true+, +false+ or +nil+
+ * instead of their text.  Hash keys are frozen and deduplicated.  Default
+ * is false.
+ *
+ *   conn.decode_json = true
+ *   conn.select_value %q(SELECT '{"a":[1,2.5,null]}'::jsonb;)
+ *       #=> {"a"=>[1, 2.5, nil]}
+ */
+VALUE
+pgconn_set_decode_json( VALUE self, VALUE flag)
+{
+    struct pgconn_data *c;
+
+    TypedData_Get_Struct( self, struct pgconn_data, &pgconn_data_data_type, c);
+    c->decode_json = RTEST( flag) ? 1 : 0;
+    return flag;
+}
+
+
 /*
  * Document-class: Pg::Conn::Failed
  *
@@ -914,9 +1170,28 @@ Init_pgsql_conn( void)
 
     rb_define_method( rb_cPgConn, "on_notice", &pgconn_on_notice, 0);
 
+    rb_define_method( rb_cPgConn, "translate_results", &pgconn_translate_results, 0);
+    rb_define_method( rb_cPgConn, "translate_results=", &pgconn_set_translate_results, 1);
+    rb_define_method( rb_cPgConn, "translating", &pgconn_translating, 1);
+    rb_define_method( rb_cPgConn, "numeric_mode", &pgconn_numeric_mode, 0);
+    rb_define_method( rb_cPgConn, "numeric_mode=", &pgconn_set_numeric_mode, 1);
+    rb_define_method( rb_cPgConn, "decode_json?", &pgconn_decode_json, 0);
+    rb_define_method( rb_cPgConn, "decode_json=", &pgconn_set_decode_json, 1);
+
+    sym_translate_modes[ PG_TRANSLATE_RAW]    = ID2SYM( rb_intern( "raw"));
+    sym_translate_modes[ PG_TRANSLATE_TYPED]  = ID2SYM( rb_intern( "typed"));
+    sym_translate_modes[ PG_TRANSLATE_BINARY] = ID2SYM( rb_intern( "binary"));
+
+    sym_numeric_modes[ PG_NUMERIC_BIGDECIMAL] = ID2SYM( rb_intern( "bigdecimal"));
+    sym_numeric_modes[ PG_NUMERIC_FLOAT]      = ID2SYM( rb_intern( "float"));
+    sym_numeric_modes[ PG_NUMERIC_RATIONAL]   = ID2SYM( rb_intern( "rational"));
+    sym_numeric_modes[ PG_NUMERIC_SCALED]     = ID2SYM( rb_intern( "scaled"));
+
     id_to_s = rb_intern( "to_s");
 
     Init_pgsql_conn_quote();
     Init_pgsql_conn_exec();
+    Init_pgsql_conn_copy();
+    Init_pgsql_conn_repl();
 }
 
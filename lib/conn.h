@@ -13,6 +13,18 @@
 #endif
 
 
+/* How NUMERIC values with decimal places are returned. */
+#define PG_NUMERIC_BIGDECIMAL  0
+#define PG_NUMERIC_FLOAT       1
+#define PG_NUMERIC_RATIONAL    2
+#define PG_NUMERIC_SCALED      3
+
+/* How result values are translated. */
+#define PG_TRANSLATE_RAW       0
+#define PG_TRANSLATE_TYPED     1
+#define PG_TRANSLATE_BINARY    2
+
+
 struct pgconn_data {
     PGconn *conn;
 #ifdef RUBY_ENCODING
@@ -20,17 +32,30 @@ struct pgconn_data {
     VALUE internal;
 #endif
     VALUE notice;
+    int   translate;
+    int   sent_translate;   /* for the results of Pg::Conn#send */
+    int   numeric_mode;
+    int   decode_json;
+    VALUE type_map;
+    VALUE shapes;
+    unsigned long long lsn_received;
+    unsigned long long lsn_flushed;
 };
 
 
 extern VALUE rb_cPgConn;
 
+extern int pg_translate_default;
+
 
 extern void pg_check_conninvalid( struct pgconn_data *c);
+extern VALUE pg_conninfo( VALUE self);
 
 
 extern struct pgconn_data *get_pgconn( VALUE obj);
+extern VALUE pgconn_typemap( VALUE obj);
 
+extern VALUE       pgconn_encode_in4out( struct pgconn_data *ptr, VALUE str);
 extern const char *pgconn_destring(  struct pgconn_data *ptr, VALUE str, int *len);
 extern VALUE       pgconn_mkstring(  struct pgconn_data *ptr, const char *str);
 extern VALUE       pgconn_mkstringn( struct pgconn_data *ptr, const char *str, int len);
@@ -0,0 +1,1174 @@
+/*
+ *  conn_copy.c  --  PostgreSQL connection, COPY data transfer
+ */
+
+
+#include "conn_copy.h"
+
+#include "conn_quote.h"
+#include "conn_exec.h"
+#include "result.h"
+#include "binary.h"
+
+#if defined( HAVE_HEADER_RUBY_IO_BUFFER_H)
+    #include <ruby/io/buffer.h>
+#endif
+#include <ruby/thread.h>
+
+#include <errno.h>
+#include <poll.h>
+#include <unistd.h>
+
+
+#define COPY_BUFSIZE  0x10000
+
+
+struct copy_in_data {
+    VALUE               conn;
+    struct pgconn_data *c;
+    VALUE               rows;
+    VALUE               types;
+    int                 binary;
+    VALUE               buf;
+    long                count;
+};
+
+struct copy_out_data {
+    VALUE               conn;
+    struct pgconn_data *c;
+    VALUE               cmd;
+    VALUE               describe;
+    VALUE               types;
+    int                 nfields;
+    VALUE               plan;
+    struct pg_column   *cols;   /* NULL for untyped rows */
+    int                 binary;
+    int                 header;
+    VALUE               scratch;
+    long                count;
+    int                 done;   /* all data read, nothing raised */
+};
+
+struct copy_io_data {
+    VALUE               conn;
+    struct pgconn_data *c;
+    VALUE               io;
+    VALUE               membuf;
+    PGcancel           *cancel;
+    int                 fd;
+    char               *mem;
+    long                memlen;
+    char               *buf;
+    long                chunk;
+    long                len;
+    long long           total;
+    int                 err;
+    int                 failed;
+    int                 overflow;
+    int                 done;
+    int                 locked;
+    volatile int        interrupted;
+};
+
+
+static int   pg_copy_check( VALUE res, ExecStatusType status);
+static void  pg_copy_abort( VALUE conn, ExecStatusType status);
+extern void  pg_copy_put( struct pgconn_data *c, const char *p, int l);
+extern void  pg_copy_finish( VALUE conn, const char *errormsg);
+extern int   pg_copy_start_binary( VALUE conn, VALUE res);
+
+static VALUE pgconn_copy_in( int argc, VALUE *argv, VALUE self);
+static VALUE copy_in_rows( VALUE arg);
+static VALUE copy_in_each_i( RB_BLOCK_CALL_FUNC_ARGLIST( row, arg));
+static void  copy_in_row( struct copy_in_data *d, VALUE row);
+static void  copy_in_flush( struct copy_in_data *d);
+
+static VALUE pgconn_copy_out( int argc, VALUE *argv, VALUE self);
+static int   is_copy_command( VALUE cmd);
+extern VALUE pg_strip_semicolon( VALUE cmd);
+static VALUE describe_query( VALUE conn, VALUE cmd);
+static void  copy_out_types( struct copy_out_data *d, VALUE res);
+static VALUE copy_out_rows( VALUE arg);
+static VALUE copy_out_end( VALUE arg);
+static VALUE copy_text_row( struct copy_out_data *d, const char *p, int l);
+static long  copy_text_unescape( const char *p, long l, char *dst);
+static VALUE copy_binary_row( struct copy_out_data *d, const char *p, int l);
+
+static VALUE pgconn_putbinary( int argc, VALUE *argv, VALUE self);
+
+static VALUE pgconn_copy_to_io(   int argc, VALUE *argv, VALUE self);
+static VALUE pgconn_copy_from_io( int argc, VALUE *argv, VALUE self);
+static void  copy_io_init( struct copy_io_data *d, VALUE self, VALUE io, VALUE opts);
+static int   copy_io_target( struct copy_io_data *d, int writing);
+static void  copy_io_lock( struct copy_io_data *d, int writing);
+static VALUE copy_to_io_run( VALUE arg);
+static VALUE copy_to_io_end( VALUE arg);
+static VALUE copy_from_io_run( VALUE arg);
+static VALUE copy_from_io_end( VALUE arg);
+static void  copy_io_nogvl( struct copy_io_data *d, void *(*func)( void *));
+static void *copy_to_nogvl( void *arg);
+static void *copy_from_nogvl( void *arg);
+static int   write_all( struct copy_io_data *d, const char *p, long l);
+static int   wait_fd( struct copy_io_data *d, short events);
+static void  copy_io_ubf( void *arg);
+
+
+static ID id_each;
+
+
+
+/*
+ * Make sure +res+ started a COPY in the direction +status+.  If it
+ * started the other one, end that before raising, so the connection
+ * is usable again.
+ */
+int
+pg_copy_check( VALUE res, ExecStatusType status)
+{
+    struct pgresult_data *r;
+    ExecStatusType st;
+
+    TypedData_Get_Struct( res, struct pgresult_data, &pgresult_data_data_type, r);
+    st = PQresultStatus( r->res);
+    if (st != status) {
+        pgresult_clear( res);
+        pg_copy_abort( r->conn, st);
+        rb_raise( rb_ePgConnCopy, "Statement is not a suitable COPY command.");
+    }
+    return PQbinaryTuples( r->res);
+}
+
+/*
+ * End a COPY that is in state +status+ without caring for its data or
+ * its result.
+ */
+void
+pg_copy_abort( VALUE conn, ExecStatusType status)
+{
+    struct pgconn_data *c;
+    PGresult *res;
+    char *b;
+
+    c = get_pgconn( conn);
+    switch (status) {
+    case PGRES_COPY_IN:
+        pg_copy_finish( conn, "COPY aborted by client.");
+        break;
+    case PGRES_COPY_OUT:
+        while (PQgetCopyData( c->conn, &b, 0) > 0)
+            PQfreemem( b);
+        while ((res = PQgetResult( c->conn)) != NULL)
+            PQclear( res);
+        break;
+    default:
+        break;
+    }
+}
+
+/*
+ * Send data to a COPY FROM STDIN command.  Blocks until libpq accepted
+ * the data.
+ */
+void
+pg_copy_put( struct pgconn_data *c, const char *p, int l)
+{
+    int r;
+
+    while ((r = PQputCopyData( c->conn, p, l)) == 0)
+        ;
+    if (r < 0)
+        rb_raise( rb_ePgConnCopy, "Copy from stdin failed: %s",
+                                            PQerrorMessage( c->conn));
+}
+
+/*
+ * Finish a COPY FROM STDIN command.  If +errormsg+ is non-null, the
+ * command will be aborted and the resulting error will be discarded.
+ */
+void
+pg_copy_finish( VALUE conn, const char *errormsg)
+{
+    struct pgconn_data *c;
+    PGresult *res;
+    int r;
+
+    c = get_pgconn( conn);
+    while ((r = PQputCopyEnd( c->conn, errormsg)) == 0)
+        ;
+    if (r < 0 && errormsg == NULL)
+        rb_raise( rb_ePgConnCopy, "Copy from stdin failed to finish.");
+    while ((res = PQgetResult( c->conn)) != NULL)
+        if (errormsg != NULL)
+            PQclear( res);
+        else
+            pgresult_new( res, conn, Qnil, Qnil);
+}
+
+/*
+ * If +res+ started a binary COPY FROM STDIN, send the file header and
+ * return true.
+ */
+int
+pg_copy_start_binary( VALUE conn, VALUE res)
+{
+    struct pgresult_data *r;
+
+    TypedData_Get_Struct( res, struct pgresult_data, &pgresult_data_data_type, r);
+    if (PQresultStatus( r->res) != PGRES_COPY_IN || !PQbinaryTuples( r->res))
+        return 0;
+    pg_copy_put( get_pgconn( conn), pg_binary_header, PG_BINARY_HEADER_LEN);
+    return 1;
+}
+
+
+
+/*
+ * call-seq:
+ *    conn.copy_in( sql, rows, types = nil)  ->  int
+ *
+ * Run a <code>COPY ... FROM STDIN</code> command and feed it the rows
+ * delivered by +rows+.  This may be any +Enumerable+ that yields arrays,
+ * one per line.  Returns the number of lines sent.
+ *
+ *   conn.copy_in "COPY t FROM STDIN;", [ [ 1, "foo"], [ 2, nil]]
+ *
+ *   File.open "data.csv" do |f|
+ *     conn.copy_in "COPY t FROM STDIN;", CSV.new( f)
+ *   end
+ *
+ * The fields are built the same way +stringize_line+ does, but the
+ * escaping is done in a single pass directly into the send buffer.
+ *
+ * If the command says <code>(FORMAT binary)</code>, the rows will be
+ * encoded as binary tuples.  See Pg::Conn#putbinary for the meaning of
+ * +types+.
+ *
+ * If an exception is raised while enumerating, the +COPY+ command will be
+ * aborted and nothing will be stored.
+ */
+VALUE
+pgconn_copy_in( int argc, VALUE *argv, VALUE self)
+{
+    struct copy_in_data d;
+    VALUE cmd;
+    int state;
+
+    rb_scan_args( argc, argv, "21", &cmd, &d.rows, &d.types);
+    StringValue( cmd);
+    if (!NIL_P( d.types))
+        d.types = rb_convert_type( d.types, T_ARRAY, "Array", "to_ary");
+    d.binary = pg_copy_check( pg_command_exec( self, cmd), PGRES_COPY_IN);
+
+    d.conn  = self;
+    d.c     = get_pgconn( self);
+    d.buf   = rb_str_buf_new( COPY_BUFSIZE + COPY_BUFSIZE / 4);
+    d.count = 0;
+    if (d.binary)
+        rb_str_buf_cat( d.buf, pg_binary_header, PG_BINARY_HEADER_LEN);
+    rb_protect( &copy_in_rows, (VALUE) &d, &state);
+    if (state) {
+        pg_copy_finish( self, "COPY aborted by client.");
+        rb_jump_tag( state);
+    }
+    pg_copy_finish( self, NULL);
+    RB_GC_GUARD( d.buf);
+    return LONG2NUM( d.count);
+}
+
+VALUE
+copy_in_rows( VALUE arg)
+{
+    struct copy_in_data *d = (struct copy_in_data *) arg;
+
+    if (TYPE( d->rows) == T_ARRAY) {
+        long i;
+
+        for (i = 0; i < RARRAY_LEN( d->rows); ++i)
+            copy_in_row( d, RARRAY_AREF( d->rows, i));
+    } else
+        rb_block_call( d->rows, id_each, 0, NULL, &copy_in_each_i, arg);
+    if (d->binary)
+        pg_put_int16( d->buf, -1);
+    copy_in_flush( d);
+    return Qnil;
+}
+
+VALUE
+copy_in_each_i( RB_BLOCK_CALL_FUNC_ARGLIST( row, arg))
+{
+    copy_in_row( (struct copy_in_data *) arg, row);
+    return Qnil;
+}
+
+void
+copy_in_row( struct copy_in_data *d, VALUE row)
+{
+    VALUE a;
+    long i, l;
+
+    if (d->binary) {
+        pg_binary_put_row( d->conn, d->buf, row, d->types);
+        goto done;
+    }
+    a = rb_check_array_type( row);
+    if (NIL_P( a))
+        rb_raise( rb_eArgError, "Row is not an array.");
+    for (i = 0, l = RARRAY_LEN( a); i < l; ++i) {
+        VALUE f;
+
+        if (i > 0)
+            rb_str_buf_cat( d->buf, "\t", 1);
+        f = RARRAY_AREF( a, i);
+        if (NIL_P( f))
+            rb_str_buf_cat( d->buf, "\\N", 2);
+        else {
+            f = pgconn_encode_in4out( d->c, pgconn_stringize( d->conn, f));
+            pg_copy_escape( d->buf, f);
+        }
+    }
+    rb_str_buf_cat( d->buf, "\n", 1);
+done:
+    d->count++;
+    if (RSTRING_LEN( d->buf) >= COPY_BUFSIZE)
+        copy_in_flush( d);
+}
+
+void
+copy_in_flush( struct copy_in_data *d)
+{
+    if (RSTRING_LEN( d->buf) > 0) {
+        pg_copy_put( d->c, RSTRING_PTR( d->buf), RSTRING_LEN( d->buf));
+        rb_str_set_len( d->buf, 0);
+    }
+}
+
+
+
+/*
+ * call-seq:
+ *    conn.copy_out( sql, types = nil) { |row| ... }  ->  int
+ *
+ * Run a <code>COPY ... TO STDOUT</code> command and yield every line
+ * as an array of fields.  Returns the number of lines read.
+ *
+ * The fields are split and unescaped in C.  That includes "\\N" for
+ * +nil+ as well as octal and <code>\\x</code> escapes.
+ *
+ *   conn.copy_out "COPY t TO STDOUT;" do |row|
+ *     row    #=> [ "1", "foo", nil]
+ *   end
+ *
+ * If +sql+ is not a +COPY+ command, it will be taken as a query and
+ * wrapped into <code>COPY (...) TO STDOUT</code>.  Then the query will be
+ * described first and the fields are translated to Ruby objects the
+ * same way Pg::Result does.
+ *
+ *   conn.copy_out "SELECT id, name, born FROM persons" do |id,name,born|
+ *     id     #=> 1
+ *     born   #=> #<Date: 1970-01-01 ...>
+ *   end
+ *
+ * You may give the column types yourself as an array of OIDs in +types+,
+ * or +false+ to suppress the translation.
+ *
+ * A <code>(FORMAT binary)</code> command will be decoded from the binary
+ * tuples.  Fields of unknown type are returned as binary strings then.
+ */
+VALUE
+pgconn_copy_out( int argc, VALUE *argv, VALUE self)
+{
+    struct copy_out_data d;
+    VALUE cmd, types;
+
+    rb_scan_args( argc, argv, "11", &cmd, &types);
+    StringValue( cmd);
+
+    d.conn     = self;
+    d.c        = get_pgconn( self);
+    d.cmd      = Qnil;
+    d.describe = Qnil;
+    d.types    = Qnil;
+    d.nfields  = 0;
+    d.plan     = Qnil;
+    d.cols     = NULL;
+    d.binary   = 0;
+    d.header   = 0;
+    d.scratch  = Qnil;
+    d.count    = 0;
+    d.done     = 0;
+    if (!is_copy_command( cmd)) {
+        if (NIL_P( types))
+            d.describe = describe_query( self, cmd);
+        cmd = rb_sprintf( "COPY (%"PRIsVALUE") TO STDOUT;", pg_strip_semicolon( cmd));
+    }
+    if (RTEST( types))
+        d.types = rb_convert_type( types, T_ARRAY, "Array", "to_ary");
+    d.cmd = cmd;
+
+    return rb_ensure( &copy_out_rows, (VALUE) &d, &copy_out_end, (VALUE) &d);
+}
+
+int
+is_copy_command( VALUE cmd)
+{
+    const char *p;
+    long l;
+
+    for (p = RSTRING_PTR( cmd), l = RSTRING_LEN( cmd); l && ISSPACE( *p); ++p, --l)
+        ;
+    return l > 4 && strncasecmp( p, "copy", 4) == 0 && ISSPACE( p[ 4]);
+}
+
+VALUE
+pg_strip_semicolon( VALUE cmd)
+{
+    const char *p;
+    long l;
+
+    p = RSTRING_PTR( cmd);
+    for (l = RSTRING_LEN( cmd); l && (ISSPACE( p[ l - 1]) || p[ l - 1] == ';'); --l)
+        ;
+    return rb_str_subseq( cmd, 0, l);
+}
+
+VALUE
+describe_query( VALUE conn, VALUE cmd)
+{
+    struct pgconn_data *c;
+    PGresult *result;
+
+    c = get_pgconn( conn);
+    result = PQprepare( c->conn, "", pgconn_destring( c, cmd, NULL), 0, NULL);
+    if (result == NULL)
+        pg_raise_connexec( c);
+    pgresult_clear( pgresult_new( result, conn, cmd, Qnil));
+    result = PQdescribePrepared( c->conn, "");
+    if (result == NULL)
+        pg_raise_connexec( c);
+    return pgresult_new( result, conn, cmd, Qnil);
+}
+
+void
+copy_out_types( struct copy_out_data *d, VALUE res)
+{
+    struct pgresult_data *r;
+    int i;
+
+    d->binary = pg_copy_check( res, PGRES_COPY_OUT);
+    TypedData_Get_Struct( res, struct pgresult_data, &pgresult_data_data_type, r);
+    d->nfields = PQnfields( r->res);
+    pgresult_clear( res);
+
+    if (!NIL_P( d->describe) || !NIL_P( d->types)) {
+        struct pg_column *cols;
+
+        /* The decoders are chosen once for all rows. */
+        d->plan = pg_plan_new( d->nfields, &cols);
+        if (!NIL_P( d->describe))
+            TypedData_Get_Struct( d->describe, struct pgresult_data, &pgresult_data_data_type, r);
+        for (i = 0; i < d->nfields; ++i) {
+            Oid typ;
+            int typmod;
+
+            if (!NIL_P( d->describe)) {
+                typ    = i < PQnfields( r->res) ? PQftype( r->res, i) : InvalidOid;
+                typmod = i < PQnfields( r->res) ? PQfmod(  r->res, i) : -1;
+            } else {
+                VALUE t = rb_ary_entry( d->types, i);
+                typ    = NIL_P( t) ? InvalidOid : NUM2UINT( t);
+                typmod = -1;
+            }
+            if (typ != InvalidOid)
+                pg_column_init( cols + i, d->c, typ, typmod, 0);
+        }
+        d->cols = cols;
+    }
+}
+
+VALUE
+copy_out_rows( VALUE arg)
+{
+    struct copy_out_data *d = (struct copy_out_data *) arg;
+    char *b;
+    int r;
+
+    copy_out_types( d, pg_command_exec( d->conn, d->cmd));
+    d->scratch = rb_str_buf_new( BUFSIZ);
+    while ((r = PQgetCopyData( d->c->conn, &b, 0)) > 0) {
+        VALUE row;
+
+        row = d->binary ? copy_binary_row( d, b, r) : copy_text_row( d, b, r);
+        PQfreemem( b);
+        if (row == Qundef)
+            continue;
+        d->count++;
+        rb_yield( row);
+    }
+    d->done = 1;
+    return LONG2NUM( d->count);
+}
+
+VALUE
+copy_out_end( VALUE arg)
+{
+    struct copy_out_data *d = (struct copy_out_data *) arg;
+    PGresult *res;
+    char *b;
+    int r;
+
+    d->cols = NULL;
+    d->plan = Qnil;
+    if (!NIL_P( d->describe))
+        pgresult_clear( d->describe);
+
+    if (d->done) {
+        PGresult *err;
+
+        /* Read all results before an error is raised. */
+        err = NULL;
+        while ((res = PQgetResult( d->c->conn)) != NULL)
+            if (err == NULL && PQresultStatus( res) == PGRES_FATAL_ERROR)
+                err = res;
+            else
+                PQclear( res);
+        if (err != NULL)
+            pgresult_new( err, d->conn, Qnil, Qnil);
+        return Qnil;
+    }
+
+    /*
+     * The loop was left by an exception or a break.  Stop the server
+     * instead of reading the rest, and do not raise over the exception
+     * that may be on its way.
+     */
+    if (PQtransactionStatus( d->c->conn) == PQTRANS_ACTIVE) {
+        PGcancel *cancel;
+
+        cancel = PQgetCancel( d->c->conn);
+        if (cancel != NULL) {
+            char errbuf[ 256];
+
+            PQcancel( cancel, errbuf, sizeof errbuf);
+            PQfreeCancel( cancel);
+        }
+    }
+    while ((r = PQgetCopyData( d->c->conn, &b, 0)) > 0)
+        PQfreemem( b);
+    while ((res = PQgetResult( d->c->conn)) != NULL)
+        PQclear( res);
+    return Qnil;
+}
+
+VALUE
+copy_text_row( struct copy_out_data *d, const char *p, int l)
+{
+    VALUE row;
+    const char *q;
+    long m;
+    int i;
+
+    if (l > 0 && p[ l - 1] == '\n')
+        --l;
+    row = rb_ary_new2( d->nfields);
+    for (i = 0;; ++i) {
+        q = memchr( p, '\t', l);
+        m = q != NULL ? q - p : l;
+        if (m == 2 && p[ 0] == '\\' && p[ 1] == 'N')
+            rb_ary_push( row, Qnil);
+        else {
+            char *s;
+
+            rb_str_modify_expand( d->scratch, m + 1);
+            s = RSTRING_PTR( d->scratch);
+            m = copy_text_unescape( p, m, s);
+            s[ m] = '\0';
+            if (d->cols != NULL && i < d->nfields) {
+                const struct pg_column *col = d->cols + i;
+
+                rb_ary_push( row, (*col->decode)( d->c, s, m, col));
+            } else
+                rb_ary_push( row, pgconn_mkstringn( d->c, s, m));
+        }
+        if (q == NULL)
+            break;
+        l -= q + 1 - p;
+        p = q + 1;
+    }
+    return row;
+}
+
+/*
+ * Undo the escaping of a +COPY+ text field.  The result will never be
+ * longer than the source.
+ */
+long
+copy_text_unescape( const char *p, long l, char *dst)
+{
+    char *d;
+    const char *q;
+    int v, n;
+
+    d = dst;
+    while (l) {
+        q = memchr( p, '\\', l);
+        if (q == NULL)
+            q = p + l;
+        memcpy( d, p, q - p);
+        d += q - p;
+        l -= q - p;
+        p = q;
+        if (l == 0)
+            break;
+        ++p, --l;
+        if (l == 0) {
+            *d++ = '\\';
+            break;
+        }
+        switch (*p) {
+        case '0': case '1': case '2': case '3':
+        case '4': case '5': case '6': case '7':
+            for (v = 0, n = 3; n && l && *p >= '0' && *p <= '7'; --n, ++p, --l)
+                v = (v << 3) + (*p - '0');
+            *d++ = (char) v;
+            continue;
+        case 'x':
+            if (l > 1 && ISXDIGIT( p[ 1])) {
+                ++p, --l;
+                for (v = 0, n = 2; n && l && ISXDIGIT( *p); --n, ++p, --l)
+                    v = (v << 4) + (ISDIGIT( *p) ? *p - '0' : (*p | 0x20) - 'a' + 10);
+                *d++ = (char) v;
+                continue;
+            }
+            *d++ = 'x';
+            break;
+        case 'b': *d++ = '\b'; break;
+        case 'f': *d++ = '\f'; break;
+        case 'n': *d++ = '\n'; break;
+        case 'r': *d++ = '\r'; break;
+        case 't': *d++ = '\t'; break;
+        case 'v': *d++ = '\v'; break;
+        default:  *d++ = *p;   break;
+        }
+        ++p, --l;
+    }
+    return d - dst;
+}
+
+VALUE
+copy_binary_row( struct copy_out_data *d, const char *p, int l)
+{
+    VALUE row;
+    int n, i;
+    long m;
+
+    if (!d->header) {
+        if (l < PG_BINARY_HEADER_LEN || memcmp( p, pg_binary_header, 11) != 0)
+            rb_raise( rb_ePgConnCopy, "Missing binary COPY header.");
+        m = PG_BINARY_HEADER_LEN + pg_get_int32( p + PG_BINARY_HEADER_LEN - 4);
+        if (m > l)
+            rb_raise( rb_ePgConnCopy, "Malformed binary COPY header.");
+        p += m, l -= m;
+        d->header = 1;
+        if (l == 0)
+            return Qundef;
+    }
+    if (l < 2)
+        rb_raise( rb_ePgConnCopy, "Malformed binary COPY tuple.");
+    n = pg_get_int16( p);
+    if (n < 0)
+        return Qundef;
+    p += 2, l -= 2;
+    row = rb_ary_new2( n);
+    for (i = 0; i < n; ++i) {
+        if (l < 4)
+            rb_raise( rb_ePgConnCopy, "Malformed binary COPY tuple.");
+        m = pg_get_int32( p);
+        p += 4, l -= 4;
+        if (m < 0)
+            rb_ary_push( row, Qnil);
+        else {
+            if (m > l)
+                rb_raise( rb_ePgConnCopy, "Malformed binary COPY tuple.");
+            if (d->cols != NULL && i < d->nfields && d->cols[ i].typ != InvalidOid)
+                rb_ary_push( row, pg_binary_value( d->c, p, m, d->cols[ i].typ,
+                                                                d->cols[ i].typmod));
+            else
+                rb_ary_push( row, rb_str_new( p, m));
+            p += m, l -= m;
+        }
+    }
+    return row;
+}
+
+
+
+/*
+ * call-seq:
+ *    conn.putbinary( ary, types = nil)  -> nil
+ *
+ * Sends a binary tuple to the backend server.  You have to open the
+ * stream with a <code>COPY ... FROM STDIN (FORMAT binary)</code> command
+ * using +copy_stdin+, what will send the file header and trailer.
+ *
+ *   conn.copy_stdin "COPY t FROM STDIN (FORMAT binary);" do
+ *     conn.putbinary [ 1, "foo", Time.now, BigDecimal( "1.5")]
+ *   end
+ *
+ * Without +types+, the PostgreSQL types will be derived from the Ruby
+ * classes: +Integer+ will become +int8+, +Float+ will become +float8+,
+ * +Time+ will be sent as +timestamptz+, +Date+ as +date+, +BigDecimal+ as
+ * +numeric+ and +true+/+false+ as +boolean+.  Everything else will be
+ * stringized and sent as text.  As the server expects exactly the types
+ * of the table's columns, you will often have to give an array of OIDs,
+ * for example:
+ *
+ *   res = conn.exec "SELECT * FROM t LIMIT 0;"
+ *   types = res.num_fields.times.map { |i| res.type i }
+ */
+VALUE
+pgconn_putbinary( int argc, VALUE *argv, VALUE self)
+{
+    VALUE ary, types;
+    VALUE buf;
+
+    rb_scan_args( argc, argv, "11", &ary, &types);
+    if (!NIL_P( types))
+        types = rb_convert_type( types, T_ARRAY, "Array", "to_ary");
+    buf = rb_str_buf_new( BUFSIZ);
+    pg_binary_put_row( self, buf, ary, types);
+    pg_copy_put( get_pgconn( self), RSTRING_PTR( buf), RSTRING_LEN( buf));
+    RB_GC_GUARD( buf);
+    return Qnil;
+}
+
+
+
+/*
+ * call-seq:
+ *    conn.copy_to_io( sql, io, chunk: 65536)  ->  int
+ *
+ * Run a <code>COPY ... TO STDOUT</code> command and write its output
+ * to +io+.  Returns the number of bytes written.
+ *
+ *   File.open "t.dump", "w" do |f|
+ *     conn.copy_to_io "COPY t TO STDOUT (FORMAT binary);", f
+ *   end
+ *
+ * If +io+ is a real IO, the data will be collected in chunks of the
+ * given size and written to the file descriptor directly.  No Ruby
+ * strings are built and the GVL is released during the transfer.
+ *
+ * If +io+ is an IO::Buffer, the data will be copied into it.  An error
+ * is raised when it doesn't fit.  Any other object will have its
+ * +write+ method called with one string per chunk.
+ *
+ * As with Conn#copy_out, +sql+ may be a plain query.
+ */
+VALUE
+pgconn_copy_to_io( int argc, VALUE *argv, VALUE self)
+{
+    struct copy_io_data d;
+    VALUE cmd, io, opts;
+
+    rb_scan_args( argc, argv, "2:", &cmd, &io, &opts);
+    StringValue( cmd);
+    if (!is_copy_command( cmd))
+        cmd = rb_sprintf( "COPY (%"PRIsVALUE") TO STDOUT;", pg_strip_semicolon( cmd));
+    copy_io_init( &d, self, io, opts);
+    copy_io_target( &d, 1);
+
+    pg_copy_check( pg_command_exec( self, cmd), PGRES_COPY_OUT);
+    return rb_ensure( &copy_to_io_run, (VALUE) &d, &copy_to_io_end, (VALUE) &d);
+}
+
+/*
+ * call-seq:
+ *    conn.copy_from_io( sql, io, chunk: 65536)  ->  int
+ *
+ * Run a <code>COPY ... FROM STDIN</code> command and feed it everything
+ * that can be read from +io+.  Returns the number of bytes sent.
+ *
+ *   File.open "t.dump" do |f|
+ *     conn.copy_from_io "COPY t FROM STDIN (FORMAT binary);", f
+ *   end
+ *
+ * A real IO will be read in chunks of the given size directly from the
+ * file descriptor while the GVL is released.  A String or an IO::Buffer
+ * will be sent without being copied.  Any other object will have its
+ * +read+ method called.
+ */
+VALUE
+pgconn_copy_from_io( int argc, VALUE *argv, VALUE self)
+{
+    struct copy_io_data d;
+    VALUE cmd, io, opts;
+
+    rb_scan_args( argc, argv, "2:", &cmd, &io, &opts);
+    StringValue( cmd);
+    copy_io_init( &d, self, io, opts);
+    copy_io_target( &d, 0);
+
+    pg_copy_check( pg_command_exec( self, cmd), PGRES_COPY_IN);
+    return rb_ensure( &copy_from_io_run, (VALUE) &d, &copy_from_io_end, (VALUE) &d);
+}
+
+void
+copy_io_init( struct copy_io_data *d, VALUE self, VALUE io, VALUE opts)
+{
+    d->conn        = self;
+    d->c           = get_pgconn( self);
+    d->io          = io;
+    d->membuf      = Qnil;
+    d->cancel      = NULL;
+    d->fd          = -1;
+    d->mem         = NULL;
+    d->memlen      = 0;
+    d->buf         = NULL;
+    d->chunk       = COPY_BUFSIZE;
+    d->len         = 0;
+    d->total       = 0;
+    d->err         = 0;
+    d->failed      = 0;
+    d->overflow    = 0;
+    d->done        = 0;
+    d->locked      = 0;
+    d->interrupted = 0;
+    if (!NIL_P( opts)) {
+        ID kw;
+        VALUE v;
+
+        kw = rb_intern( "chunk");
+        rb_get_kwargs( opts, &kw, 0, 1, &v);
+        if (v != Qundef)
+            d->chunk = NUM2LONG( v);
+        if (d->chunk <= 0)
+            rb_raise( rb_eArgError, "Chunk size must be positive.");
+    }
+}
+
+/*
+ * Find out where the data goes to or comes from: a file descriptor,
+ * a memory area, or neither of them.
+ */
+int
+copy_io_target( struct copy_io_data *d, int writing)
+{
+    VALUE f;
+
+#if defined( HAVE_HEADER_RUBY_IO_BUFFER_H)
+    if (rb_obj_is_kind_of( d->io, rb_cIOBuffer)) {
+        d->membuf = d->io;
+        return 1;
+    }
+#endif
+    if (!writing && TYPE( d->io) == T_STRING) {
+        d->membuf = rb_str_new_frozen( d->io);
+        d->mem    = RSTRING_PTR( d->membuf);
+        d->memlen = RSTRING_LEN( d->membuf);
+        return 1;
+    }
+    f = rb_io_check_io( d->io);
+    if (!NIL_P( f)) {
+        rb_io_t *fptr;
+
+        GetOpenFile( f, fptr);
+        if (writing) {
+            rb_io_check_writable( fptr);
+            rb_io_flush( f);
+        } else {
+            rb_io_check_readable( fptr);
+            if (rb_io_read_pending( fptr))
+                return 0;
+        }
+        d->fd = rb_io_descriptor( f);
+        return 1;
+    }
+    return 0;
+}
+
+/*
+ * Lock an IO::Buffer target for the transfer.  This is done inside the
+ * ensured part, so the buffer is unlocked again whatever happens.
+ */
+void
+copy_io_lock( struct copy_io_data *d, int writing)
+{
+#if defined( HAVE_HEADER_RUBY_IO_BUFFER_H)
+    if (rb_obj_is_kind_of( d->membuf, rb_cIOBuffer)) {
+        void *base;
+        size_t size;
+
+        if (writing)
+            rb_io_buffer_get_bytes_for_writing( d->membuf, &base, &size);
+        else
+            rb_io_buffer_get_bytes_for_reading( d->membuf, (const void **) &base, &size);
+        rb_io_buffer_lock( d->membuf);
+        d->locked = 1;
+        d->mem    = base;
+        d->memlen = size;
+    }
+#endif
+}
+
+VALUE
+copy_to_io_run( VALUE arg)
+{
+    struct copy_io_data *d = (struct copy_io_data *) arg;
+
+    copy_io_lock( d, 1);
+    if (d->fd >= 0 || d->mem != NULL) {
+        if (d->fd >= 0)
+            d->buf = ALLOC_N( char, d->chunk);
+        copy_io_nogvl( d, &copy_to_nogvl);
+        if (d->err)
+            rb_syserr_fail( d->err, "copy_to_io");
+        if (d->overflow)
+            rb_raise( rb_ePgConnCopy, "COPY output does not fit into buffer.");
+    } else {
+        static ID id_write = 0;
+        VALUE str;
+        char *b;
+        int r;
+
+        if (id_write == 0)
+            id_write = rb_intern( "write");
+        str = rb_str_buf_new( d->chunk);
+        while ((r = PQgetCopyData( d->c->conn, &b, 0)) > 0) {
+            rb_str_buf_cat( str, b, r);
+            PQfreemem( b);
+            d->total += r;
+            if (RSTRING_LEN( str) >= d->chunk) {
+                rb_funcall( d->io, id_write, 1, str);
+                str = rb_str_buf_new( d->chunk);
+            }
+        }
+        if (r == -2)
+            d->failed = 1;
+        if (RSTRING_LEN( str) > 0)
+            rb_funcall( d->io, id_write, 1, str);
+    }
+    if (d->failed)
+        pg_raise_connexec( d->c);
+    return LL2NUM( d->total);
+}
+
+VALUE
+copy_to_io_end( VALUE arg)
+{
+    struct copy_io_data *d = (struct copy_io_data *) arg;
+    PGresult *res;
+    char *b;
+    int r;
+
+    xfree( d->buf);
+    d->buf = NULL;
+#if defined( HAVE_HEADER_RUBY_IO_BUFFER_H)
+    if (d->locked)
+        rb_io_buffer_unlock( d->membuf);
+#endif
+    while ((r = PQgetCopyData( d->c->conn, &b, 0)) > 0)
+        PQfreemem( b);
+    while ((res = PQgetResult( d->c->conn)) != NULL)
+        pgresult_new( res, d->conn, Qnil, Qnil);
+    return Qnil;
+}
+
+VALUE
+copy_from_io_run( VALUE arg)
+{
+    struct copy_io_data *d = (struct copy_io_data *) arg;
+
+    copy_io_lock( d, 0);
+    if (d->fd >= 0 || d->mem != NULL) {
+        if (d->fd >= 0)
+            d->buf = ALLOC_N( char, d->chunk);
+        copy_io_nogvl( d, &copy_from_nogvl);
+        if (d->err)
+            rb_syserr_fail( d->err, "copy_from_io");
+    } else {
+        static ID id_read = 0;
+        VALUE len, str;
+
+        if (id_read == 0)
+            id_read = rb_intern( "read");
+        len = LONG2NUM( d->chunk);
+        while (!NIL_P( str = rb_funcall( d->io, id_read, 1, len))) {
+            StringValue( str);
+            if (RSTRING_LEN( str) == 0)
+                break;
+            pg_copy_put( d->c, RSTRING_PTR( str), RSTRING_LEN( str));
+            d->total += RSTRING_LEN( str);
+        }
+    }
+    if (d->failed)
+        rb_raise( rb_ePgConnCopy, "Copy from stdin failed: %s",
+                                        PQerrorMessage( d->c->conn));
+    d->done = 1;
+    return LL2NUM( d->total);
+}
+
+VALUE
+copy_from_io_end( VALUE arg)
+{
+    struct copy_io_data *d = (struct copy_io_data *) arg;
+
+    xfree( d->buf);
+    d->buf = NULL;
+#if defined( HAVE_HEADER_RUBY_IO_BUFFER_H)
+    if (d->locked)
+        rb_io_buffer_unlock( d->membuf);
+#endif
+    RB_GC_GUARD( d->membuf);
+    pg_copy_finish( d->conn, d->done ? NULL : "COPY aborted by client.");
+    return Qnil;
+}
+
+void
+copy_io_nogvl( struct copy_io_data *d, void *(*func)( void *))
+{
+    d->cancel = PQgetCancel( d->c->conn);
+    rb_thread_call_without_gvl( func, d, &copy_io_ubf, d);
+    PQfreeCancel( d->cancel);
+    d->cancel = NULL;
+    if (d->interrupted)
+        rb_thread_check_ints();
+}
+
+void *
+copy_to_nogvl( void *arg)
+{
+    struct copy_io_data *d = arg;
+    char *b;
+    int r;
+
+    r = 0;
+    while (!d->interrupted && (r = PQgetCopyData( d->c->conn, &b, 0)) > 0) {
+        if (d->fd < 0) {
+            if (d->total + r > d->memlen)
+                d->overflow = 1;
+            else {
+                memcpy( d->mem + d->total, b, r);
+                d->total += r;
+            }
+        } else if (d->err == 0) {
+            if (d->len + r > d->chunk && d->len > 0) {
+                write_all( d, d->buf, d->len);
+                d->len = 0;
+            }
+            if (r > d->chunk)
+                write_all( d, b, r);
+            else {
+                memcpy( d->buf + d->len, b, r);
+                d->len += r;
+            }
+            d->total += r;
+        }
+        PQfreemem( b);
+    }
+    if (r == -2)
+        d->failed = 1;
+    if (d->fd >= 0 && d->err == 0 && d->len > 0)
+        write_all( d, d->buf, d->len);
+    return NULL;
+}
+
+void *
+copy_from_nogvl( void *arg)
+{
+    struct copy_io_data *d = arg;
+    long off, n;
+
+    if (d->fd < 0)
+        for (off = 0; off < d->memlen && !d->interrupted; off += n) {
+            n = d->memlen - off < d->chunk ? d->memlen - off : d->chunk;
+            if (PQputCopyData( d->c->conn, d->mem + off, n) < 0) {
+                d->failed = 1;
+                break;
+            }
+            d->total += n;
+        }
+    else
+        while (!d->interrupted) {
+            n = read( d->fd, d->buf, d->chunk);
+            if (n < 0) {
+                if (errno == EINTR)
+                    continue;
+                if ((errno == EAGAIN || errno == EWOULDBLOCK) && wait_fd( d, POLLIN) == 0)
+                    continue;
+                d->err = errno;
+                break;
+            }
+            if (n == 0)
+                break;
+            if (PQputCopyData( d->c->conn, d->buf, n) < 0) {
+                d->failed = 1;
+                break;
+            }
+            d->total += n;
+        }
+    return NULL;
+}
+
+int
+write_all( struct copy_io_data *d, const char *p, long l)
+{
+    long n;
+
+    while (l > 0 && !d->interrupted) {
+        n = write( d->fd, p, l);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            if ((errno == EAGAIN || errno == EWOULDBLOCK) && wait_fd( d, POLLOUT) == 0)
+                continue;
+            return d->err = errno;
+        }
+        p += n, l -= n;
+    }
+    return 0;
+}
+
+int
+wait_fd( struct copy_io_data *d, short events)
+{
+    struct pollfd pfd;
+    int r;
+
+    pfd.fd     = d->fd;
+    pfd.events = events;
+    do
+        r = poll( &pfd, 1, 100);
+    while ((r == 0 || (r < 0 && errno == EINTR)) && !d->interrupted);
+    return r < 0 ? -1 : 0;
+}
+
+void
+copy_io_ubf( void *arg)
+{
+    struct copy_io_data *d = arg;
+    char errbuf[ 256];
+
+    d->interrupted = 1;
+    if (d->cancel != NULL)
+        PQcancel( d->cancel, errbuf, sizeof errbuf);
+}
+
+
+
+void
+Init_pgsql_conn_copy( void)
+{
+
+#ifdef RDOC_NEEDS_THIS
+    rb_cPgConn = rb_define_class_under( rb_mPg, "Conn", rb_cObject);
+#endif
+
+    rb_define_method( rb_cPgConn, "copy_in", &pgconn_copy_in, -1);
+    rb_define_method( rb_cPgConn, "copy_out", &pgconn_copy_out, -1);
+    rb_define_method( rb_cPgConn, "putbinary", &pgconn_putbinary, -1);
+    rb_define_method( rb_cPgConn, "copy_to_io", &pgconn_copy_to_io, -1);
+    rb_define_method( rb_cPgConn, "copy_from_io", &pgconn_copy_from_io, -1);
+
+    id_each = rb_intern( "each");
+}
+
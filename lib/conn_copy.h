@@ -0,0 +1,20 @@
+/*
+ *  conn_copy.h  --  PostgreSQL connection, COPY data transfer
+ */
+
+#ifndef __CONN_COPY_H
+#define __CONN_COPY_H
+
+#include "conn.h"
+
+
+extern void  pg_copy_put( struct pgconn_data *c, const char *p, int l);
+extern void  pg_copy_finish( VALUE conn, const char *errormsg);
+extern int   pg_copy_start_binary( VALUE conn, VALUE res);
+extern VALUE pg_strip_semicolon( VALUE cmd);
+
+
+extern void Init_pgsql_conn_copy( void);
+
+#endif
+
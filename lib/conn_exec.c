@@ -6,18 +6,21 @@
 #include "conn_exec.h"
 
 #include "conn_quote.h"
+#include "conn_copy.h"
 #include "result.h"
+#include "row.h"
 
 #include <math.h>
 
 
-static void pg_raise_connexec( struct pgconn_data *c);
+extern void pg_raise_connexec( struct pgconn_data *c);
 
-static VALUE pg_statement_exec( VALUE conn, VALUE cmd, VALUE par);
+extern VALUE pg_statement_exec( VALUE conn, VALUE cmd, VALUE par);
+extern VALUE pg_command_exec( VALUE conn, VALUE cmd);
 static void  pg_statement_send( VALUE conn, VALUE cmd, VALUE par);
 static char **params_to_strings( VALUE conn, VALUE params, int *len);
 static void free_strings( char **strs, int len);
-static void pg_parse_parameters( int argc, VALUE *argv, VALUE *cmd, VALUE *par);
+extern void pg_parse_parameters( int argc, VALUE *argv, VALUE *cmd, VALUE *par);
 
 static VALUE pgconn_exec( int argc, VALUE *argv, VALUE obj);
 static VALUE yield_or_return_result( VALUE res);
@@ -27,6 +30,9 @@ static void wait_for_pgsocket( PGconn *c, VALUE to);
 static VALUE clear_resultqueue( VALUE self);
 static VALUE pgconn_fetch_rows( int argc, VALUE *argv, VALUE conn);
 static VALUE fetch_result_each( RB_BLOCK_CALL_FUNC_ARGLIST( res, arg));
+static VALUE pgconn_stream( int argc, VALUE *argv, VALUE conn);
+static VALUE stream_run( VALUE ary);
+static VALUE stream_result_each( RB_BLOCK_CALL_FUNC_ARGLIST( res, as));
 
 static VALUE pgconn_query(         int argc, VALUE *argv, VALUE self);
 static VALUE pgconn_select_row(    int argc, VALUE *argv, VALUE self);
@@ -47,6 +53,7 @@ static VALUE pgconn_transaction_status( VALUE self);
 
 static VALUE pgconn_copy_stdin( int argc, VALUE *argv, VALUE self);
 static VALUE put_end( VALUE conn);
+static VALUE put_end_binary( VALUE conn);
 static VALUE pgconn_putline( VALUE self, VALUE str);
 static VALUE pgconn_copy_stdout( int argc, VALUE *argv, VALUE self);
 static VALUE get_end( VALUE conn);
@@ -56,14 +63,34 @@ static VALUE pgconn_each_line( VALUE self);
 static VALUE pgconn_backup( VALUE self, VALUE label);
 static VALUE backup_end( VALUE conn);
 
+static VALUE pgconn_stream_value( int argc, VALUE *argv, VALUE self);
+static VALUE stream_value_run( VALUE arg);
+static VALUE stream_value_end( VALUE arg);
+
 
 static VALUE rb_ePgConnExec;
 static VALUE rb_ePgConnTimeout;
 static VALUE rb_ePgConnTrans;
-static VALUE rb_ePgConnCopy;
+VALUE rb_ePgConnCopy;
+
+#define STREAM_CHUNK  0x100000
+
+
+struct stream_value_data {
+    VALUE               conn;
+    struct pgconn_data *c;
+    VALUE               cmd;
+    char              **values;
+    int                 len;
+    long                chunk;
+    long                total;
+    int                 found;
+};
+
 
-static ID id_to_a;
 static ID id_fetch;
+static ID id_chunk;
+static ID id_as;
 
 
 void
@@ -80,15 +107,16 @@ pg_statement_exec( VALUE conn, VALUE cmd, VALUE par)
     PGresult *result;
 
     c = get_pgconn( conn);
-    if (NIL_P( par))
+    if (NIL_P( par) && c->translate != PG_TRANSLATE_BINARY)
         result = PQexec( c->conn, pgconn_destring( c, cmd, NULL));
     else {
         char **v;
-        int len;
+        int len = 0;
 
-        v = params_to_strings( conn, par, &len);
+        v = NIL_P( par) ? NULL : params_to_strings( conn, par, &len);
         result = PQexecParams( c->conn, pgconn_destring( c, cmd, NULL), len,
-                               NULL, (const char **) v, NULL, NULL, 0);
+                               NULL, (const char **) v, NULL, NULL,
+                               c->translate == PG_TRANSLATE_BINARY);
         free_strings( v, len);
     }
     if (result == NULL)
@@ -96,6 +124,23 @@ pg_statement_exec( VALUE conn, VALUE cmd, VALUE par)
     return pgresult_new( result, conn, cmd, par);
 }
 
+/*
+ * Commands of our own always use the simple query protocol, whatever
+ * Pg::Conn#translate_results says.
+ */
+VALUE
+pg_command_exec( VALUE conn, VALUE cmd)
+{
+    struct pgconn_data *c;
+    PGresult *result;
+
+    c = get_pgconn( conn);
+    result = PQexec( c->conn, pgconn_destring( c, cmd, NULL));
+    if (result == NULL)
+        pg_raise_connexec( c);
+    return pgresult_new( result, conn, cmd, Qnil);
+}
+
 
 void
 pg_statement_send( VALUE conn, VALUE cmd, VALUE par)
@@ -104,19 +149,21 @@ pg_statement_send( VALUE conn, VALUE cmd, VALUE par)
     int res;
 
     c = get_pgconn( conn);
-    if (NIL_P( par))
+    if (NIL_P( par) && c->translate != PG_TRANSLATE_BINARY)
         res = PQsendQuery( c->conn, pgconn_destring( c, cmd, NULL));
     else {
         char **v;
-        int len;
+        int len = 0;
 
-        v = params_to_strings( conn, par, &len);
+        v = NIL_P( par) ? NULL : params_to_strings( conn, par, &len);
         res = PQsendQueryParams( c->conn, pgconn_destring( c, cmd, NULL), len,
-                                 NULL, (const char **) v, NULL, NULL, 0);
+                                 NULL, (const char **) v, NULL, NULL,
+                                 c->translate == PG_TRANSLATE_BINARY);
         free_strings( v, len);
     }
     if (res <= 0)
         pg_raise_connexec( c);
+    c->sent_translate = c->translate;
     PQsetSingleRowMode( c->conn);
 }
 
@@ -256,7 +303,7 @@ pgconn_fetch( int argc, VALUE *argv, VALUE conn)
 {
     struct pgconn_data *c;
     PGresult *result;
-    VALUE to;
+    VALUE to, prev;
 
     rb_scan_args( argc, argv, "01", &to);
 
@@ -264,12 +311,21 @@ pgconn_fetch( int argc, VALUE *argv, VALUE conn)
     wait_for_pgsocket( c->conn, to);
     if (PQconsumeInput( c->conn) == 0)
         pg_raise_connexec( c);
+    prev = Qnil;
     if (PQisBusy( c->conn) == 0)
         while ((result = PQgetResult( c->conn)) != NULL) {
+            struct pgresult_data *r, *p;
             VALUE res;
 
             res = pgresult_new( result, conn, Qnil, Qnil);
+            TypedData_Get_Struct( res,  struct pgresult_data, &pgresult_data_data_type, r);
+            r->translate = c->sent_translate;
+            if (!NIL_P( prev)) {
+                TypedData_Get_Struct( prev, struct pgresult_data, &pgresult_data_data_type, p);
+                pg_result_inherit_plan( r, p);
+            }
             rb_ensure( rb_yield, res, pgresult_clear, res);
+            prev = res;
         }
     return Qnil;
 }
@@ -381,6 +437,58 @@ fetch_result_each( RB_BLOCK_CALL_FUNC_ARGLIST( res, arg))
 }
 
 
+/*
+ * call-seq:
+ *    conn.stream( sql, *bind_values, as: :array) { |row| ... }  -> nil
+ *
+ * Send the query and yield the rows one by one as they arrive, without
+ * holding the whole result in memory.  +as+ chooses the rows' shape:
+ * +:array+, +:hash+ (frozen field names as keys), +:symbol_hash+ or
+ * +:struct+ or +:lazy+.  See Pg::Result#each_hash, Pg::Result#each_struct
+ * and Pg::Row.
+ *
+ *   conn.stream "SELECT * FROM orders;", as: :hash do |o|
+ *     ship o[ "id"] if o[ "paid"]
+ *   end
+ */
+VALUE
+pgconn_stream( int argc, VALUE *argv, VALUE conn)
+{
+    VALUE cmd, par, opts, as;
+
+    rb_scan_args( argc, argv, "1*:", &cmd, &par, &opts);
+    StringValue( cmd);
+    if (RARRAY_LEN( par) <= 0)
+        par = Qnil;
+    as = Qnil;
+    if (!NIL_P( opts)) {
+        rb_get_kwargs( opts, &id_as, 0, 1, &as);
+        if (as == Qundef)
+            as = Qnil;
+    }
+    as = INT2FIX( pg_row_as( as));
+    pg_statement_send( conn, cmd, par);
+    return rb_ensure( stream_run, rb_ary_new3( 2, conn, as),
+                        clear_resultqueue, conn);
+}
+
+VALUE
+stream_run( VALUE ary)
+{
+    if (!id_fetch)
+        id_fetch = rb_intern( "fetch");
+    rb_block_call( rb_ary_entry( ary, 0), id_fetch, 0, NULL,
+                    stream_result_each, rb_ary_entry( ary, 1));
+    return Qnil;
+}
+
+VALUE
+stream_result_each( RB_BLOCK_CALL_FUNC_ARGLIST( res, as))
+{
+    return pg_result_each_as( res, FIX2INT( as));
+}
+
+
 /*
  * call-seq:
  *    conn.query( sql, *bind_values)    -> rows
@@ -403,11 +511,11 @@ pgconn_query( int argc, VALUE *argv, VALUE self)
     if (rb_block_given_p())
         return rb_ensure( pgresult_each, res, pgresult_clear, res);
     else {
+        struct pgresult_data *r;
         VALUE ret;
 
-        if (!id_to_a)
-            id_to_a = rb_intern( "to_a");
-        ret = rb_funcall( res, id_to_a, 0);
+        TypedData_Get_Struct( res, struct pgresult_data, &pgresult_data_data_type, r);
+        ret = pg_result_rows( r);
         pgresult_clear( res);
         return ret;
     }
@@ -469,25 +577,15 @@ pgconn_select_values( int argc, VALUE *argv, VALUE self)
     VALUE cmd, par;
     VALUE res;
     struct pgresult_data *r;
-    int n, m, n_, l;
-    int i, j, k;
     VALUE ret;
 
     pg_parse_parameters( argc, argv, &cmd, &par);
     res = pg_statement_exec( self, cmd, par);
 
     TypedData_Get_Struct( res, struct pgresult_data, &pgresult_data_data_type, r);
-    m = PQntuples( r->res), n = PQnfields( r->res);
-    l = m * n;
-    if (l == 0)
-        return Qnil;
-    ret = rb_ary_new2( l);
-    n_ = n;
-    for (k = 0, j = 0; m; ++j, --m) {
-        for (i = 0; n; ++i, --n, ++k)
-            rb_ary_store( ret, k, pg_fetchresult( r, j, i));
-        n = n_;
-    }
+    ret = PQntuples( r->res) > 0 && PQnfields( r->res) > 0 ?
+                    pg_result_flatten( r) : Qnil;
+    pgresult_clear( res);
     return ret;
 }
 
@@ -561,7 +659,7 @@ pgconn_transaction( int argc, VALUE *argv, VALUE conn)
     if (PQtransactionStatus( c->conn) > PQTRANS_IDLE)
         rb_raise( rb_ePgConnTrans,
             "Nested transaction block. Use Conn#subtransaction.");
-    pgresult_clear( pg_statement_exec( conn, cmd, Qnil));
+    pgresult_clear( pg_command_exec( conn, cmd));
     return rb_ensure( yield_transaction, conn, commit_transaction, conn);
 }
 
@@ -574,7 +672,7 @@ yield_transaction( VALUE conn)
 VALUE
 rollback_transaction( VALUE conn, VALUE err)
 {
-    pgresult_clear( pg_statement_exec( conn, rb_str_new2( "ROLLBACK;"), Qnil));
+    pgresult_clear( pg_command_exec( conn, rb_str_new2( "ROLLBACK;")));
     rb_exc_raise( err);
     return Qnil;
 }
@@ -586,7 +684,7 @@ commit_transaction( VALUE conn)
 
     c = get_pgconn( conn);
     if (PQtransactionStatus( c->conn) > PQTRANS_IDLE)
-        pgresult_clear( pg_statement_exec( conn, rb_str_new2( "COMMIT;"), Qnil));
+        pgresult_clear( pg_command_exec( conn, rb_str_new2( "COMMIT;")));
     return Qnil;
 }
 
@@ -622,7 +720,7 @@ pgconn_subtransaction( int argc, VALUE *argv, VALUE self)
     PQfreemem( p);
     rb_str_buf_cat2( cmd, ";");
 
-    pgresult_clear( pg_statement_exec( self, cmd, Qnil));
+    pgresult_clear( pg_command_exec( self, cmd));
     return rb_ensure( yield_subtransaction, ya, release_subtransaction, ya);
 }
 
@@ -640,7 +738,7 @@ rollback_subtransaction( VALUE ary, VALUE err)
     cmd = rb_str_buf_new2( "ROLLBACK TO SAVEPOINT ");
     rb_str_buf_append( cmd, rb_ary_entry( ary, 1));
     rb_str_buf_cat2( cmd, ";");
-    pgresult_clear( pg_statement_exec( rb_ary_entry( ary, 0), cmd, Qnil));
+    pgresult_clear( pg_command_exec( rb_ary_entry( ary, 0), cmd));
     rb_ary_store( ary, 1, Qnil);
     rb_exc_raise( err);
     return Qnil;
@@ -657,7 +755,7 @@ release_subtransaction( VALUE ary)
         cmd = rb_str_buf_new2( "RELEASE SAVEPOINT ");
         rb_str_buf_append( cmd, n);
         rb_str_buf_cat2( cmd, ";");
-        pgresult_clear( pg_statement_exec( rb_ary_entry( ary, 0), cmd, Qnil));
+        pgresult_clear( pg_command_exec( rb_ary_entry( ary, 0), cmd));
     }
     return Qnil;
 }
@@ -702,6 +800,9 @@ pgconn_transaction_status( VALUE self)
  *   end
  *
  * You may write a "\\." yourself if you like it.
+ *
+ * In case of a <code>(FORMAT binary)</code> command, the file header and
+ * trailer will be written for you.  Send the tuples with +putbinary+.
  */
 VALUE
 pgconn_copy_stdin( int argc, VALUE *argv, VALUE self)
@@ -711,6 +812,8 @@ pgconn_copy_stdin( int argc, VALUE *argv, VALUE self)
 
     pg_parse_parameters( argc, argv, &cmd, &par);
     res = pg_statement_exec( self, cmd, par);
+    if (pg_copy_start_binary( self, res))
+        return rb_ensure( rb_yield, res, put_end_binary, self);
     return rb_ensure( rb_yield, res, put_end, self);
 }
 
@@ -739,6 +842,13 @@ put_end( VALUE self)
     return Qnil;
 }
 
+VALUE
+put_end_binary( VALUE self)
+{
+    pg_copy_put( get_pgconn( self), "\377\377", 2);
+    return put_end( self);
+}
+
 /*
  * call-seq:
  *    conn.putline( str)         -> nil
@@ -816,6 +926,8 @@ pgconn_putline( VALUE self, VALUE arg)
  *     }
  *     ...
  *   end
+ *
+ * Conn#copy_out does the splitting and unescaping for you.
  */
 VALUE
 pgconn_copy_stdout( int argc, VALUE *argv, VALUE self)
@@ -934,7 +1046,117 @@ backup_end( VALUE self)
     VALUE cmd;
 
     cmd = rb_str_new2( "SELECT pg_stop_backup();");
-    pgresult_clear( pg_statement_exec( self, cmd, Qnil));
+    pgresult_clear( pg_command_exec( self, cmd));
+    return Qnil;
+}
+
+
+
+/*
+ * call-seq:
+ *    conn.stream_value( sql, *bind_values, chunk: 1048576) { |bytes| ... }  -> int or nil
+ *
+ * Read a single large +bytea+ or +text+ value in pieces of +chunk+
+ * bytes (characters for +text+) and yield each of them.  Returns the
+ * total length in bytes or +nil+ if the query returned no row or a
+ * +NULL+ value.
+ *
+ *   File.open "dump.bin", "wb" do |f|
+ *     conn.transaction do
+ *       conn.stream_value "SELECT data FROM files WHERE id = $1", id do |b|
+ *         f.write b
+ *       end
+ *     end
+ *   end
+ *
+ * The query must return one column.  It will be executed once per piece
+ * wrapped into <code>substring( ... FROM ... FOR ...)</code> and the
+ * result will be transferred in binary format, so neither the escaped
+ * form nor the whole value will ever be held in memory.  Run it inside
+ * a transaction with at least repeatable read isolation if the value
+ * may change meanwhile.  Values that are stored uncompressed
+ * (<code>SET STORAGE EXTERNAL</code>) are cheapest for the server to
+ * slice.
+ */
+VALUE
+pgconn_stream_value( int argc, VALUE *argv, VALUE self)
+{
+    VALUE cmd, par, opts;
+    struct stream_value_data d;
+
+    rb_scan_args( argc, argv, "1*:", &cmd, &par, &opts);
+    d.chunk = STREAM_CHUNK;
+    if (!NIL_P( opts)) {
+        VALUE ch;
+
+        rb_get_kwargs( opts, &id_chunk, 0, 1, &ch);
+        if (ch != Qundef && !NIL_P( ch))
+            d.chunk = NUM2LONG( ch);
+    }
+    if (d.chunk < 1 || d.chunk > 0x3fffffff)
+        rb_raise( rb_eArgError, "Invalid chunk size.");
+
+    d.conn  = self;
+    d.c     = get_pgconn( self);
+    d.total = 0;
+    d.found = 0;
+    d.cmd   = rb_sprintf( "SELECT substring( v FROM $%ld FOR $%ld)"
+                          " FROM (%"PRIsVALUE") AS pg_stream_value( v);",
+                          RARRAY_LEN( par) + 1, RARRAY_LEN( par) + 2,
+                          pg_strip_semicolon( StringValue( cmd)));
+    d.values = params_to_strings( self, par, &d.len);
+    REALLOC_N( d.values, char *, d.len + 2);
+    d.values[ d.len]     = ALLOC_N( char, 24);
+    d.values[ d.len + 1] = ALLOC_N( char, 24);
+    rb_ensure( &stream_value_run, (VALUE) &d, &stream_value_end, (VALUE) &d);
+    return d.found ? LONG2NUM( d.total) : Qnil;
+}
+
+VALUE
+stream_value_run( VALUE arg)
+{
+    struct stream_value_data *d = (struct stream_value_data *) arg;
+    long pos;
+
+    snprintf( d->values[ d->len + 1], 24, "%ld", d->chunk);
+    for (pos = 1;; pos += d->chunk) {
+        PGresult *result;
+        VALUE res, str;
+        int l, bytea;
+
+        snprintf( d->values[ d->len], 24, "%ld", pos);
+        result = PQexecParams( d->c->conn,
+                            pgconn_destring( d->c, d->cmd, NULL), d->len + 2, NULL,
+                            (const char **) d->values, NULL, NULL, 1);
+        if (result == NULL)
+            pg_raise_connexec( d->c);
+        res = pgresult_new( result, d->conn, d->cmd, Qnil);
+        if (PQntuples( result) == 0 || PQgetisnull( result, 0, 0)) {
+            pgresult_clear( res);
+            break;
+        }
+        d->found = 1;
+        l = PQgetlength( result, 0, 0);
+        bytea = PQftype( result, 0) == BYTEAOID;
+        str = bytea ? rb_str_new( PQgetvalue( result, 0, 0), l) :
+                      pgconn_mkstringn( d->c, PQgetvalue( result, 0, 0), l);
+        pgresult_clear( res);
+        if (l == 0)
+            break;
+        d->total += l;
+        rb_yield( str);
+        if (bytea && l < d->chunk)
+            break;
+    }
+    return Qnil;
+}
+
+VALUE
+stream_value_end( VALUE arg)
+{
+    struct stream_value_data *d = (struct stream_value_data *) arg;
+
+    free_strings( d->values, d->len + 2);
     return Qnil;
 }
 
@@ -978,6 +1200,7 @@ Init_pgsql_conn_exec( void)
     rb_define_method( rb_cPgConn, "send", &pgconn_send, -1);
     rb_define_method( rb_cPgConn, "fetch", &pgconn_fetch, -1);
     rb_define_method( rb_cPgConn, "fetch_rows", &pgconn_fetch_rows, -1);
+    rb_define_method( rb_cPgConn, "stream", &pgconn_stream, -1);
 
     rb_define_method( rb_cPgConn, "query", &pgconn_query, -1);
     rb_define_method( rb_cPgConn, "select_row", &pgconn_select_row, -1);
@@ -1010,7 +1233,10 @@ Init_pgsql_conn_exec( void)
 
     rb_define_method( rb_cPgConn, "backup", &pgconn_backup, 1);
 
-    id_to_a  = 0;
+    rb_define_method( rb_cPgConn, "stream_value", &pgconn_stream_value, -1);
+
     id_fetch = 0;
+    id_chunk = rb_intern( "chunk");
+    id_as    = rb_intern( "as");
 }
 
@@ -8,6 +8,15 @@
 #include "conn.h"
 
 
+extern VALUE rb_ePgConnCopy;
+
+
+extern void  pg_raise_connexec( struct pgconn_data *c);
+extern VALUE pg_statement_exec( VALUE conn, VALUE cmd, VALUE par);
+extern VALUE pg_command_exec( VALUE conn, VALUE cmd);
+extern void  pg_parse_parameters( int argc, VALUE *argv, VALUE *cmd, VALUE *par);
+
+
 extern void Init_pgsql_conn_exec( void);
 
 #endif
@@ -5,6 +5,8 @@
 
 #include "conn_quote.h"
 
+#include "typemap.h"
+
 
 extern VALUE pg_monetary_class( void);
 
@@ -20,10 +22,12 @@ static VALUE pgconn_unescape_bytea( VALUE self, VALUE obj);
 extern VALUE pgconn_stringize( VALUE self, VALUE obj);
 extern VALUE pgconn_stringize_line( VALUE self, VALUE ary);
 extern VALUE pgconn_for_copy( VALUE self, VALUE str);
+extern int   pg_copy_needs_escape( VALUE str);
+extern void  pg_copy_escape( VALUE buf, VALUE str);
 static int   needs_dquote_string( VALUE str);
 static VALUE dquote_string( VALUE str);
 static VALUE stringize_array( VALUE self, VALUE result, VALUE ary);
-static VALUE gsub_escape_i( RB_BLOCK_CALL_FUNC_ARGLIST( c, arg));
+static rb_encoding *copy_multibyte( VALUE str);
 
 
 static VALUE pgconn_quote( VALUE self, VALUE obj);
@@ -44,13 +48,17 @@ static ID id_format;
 static ID id_iso8601;
 static ID id_raw;
 static ID id_to_postgres;
-static ID id_gsub;
 
 static int lookup_monetary;
 
 static VALUE pg_string_null;
 static VALUE pg_string_bsl_N;
-static VALUE pg_escape_regex;
+
+
+static const char copy_escapes[ 256] = {
+    ['\b'] = 'b', ['\f'] = 'f', ['\n'] = 'n', ['\r'] = 'r',
+    ['\t'] = 't', ['\v'] = 'v', ['\\'] = '\\',
+};
 
 
 static const char *monetary[] = { "Money", "Monetary", "Amount", "Currency"};
@@ -173,8 +181,9 @@ pgconn_escape_bytea( VALUE self, VALUE str)
  *
  *   Pg::Conn.unescape_bytea "\\x616263"   # =>  "abc"
  *
- * You will need this because Pg::Result will not convert a return value
- * automatically if the field type was a +bytea+.
+ * Results of +bytea+ columns will be converted automatically; you will
+ * need this only for values that were obtained by other means, e.g. with
+ * <code>conn.translate_results = :raw</code>.
  *
  * If +enc+ is given, the result will be associated with this encoding.
  * A conversion will not be tried.  Probably, if dealing with encodings
@@ -277,7 +286,9 @@ pgconn_stringize( VALUE self, VALUE obj)
             break;
 
         default:
-            if (rb_obj_is_kind_of( obj, rb_cNumeric))
+            if ((result = pg_typemap_encode( pgconn_typemap( self), obj)) != Qundef)
+                ;
+            else if (rb_obj_is_kind_of( obj, rb_cNumeric))
                 result = rb_obj_as_string( obj);
             else {
                 VALUE co;
@@ -321,10 +332,18 @@ pgconn_stringize_line( VALUE self, VALUE ary)
     a = rb_check_convert_type( ary, T_ARRAY, "Array", "to_ary");
     if (NIL_P(a))
         rb_raise( rb_eArgError, "Give me an array.");
-    ret = rb_str_new( NULL, 0);
+    ret = rb_str_buf_new( 0);
     for (l = RARRAY_LEN( a), p = RARRAY_PTR( a); l; ++p) {
-        rb_str_concat( ret, pgconn_for_copy( self, *p));
-        rb_str_cat( ret, (--l > 0 ? "\t" : "\n"), 1);
+        if (NIL_P( *p))
+            rb_str_buf_cat( ret, "\\N", 2);
+        else {
+            VALUE s;
+
+            s = pgconn_stringize( self, *p);
+            rb_enc_associate( ret, rb_enc_check( ret, s));
+            pg_copy_escape( ret, s);
+        }
+        rb_str_buf_cat( ret, (--l > 0 ? "\t" : "\n"), 1);
     }
     return ret;
 }
@@ -345,17 +364,87 @@ pgconn_for_copy( VALUE self, VALUE obj)
     if (NIL_P( obj))
         ret = pg_string_bsl_N;
     else {
-        ret = pgconn_stringize( self, obj);
-        if (NIL_P( pg_escape_regex)) {
-            pg_escape_regex = rb_reg_new( "([\\b\\f\\n\\r\\t\\v\\\\])", 18, 0);
-            rb_global_variable( &pg_escape_regex);
+        VALUE str;
+
+        ret = str = pgconn_stringize( self, obj);
+        if (pg_copy_needs_escape( str)) {
+            ret = rb_str_buf_new( RSTRING_LEN( str) + 16);
+            pg_copy_escape( ret, str);
+            rb_enc_associate( ret, rb_enc_get( str));
         }
-        if (RTEST( rb_reg_match( pg_escape_regex, ret)))
-            ret = rb_block_call( ret, id_gsub, 1, &pg_escape_regex, &gsub_escape_i, Qnil);
     }
     return ret;
 }
 
+/*
+ * The encoding of +str+ if it has to be scanned character by character,
+ * else +NULL+.  In encodings like SJIS or BIG5 the second byte of a
+ * character may look like a backslash.
+ */
+rb_encoding *
+copy_multibyte( VALUE str)
+{
+    rb_encoding *enc;
+
+    enc = rb_enc_get( str);
+    if (rb_enc_mbmaxlen( enc) == 1 || rb_enc_to_index( enc) == rb_utf8_encindex() ||
+            rb_enc_str_asciionly_p( str))
+        return NULL;
+    return enc;
+}
+
+/*
+ * Tell whether a field contains characters that +COPY+ wants escaped.
+ */
+int
+pg_copy_needs_escape( VALUE str)
+{
+    rb_encoding *enc;
+    const char *p, *e;
+
+    enc = copy_multibyte( str);
+    p = RSTRING_PTR( str), e = RSTRING_END( str);
+    while (p < e) {
+        if (copy_escapes[ (unsigned char) *p])
+            return 1;
+        p += enc != NULL ? rb_enc_mbclen( p, e, enc) : 1;
+    }
+    return 0;
+}
+
+/*
+ * Append +str+ as a +COPY+ text field to +buf+, escaping in a single
+ * pass.  Runs of plain characters are copied as a whole.
+ */
+void
+pg_copy_escape( VALUE buf, VALUE str)
+{
+    rb_encoding *enc;
+    const char *p, *q, *e;
+    char *d;
+    long len;
+
+    enc = copy_multibyte( str);
+    p = RSTRING_PTR( str), e = RSTRING_END( str);
+    len = RSTRING_LEN( buf);
+    rb_str_modify_expand( buf, 2 * (e - p));
+    d = RSTRING_PTR( buf) + len;
+    while (p < e) {
+        for (q = p; q < e && !copy_escapes[ (unsigned char) *q];)
+            q += enc != NULL ? rb_enc_mbclen( q, e, enc) : 1;
+        memcpy( d, p, q - p);
+        d += q - p;
+        if (q < e) {
+            *d++ = '\\';
+            *d++ = copy_escapes[ (unsigned char) *q];
+            ++q;
+        }
+        p = q;
+    }
+    rb_str_set_len( buf, d - RSTRING_PTR( buf));
+    RB_GC_GUARD( str);
+}
+
 
 int
 needs_dquote_string( VALUE str)
@@ -432,28 +521,6 @@ stringize_array( VALUE self, VALUE result, VALUE ary)
 }
 
 
-VALUE
-gsub_escape_i( RB_BLOCK_CALL_FUNC_ARGLIST( c, arg))
-{
-    const char *r;
-
-    r = NULL;
-    switch (*RSTRING_PTR( c)) {
-        case '\b': r = "\\b";  break;
-        case '\f': r = "\\f";  break;
-        case '\n': r = "\\n";  break;
-        case '\r': r = "\\r";  break;
-        case '\t': r = "\\t";  break;
-        case '\v': r = "\\v";  break;
-        case '\\': r = "\\\\"; break;
-        default:               break;
-    }
-    return rb_str_new2( r);
-}
-
-
-
-
 /*
  * call-seq: conn.quote( obj) -> str
  *
@@ -677,12 +744,10 @@ Init_pgsql_conn_quote( void)
     id_iso8601     = rb_intern( "iso8601");
     id_raw         = rb_intern( "raw");
     id_to_postgres = rb_intern( "to_postgres");
-    id_gsub        = rb_intern( "gsub");
 
     lookup_monetary = 1;
 
     pg_string_null  = rb_str_new2( "NULL");  rb_global_variable( &pg_string_null);   rb_str_freeze( pg_string_null);
     pg_string_bsl_N = rb_str_new2( "\\N");   rb_global_variable( &pg_string_bsl_N);  rb_str_freeze( pg_string_bsl_N);
-    pg_escape_regex = Qnil;
 }
 
@@ -17,6 +17,8 @@ extern VALUE pg_monetary_class( void);
 
 extern VALUE pgconn_stringize( VALUE self, VALUE obj);
 extern VALUE pgconn_stringize_line( VALUE self, VALUE ary);
+extern int   pg_copy_needs_escape( VALUE str);
+extern void  pg_copy_escape( VALUE buf, VALUE str);
 
 
 extern void Init_pgsql_conn_quote( void);
@@ -0,0 +1,442 @@
+/*
+ *  conn_repl.c  --  PostgreSQL connection, replication streams
+ */
+
+
+#include "conn_repl.h"
+
+#include "conn_exec.h"
+#include "result.h"
+#include "binary.h"
+
+#include <sys/time.h>
+
+
+#define POSTGRES_EPOCH_UNIX  946684800LL
+#define USECS_PER_SEC        1000000LL
+
+#define STATUS_INTERVAL      10.0
+#define STATUS_LEN           34
+
+
+struct repl_data {
+    VALUE               conn;
+    struct pgconn_data *c;
+    long long           interval;
+    long long           next;
+    int                 done;
+};
+
+
+extern unsigned long long pg_lsn_parse( VALUE lsn);
+static VALUE lsn_format( unsigned long long lsn);
+static long long repl_now( void);
+static void  repl_put64( char *p, unsigned long long v);
+static int   repl_option_i( VALUE key, VALUE val, VALUE arg);
+
+static VALUE pgconn_start_replication( int argc, VALUE *argv, VALUE self);
+static VALUE repl_run( VALUE arg);
+static VALUE repl_stop( VALUE arg);
+static void  repl_wait( struct repl_data *d);
+static void  repl_message( struct repl_data *d, VALUE str);
+static int   repl_status( struct repl_data *d);
+
+static VALUE pgconn_received_lsn( VALUE self);
+static VALUE pgconn_flush_lsn( VALUE self);
+static VALUE pgconn_set_flush_lsn( VALUE self, VALUE lsn);
+
+static VALUE pgrepl_s_parse_lsn( VALUE cls, VALUE lsn);
+static VALUE pgrepl_s_format_lsn( VALUE cls, VALUE lsn);
+
+
+VALUE rb_mPgReplication;
+
+static VALUE rb_cPgXLogData;
+
+static ID id_quote;
+static ID id_quote_identifier;
+static ID id_status_interval;
+
+
+
+/*
+ * An LSN may be given as an Integer or in the server's notation
+ * <code>"16/B374D848"</code>.
+ */
+unsigned long long
+pg_lsn_parse( VALUE lsn)
+{
+    if (NIL_P( lsn))
+        return 0;
+    if (TYPE( lsn) == T_STRING) {
+        unsigned int hi, lo;
+        char c;
+
+        if (sscanf( StringValueCStr( lsn), "%X/%X%c", &hi, &lo, &c) != 2)
+            rb_raise( rb_eArgError, "Invalid LSN: %"PRIsVALUE, lsn);
+        return (unsigned long long) hi << 32 | lo;
+    }
+    return NUM2ULL( lsn);
+}
+
+VALUE
+lsn_format( unsigned long long lsn)
+{
+    return rb_sprintf( "%X/%X", (unsigned int) (lsn >> 32), (unsigned int) lsn);
+}
+
+/*
+ * Microseconds since 2000-01-01, the way the server counts time.
+ */
+long long
+repl_now( void)
+{
+    struct timeval tv;
+
+    gettimeofday( &tv, NULL);
+    return ((long long) tv.tv_sec - POSTGRES_EPOCH_UNIX) * USECS_PER_SEC + tv.tv_usec;
+}
+
+void
+repl_put64( char *p, unsigned long long v)
+{
+    int i;
+
+    for (i = 7; i >= 0; --i, v >>= 8)
+        p[ i] = (char) (v & 0xff);
+}
+
+int
+repl_option_i( VALUE key, VALUE val, VALUE arg)
+{
+    VALUE conn, cmd;
+
+    conn = RARRAY_AREF( arg, 0);
+    cmd  = RARRAY_AREF( arg, 1);
+    if (RSTRING_PTR( cmd)[ RSTRING_LEN( cmd) - 1] != '(')
+        rb_str_cat_cstr( cmd, ", ");
+    rb_str_append( cmd, rb_funcall( conn, id_quote_identifier, 1,
+                                                rb_obj_as_string( key)));
+    if (!NIL_P( val)) {
+        rb_str_cat_cstr( cmd, " ");
+        rb_str_append( cmd, rb_funcall( conn, id_quote, 1,
+                                                rb_obj_as_string( val)));
+    }
+    return ST_CONTINUE;
+}
+
+
+
+/*
+ * call-seq:
+ *    conn.start_replication( slot, lsn = nil, options = nil, status_interval: 10) { |xlogdata| ... }  -> nil
+ *
+ * Stream changes from the logical replication slot +slot+ starting at
+ * +lsn+ (where the slot left off if +nil+).  The connection must have
+ * been opened with the parameter <code>replication: "database"</code>.
+ * +options+ is a Hash of options for the output plugin.
+ *
+ * Every piece of data will be yielded as a Pg::Replication::XLogData.
+ * Keepalive messages are answered and a standby status update is sent
+ * every +status_interval+ seconds even while no data arrives.  Leave
+ * the block by +break+ to stop streaming.
+ *
+ * The server may discard WAL up to the position you acknowledged with
+ * #flush_lsn=, so set that only after the changes are safely stored.
+ *
+ *   c = Pg::Conn.new dbname: "shop", replication: "database"
+ *   c.start_replication "search_index", nil,
+ *           proto_version: 1, publication_names: "products" do |x|
+ *     index x.data
+ *     c.flush_lsn = x.lsn
+ *   end
+ */
+VALUE
+pgconn_start_replication( int argc, VALUE *argv, VALUE self)
+{
+    VALUE slot, lsn, options, opts;
+    VALUE cmd, res;
+    struct pgresult_data *r;
+    PGresult *p;
+    struct repl_data d;
+    unsigned long long start;
+    double interval;
+
+    rb_scan_args( argc, argv, "12:", &slot, &lsn, &options, &opts);
+    interval = STATUS_INTERVAL;
+    if (!NIL_P( opts)) {
+        VALUE iv;
+
+        rb_get_kwargs( opts, &id_status_interval, 0, 1, &iv);
+        if (iv != Qundef && !NIL_P( iv))
+            interval = NUM2DBL( iv);
+    }
+    if (interval <= 0)
+        rb_raise( rb_eArgError, "Status interval must be positive.");
+
+    d.conn     = self;
+    d.c        = get_pgconn( self);
+    d.interval = (long long) (interval * USECS_PER_SEC);
+    d.done     = 0;
+
+    start = pg_lsn_parse( lsn);
+    cmd = rb_sprintf( "START_REPLICATION SLOT %"PRIsVALUE" LOGICAL %"PRIsVALUE,
+            rb_funcall( self, id_quote_identifier, 1, rb_obj_as_string( slot)),
+            lsn_format( start));
+    if (!NIL_P( options)) {
+        Check_Type( options, T_HASH);
+        if (RHASH_SIZE( options) > 0) {
+            rb_str_cat_cstr( cmd, " (");
+            rb_hash_foreach( options, &repl_option_i, rb_assoc_new( self, cmd));
+            rb_str_cat_cstr( cmd, ")");
+        }
+    }
+
+    /* A walsender takes replication commands as simple queries only. */
+    p = PQexec( d.c->conn, pgconn_destring( d.c, cmd, NULL));
+    if (p == NULL)
+        pg_raise_connexec( d.c);
+    res = pgresult_new( p, self, cmd, Qnil);
+    TypedData_Get_Struct( res, struct pgresult_data, &pgresult_data_data_type, r);
+    if (PQresultStatus( r->res) != PGRES_COPY_BOTH) {
+        pgresult_clear( res);
+        rb_raise( rb_ePgConnCopy, "Statement did not start a replication stream.");
+    }
+    pgresult_clear( res);
+
+    d.c->lsn_received = start;
+    d.c->lsn_flushed  = start;
+    d.next = repl_now() + d.interval;
+    rb_ensure( &repl_run, (VALUE) &d, &repl_stop, (VALUE) &d);
+    return Qnil;
+}
+
+VALUE
+repl_run( VALUE arg)
+{
+    struct repl_data *d = (struct repl_data *) arg;
+    char *b;
+    int r;
+    PGresult *result;
+
+    for (;;) {
+        r = PQgetCopyData( d->c->conn, &b, 1);
+        if (r == 0)
+            repl_wait( d);
+        else if (r > 0) {
+            VALUE str;
+
+            str = rb_str_new( b, r);
+            PQfreemem( b);
+            repl_message( d, str);
+        } else
+            break;
+        if (repl_now() >= d->next && !repl_status( d))
+            pg_raise_connexec( d->c);
+    }
+    d->done = 1;
+    if (r == -2)
+        pg_raise_connexec( d->c);
+    while ((result = PQgetResult( d->c->conn)) != NULL)
+        pgresult_clear( pgresult_new( result, d->conn, Qnil, Qnil));
+    return Qnil;
+}
+
+/*
+ * Report the final position and end the stream.
+ */
+VALUE
+repl_stop( VALUE arg)
+{
+    struct repl_data *d = (struct repl_data *) arg;
+    PGresult *result;
+    char *b;
+
+    if (!d->done && PQstatus( d->c->conn) == CONNECTION_OK) {
+        repl_status( d);
+        PQputCopyEnd( d->c->conn, NULL);
+        PQflush( d->c->conn);
+        while (PQgetCopyData( d->c->conn, &b, 0) > 0)
+            PQfreemem( b);
+        while ((result = PQgetResult( d->c->conn)) != NULL)
+            PQclear( result);
+    }
+    return Qnil;
+}
+
+void
+repl_wait( struct repl_data *d)
+{
+    struct timeval tv;
+    long long t;
+
+    t = d->next - repl_now();
+    if (t < 0)
+        t = 0;
+    tv.tv_sec  = (time_t) (t / USECS_PER_SEC);
+    tv.tv_usec = (long) (t % USECS_PER_SEC);
+    if (rb_wait_for_single_fd( PQsocket( d->c->conn), RB_WAITFD_IN, &tv) < 0)
+        rb_sys_fail( "wait for replication data");
+    if (PQconsumeInput( d->c->conn) == 0)
+        pg_raise_connexec( d->c);
+}
+
+void
+repl_message( struct repl_data *d, VALUE str)
+{
+    const char *p;
+    long l;
+    unsigned long long start, end;
+
+    p = RSTRING_PTR( str);
+    l = RSTRING_LEN( str);
+    switch (*p) {
+        case 'w':
+            if (l < 25)
+                rb_raise( rb_ePgConnCopy, "Malformed XLogData message.");
+            start = (unsigned long long) pg_get_int64( p + 1);
+            end   = (unsigned long long) pg_get_int64( p + 9);
+            if (start > d->c->lsn_received)
+                d->c->lsn_received = start;
+            rb_yield( rb_struct_new( rb_cPgXLogData, ULL2NUM( start), ULL2NUM( end),
+                        pg_binary_timestamp( pg_get_int64( p + 17), 1),
+                        rb_str_subseq( str, 25, l - 25)));
+            break;
+        case 'k':
+            if (l < 18)
+                rb_raise( rb_ePgConnCopy, "Malformed keepalive message.");
+            if (p[ 17] && !repl_status( d))
+                pg_raise_connexec( d->c);
+            break;
+        default:
+            rb_raise( rb_ePgConnCopy, "Unknown replication message type '%c'.", *p);
+            break;
+    }
+}
+
+/*
+ * Send a standby status update.  Returns 0 on failure.
+ */
+int
+repl_status( struct repl_data *d)
+{
+    char m[ STATUS_LEN];
+    long long now;
+
+    now = repl_now();
+    m[ 0] = 'r';
+    repl_put64( m +  1, d->c->lsn_received);
+    repl_put64( m +  9, d->c->lsn_flushed);
+    repl_put64( m + 17, d->c->lsn_flushed);
+    repl_put64( m + 25, (unsigned long long) now);
+    m[ 33] = 0;
+    d->next = now + d->interval;
+    return PQputCopyData( d->c->conn, m, STATUS_LEN) > 0 &&
+            PQflush( d->c->conn) == 0;
+}
+
+
+/*
+ * call-seq:
+ *    conn.received_lsn()  -> int
+ *
+ * The position of the latest data received by #start_replication.
+ */
+VALUE
+pgconn_received_lsn( VALUE self)
+{
+    return ULL2NUM( get_pgconn( self)->lsn_received);
+}
+
+/*
+ * call-seq:
+ *    conn.flush_lsn()  -> int
+ *
+ * The position acknowledged to the server as safely stored.
+ */
+VALUE
+pgconn_flush_lsn( VALUE self)
+{
+    return ULL2NUM( get_pgconn( self)->lsn_flushed);
+}
+
+/*
+ * call-seq:
+ *    conn.flush_lsn = lsn
+ *
+ * Acknowledge that all changes up to +lsn+ are stored.  The position
+ * will be reported with the next standby status update.
+ */
+VALUE
+pgconn_set_flush_lsn( VALUE self, VALUE lsn)
+{
+    get_pgconn( self)->lsn_flushed = pg_lsn_parse( lsn);
+    return lsn;
+}
+
+
+/*
+ * call-seq:
+ *    Pg::Replication.parse_lsn( str)  -> int
+ *
+ * Convert an LSN like <code>"16/B374D848"</code> to an Integer.
+ */
+VALUE
+pgrepl_s_parse_lsn( VALUE cls, VALUE lsn)
+{
+    return ULL2NUM( pg_lsn_parse( lsn));
+}
+
+/*
+ * call-seq:
+ *    Pg::Replication.format_lsn( int)  -> str
+ *
+ * Convert an LSN to the notation the server uses.
+ */
+VALUE
+pgrepl_s_format_lsn( VALUE cls, VALUE lsn)
+{
+    return lsn_format( pg_lsn_parse( lsn));
+}
+
+
+
+/*
+ * Document-module: Pg::Replication
+ *
+ * Messages of a replication stream.
+ */
+
+/*
+ * Document-class: Pg::Replication::XLogData
+ *
+ * A piece of WAL data.  +lsn+ is the position where it starts, +end_lsn+
+ * the current end of WAL on the server, +time+ the time it was sent and
+ * +data+ the raw output of the plugin as a binary String.
+ */
+
+void
+Init_pgsql_conn_repl( void)
+{
+
+#ifdef RDOC_NEEDS_THIS
+    rb_cPgConn = rb_define_class_under( rb_mPg, "Conn", rb_cObject);
+#endif
+
+    rb_define_method( rb_cPgConn, "start_replication", &pgconn_start_replication, -1);
+    rb_define_method( rb_cPgConn, "received_lsn", &pgconn_received_lsn, 0);
+    rb_define_method( rb_cPgConn, "flush_lsn", &pgconn_flush_lsn, 0);
+    rb_define_method( rb_cPgConn, "flush_lsn=", &pgconn_set_flush_lsn, 1);
+
+    rb_mPgReplication = rb_define_module_under( rb_mPg, "Replication");
+    rb_define_singleton_method( rb_mPgReplication, "parse_lsn", &pgrepl_s_parse_lsn, 1);
+    rb_define_singleton_method( rb_mPgReplication, "format_lsn", &pgrepl_s_format_lsn, 1);
+
+    rb_cPgXLogData = rb_struct_define_under( rb_mPgReplication, "XLogData",
+                                "lsn", "end_lsn", "time", "data", NULL);
+
+    id_quote            = rb_intern( "quote");
+    id_quote_identifier = rb_intern( "quote_identifier");
+    id_status_interval  = rb_intern( "status_interval");
+}
+
@@ -0,0 +1,20 @@
+/*
+ *  conn_repl.h  --  PostgreSQL connection, replication streams
+ */
+
+#ifndef __CONN_REPL_H
+#define __CONN_REPL_H
+
+#include "conn.h"
+
+
+extern VALUE rb_mPgReplication;
+
+
+extern unsigned long long pg_lsn_parse( VALUE lsn);
+
+
+extern void Init_pgsql_conn_repl( void);
+
+#endif
+
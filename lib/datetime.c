@@ -0,0 +1,279 @@
+/*
+ *  datetime.c  --  Parse PostgreSQL's date and time output
+ */
+
+
+#include "datetime.h"
+
+#include "binary.h"
+
+#include <math.h>
+#include <time.h>
+#include <limits.h>
+
+
+#define POSTGRES_EPOCH_JDATE   2451545
+#define UNIX_EPOCH_JDATE       2440588
+#define SECS_PER_DAY           86400LL
+
+
+extern VALUE pg_parse_date(      const char *s, int l);
+extern VALUE pg_parse_time(      const char *s, int l, int tz);
+extern VALUE pg_parse_timestamp( const char *s, int l, int tz);
+extern int   pg_iso_date(      const char *s, int l, long *days);
+extern int   pg_iso_timestamp( const char *s, int l, int tz,
+                                long long *secs, long *usecs, long *off);
+
+static const char *dt_number( const char *p, const char *e, int min, int max, long *v);
+static const char *dt_ymd(  const char *p, const char *e, long *y, long *m, long *d);
+static const char *dt_hms(  const char *p, const char *e, long *secs, long *usecs);
+static const char *dt_zone( const char *p, const char *e, long *off);
+static const char *dt_era(  const char *p, const char *e, long *y);
+static long  dt_julian( long y, long m, long d);
+static VALUE dt_infinity( const char *s, int l);
+static VALUE dt_time( long long secs, long usecs, int off);
+
+
+
+/*
+ * The parsers understand the output of the +ISO+ +DateStyle+ only, which
+ * is PostgreSQL's default.  They return +Qundef+ for anything else so the
+ * caller may fall back to a generic parser.
+ *
+ * Infinite values become <code>Float::INFINITY</code> resp. its negative,
+ * just like in binary representation.
+ */
+
+/*
+ * Parse a date like <code>2024-01-31</code> or <code>0044-03-15 BC</code>.
+ */
+VALUE
+pg_parse_date( const char *s, int l)
+{
+    long days;
+    VALUE r;
+
+    if ((r = dt_infinity( s, l)) != Qundef)
+        return r;
+    if (!pg_iso_date( s, l, &days))
+        return Qundef;
+    return pg_binary_date( days);
+}
+
+/*
+ * Parse a time of day like <code>12:34:56.789</code> or
+ * <code>12:34:56+05:30</code>.  As +Time.parse+ does, the result is
+ * that time on the current day.
+ */
+VALUE
+pg_parse_time( const char *s, int l, int tz)
+{
+    const char *p, *e;
+    long secs, usecs, off;
+    time_t now;
+    struct tm tm;
+    long long t;
+
+    e = s + l;
+    p = dt_hms( s, e, &secs, &usecs);
+    if (p == NULL)
+        return Qundef;
+    off = 0;
+    if (tz && (p = dt_zone( p, e, &off)) == NULL)
+        return Qundef;
+    if (p != e)
+        return Qundef;
+
+    now = time( NULL);
+    localtime_r( &now, &tm);
+    if (tz) {
+        t = (dt_julian( tm.tm_year + 1900, tm.tm_mon + 1, tm.tm_mday)
+                - UNIX_EPOCH_JDATE) * SECS_PER_DAY + secs - off;
+        return dt_time( t, usecs, (int) off);
+    }
+    tm.tm_hour  = secs / 3600;
+    tm.tm_min   = secs / 60 % 60;
+    tm.tm_sec   = secs % 60;
+    tm.tm_isdst = -1;
+    return dt_time( (long long) mktime( &tm), usecs, INT_MAX);
+}
+
+/*
+ * Parse a timestamp like <code>2024-01-31 12:34:56.789+01</code>.
+ * Timestamps with time zone keep the offset the server sent, timestamps
+ * without become UTC times.
+ */
+VALUE
+pg_parse_timestamp( const char *s, int l, int tz)
+{
+    long long t;
+    long usecs, off;
+    VALUE r;
+
+    if ((r = dt_infinity( s, l)) != Qundef)
+        return r;
+    if (!pg_iso_timestamp( s, l, tz, &t, &usecs, &off))
+        return Qundef;
+    return dt_time( t, usecs, tz ? (int) off : INT_MAX - 1);
+}
+
+
+/*
+ * The days since 2000-01-01, the way PostgreSQL stores dates.  Returns 0
+ * if +s+ is not an ISO date.
+ */
+int
+pg_iso_date( const char *s, int l, long *days)
+{
+    const char *p, *e;
+    long y, m, d;
+
+    e = s + l;
+    p = dt_ymd( s, e, &y, &m, &d);
+    if (p == NULL || (p = dt_era( p, e, &y)) != e)
+        return 0;
+    *days = dt_julian( y, m, d) - POSTGRES_EPOCH_JDATE;
+    return 1;
+}
+
+/*
+ * Seconds since the Unix epoch in UTC, the fraction and the UTC offset
+ * the value was written in.  Returns 0 if +s+ is not an ISO timestamp.
+ */
+int
+pg_iso_timestamp( const char *s, int l, int tz,
+                  long long *secs, long *usecs, long *off)
+{
+    const char *p, *e;
+    long y, m, d, hms;
+
+    e = s + l;
+    p = dt_ymd( s, e, &y, &m, &d);
+    if (p == NULL || p >= e || *p != ' ')
+        return 0;
+    p = dt_hms( p + 1, e, &hms, usecs);
+    if (p == NULL)
+        return 0;
+    *off = 0;
+    if (tz && (p = dt_zone( p, e, off)) == NULL)
+        return 0;
+    if ((p = dt_era( p, e, &y)) != e)
+        return 0;
+    *secs = (dt_julian( y, m, d) - UNIX_EPOCH_JDATE) * SECS_PER_DAY + hms - *off;
+    return 1;
+}
+
+
+const char *
+dt_number( const char *p, const char *e, int min, int max, long *v)
+{
+    int n;
+
+    for (*v = 0, n = 0; p < e && n < max && *p >= '0' && *p <= '9'; ++p, ++n)
+        *v = *v * 10 + (*p - '0');
+    return n >= min ? p : NULL;
+}
+
+const char *
+dt_ymd( const char *p, const char *e, long *y, long *m, long *d)
+{
+    if ((p = dt_number( p, e, 4, 9, y)) == NULL || p >= e || *p != '-')
+        return NULL;
+    if ((p = dt_number( p + 1, e, 2, 2, m)) == NULL || p >= e || *p != '-')
+        return NULL;
+    return dt_number( p + 1, e, 2, 2, d);
+}
+
+const char *
+dt_hms( const char *p, const char *e, long *secs, long *usecs)
+{
+    long h, m, s;
+    int n;
+
+    if ((p = dt_number( p, e, 2, 2, &h)) == NULL || p >= e || *p != ':')
+        return NULL;
+    if ((p = dt_number( p + 1, e, 2, 2, &m)) == NULL || p >= e || *p != ':')
+        return NULL;
+    if ((p = dt_number( p + 1, e, 2, 2, &s)) == NULL)
+        return NULL;
+    *secs  = (h * 60 + m) * 60 + s;
+    *usecs = 0;
+    if (p < e && *p == '.') {
+        for (++p, n = 0; p < e && n < 6 && *p >= '0' && *p <= '9'; ++p, ++n)
+            *usecs = *usecs * 10 + (*p - '0');
+        if (n == 0)
+            return NULL;
+        for (; n < 6; ++n)
+            *usecs *= 10;
+    }
+    return p;
+}
+
+const char *
+dt_zone( const char *p, const char *e, long *off)
+{
+    long h, m, s;
+    int neg;
+
+    if (p >= e || (*p != '+' && *p != '-'))
+        return NULL;
+    neg = *p == '-';
+    if ((p = dt_number( p + 1, e, 2, 2, &h)) == NULL)
+        return NULL;
+    m = s = 0;
+    if (p < e && *p == ':') {
+        if ((p = dt_number( p + 1, e, 2, 2, &m)) == NULL)
+            return NULL;
+        if (p < e && *p == ':' && (p = dt_number( p + 1, e, 2, 2, &s)) == NULL)
+            return NULL;
+    }
+    *off = (h * 60 + m) * 60 + s;
+    if (neg)
+        *off = -*off;
+    return p;
+}
+
+const char *
+dt_era( const char *p, const char *e, long *y)
+{
+    if (e - p == 3 && memcmp( p, " BC", 3) == 0) {
+        *y = 1 - *y;
+        return e;
+    }
+    return p;
+}
+
+/* Proleptic Gregorian calendar, as date2j() in PostgreSQL. */
+long
+dt_julian( long y, long m, long d)
+{
+    long c;
+
+    if (m > 2)
+        m += 1, y += 4800;
+    else
+        m += 13, y += 4799;
+    c = y / 100;
+    return y * 365 - 32167 + y / 4 - c + c / 4 + 7834 * m / 256 + d;
+}
+
+VALUE
+dt_infinity( const char *s, int l)
+{
+    if (l == 8 && memcmp( s, "infinity", 8) == 0)
+        return rb_float_new( HUGE_VAL);
+    if (l == 9 && memcmp( s, "-infinity", 9) == 0)
+        return rb_float_new( -HUGE_VAL);
+    return Qundef;
+}
+
+VALUE
+dt_time( long long secs, long usecs, int off)
+{
+    struct timespec ts;
+
+    ts.tv_sec  = (time_t) secs;
+    ts.tv_nsec = usecs * 1000;
+    return rb_time_timespec_new( &ts, off);
+}
+
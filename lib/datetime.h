@@ -0,0 +1,20 @@
+/*
+ *  datetime.h  --  Parse PostgreSQL's date and time output
+ */
+
+#ifndef __DATETIME_H
+#define __DATETIME_H
+
+#include "module.h"
+
+
+extern VALUE pg_parse_date(      const char *s, int l);
+extern VALUE pg_parse_time(      const char *s, int l, int tz);
+extern VALUE pg_parse_timestamp( const char *s, int l, int tz);
+
+extern int   pg_iso_date(      const char *s, int l, long *days);
+extern int   pg_iso_timestamp( const char *s, int l, int tz,
+                                long long *secs, long *usecs, long *off);
+
+#endif
+
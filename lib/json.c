@@ -0,0 +1,331 @@
+/*
+ *  json.c  --  Parse JSON values
+ */
+
+
+#include "json.h"
+
+
+#define JSON_MAX_DEPTH  1000
+
+
+struct json_parser {
+    struct pgconn_data *c;
+    const char         *s;
+    const char         *p;
+    const char         *e;
+    VALUE               buf;
+    int                 depth;
+};
+
+
+extern VALUE pg_json_parse( struct pgconn_data *c, const char *s, int l);
+static VALUE json_value(  struct json_parser *j);
+static VALUE json_object( struct json_parser *j);
+static VALUE json_array(  struct json_parser *j);
+static VALUE json_string( struct json_parser *j, int key);
+static VALUE json_number( struct json_parser *j);
+static VALUE json_literal( struct json_parser *j, const char *word, int len, VALUE val);
+static void  json_skip(   struct json_parser *j);
+static void  json_error(  struct json_parser *j);
+static int   json_hex4(   struct json_parser *j, const char *p);
+static char *json_utf8(   char *b, unsigned long u);
+static VALUE json_mkstring( struct pgconn_data *c, const char *s, long l, int key);
+
+
+
+/*
+ * Make Ruby objects out of a +json+ or +jsonb+ value.  Objects become
+ * hashes with frozen, deduplicated keys; arrays become arrays.  Numbers
+ * containing a fraction or an exponent become +Float+, like JSON.parse
+ * does.  <code>\u</code> escapes are written as UTF-8.
+ */
+VALUE
+pg_json_parse( struct pgconn_data *c, const char *s, int l)
+{
+    struct json_parser j;
+    VALUE r;
+
+    j.c     = c;
+    j.s     = j.p = s;
+    j.e     = s + l;
+    j.buf   = Qnil;
+    j.depth = 0;
+    r = json_value( &j);
+    json_skip( &j);
+    if (j.p != j.e)
+        json_error( &j);
+    RB_GC_GUARD( j.buf);
+    return r;
+}
+
+VALUE
+json_value( struct json_parser *j)
+{
+    json_skip( j);
+    if (j->p >= j->e)
+        json_error( j);
+    switch (*j->p) {
+    case '{': return json_object( j);
+    case '[': return json_array( j);
+    case '"': return json_string( j, 0);
+    case 't': return json_literal( j, "true",  4, Qtrue);
+    case 'f': return json_literal( j, "false", 5, Qfalse);
+    case 'n': return json_literal( j, "null",  4, Qnil);
+    default:  return json_number( j);
+    }
+}
+
+VALUE
+json_object( struct json_parser *j)
+{
+    VALUE h, k;
+
+    if (++j->depth > JSON_MAX_DEPTH)
+        rb_raise( rb_ePgError, "JSON value nested too deeply.");
+    h = rb_hash_new();
+    ++j->p;
+    json_skip( j);
+    if (j->p < j->e && *j->p == '}') {
+        ++j->p;
+        --j->depth;
+        return h;
+    }
+    for (;;) {
+        json_skip( j);
+        if (j->p >= j->e || *j->p != '"')
+            json_error( j);
+        k = json_string( j, 1);
+        json_skip( j);
+        if (j->p >= j->e || *j->p != ':')
+            json_error( j);
+        ++j->p;
+        rb_hash_aset( h, k, json_value( j));
+        json_skip( j);
+        if (j->p >= j->e)
+            json_error( j);
+        if (*j->p == '}')
+            break;
+        if (*j->p != ',')
+            json_error( j);
+        ++j->p;
+    }
+    ++j->p;
+    --j->depth;
+    return h;
+}
+
+VALUE
+json_array( struct json_parser *j)
+{
+    VALUE a;
+
+    if (++j->depth > JSON_MAX_DEPTH)
+        rb_raise( rb_ePgError, "JSON value nested too deeply.");
+    a = rb_ary_new();
+    ++j->p;
+    json_skip( j);
+    if (j->p < j->e && *j->p == ']') {
+        ++j->p;
+        --j->depth;
+        return a;
+    }
+    for (;;) {
+        rb_ary_push( a, json_value( j));
+        json_skip( j);
+        if (j->p >= j->e)
+            json_error( j);
+        if (*j->p == ']')
+            break;
+        if (*j->p != ',')
+            json_error( j);
+        ++j->p;
+    }
+    ++j->p;
+    --j->depth;
+    return a;
+}
+
+VALUE
+json_string( struct json_parser *j, int key)
+{
+    const char *p, *q;
+    char *b, *d;
+    unsigned long u, v;
+
+    q = ++j->p;
+    for (p = q; p < j->e && *p != '"' && *p != '\\'; ++p)
+        ;
+    if (p >= j->e)
+        json_error( j);
+    if (*p == '"') {
+        j->p = p + 1;
+        return json_mkstring( j->c, q, p - q, key);
+    }
+
+    /* Escapes never grow, so the rest of the input bounds the length. */
+    if (NIL_P( j->buf))
+        j->buf = rb_str_buf_new( j->e - j->s);
+    b = d = RSTRING_PTR( j->buf);
+    memcpy( d, q, p - q);
+    d += p - q;
+    while (p < j->e && *p != '"') {
+        if (*p != '\\') {
+            *d++ = *p++;
+            continue;
+        }
+        if (++p >= j->e)
+            break;
+        switch (*p++) {
+        case '"':  *d++ = '"';  break;
+        case '\\': *d++ = '\\'; break;
+        case '/':  *d++ = '/';  break;
+        case 'b':  *d++ = '\b'; break;
+        case 'f':  *d++ = '\f'; break;
+        case 'n':  *d++ = '\n'; break;
+        case 'r':  *d++ = '\r'; break;
+        case 't':  *d++ = '\t'; break;
+        case 'u':
+            u = json_hex4( j, p);
+            p += 4;
+            if (u >= 0xd800 && u < 0xdc00 && p + 6 <= j->e &&
+                    p[ 0] == '\\' && p[ 1] == 'u') {
+                v = json_hex4( j, p + 2);
+                if (v >= 0xdc00 && v < 0xe000) {
+                    u = 0x10000 + ((u - 0xd800) << 10) + (v - 0xdc00);
+                    p += 6;
+                }
+            }
+            d = json_utf8( d, u);
+            break;
+        default:
+            j->p = p - 1;
+            json_error( j);
+        }
+    }
+    if (p >= j->e)
+        json_error( j);
+    j->p = p + 1;
+    return json_mkstring( j->c, b, d - b, key);
+}
+
+VALUE
+json_number( struct json_parser *j)
+{
+    const char *p, *q;
+    int flt, n;
+    long long v;
+
+    p = j->p;
+    if (p < j->e && *p == '-')
+        ++p;
+    for (q = p, v = 0, n = 0; q < j->e && *q >= '0' && *q <= '9'; ++q, ++n)
+        v = v * 10 + (*q - '0');
+    if (n == 0)
+        json_error( j);
+    flt = 0;
+    if (q < j->e && *q == '.') {
+        flt = 1;
+        for (++q; q < j->e && *q >= '0' && *q <= '9'; ++q)
+            ;
+    }
+    if (q < j->e && (*q == 'e' || *q == 'E')) {
+        flt = 1;
+        if (++q < j->e && (*q == '+' || *q == '-'))
+            ++q;
+        for (; q < j->e && *q >= '0' && *q <= '9'; ++q)
+            ;
+    }
+    p = j->p;
+    j->p = q;
+    if (!flt && n <= 18)
+        return LL2NUM( *p == '-' ? -v : v);
+    {
+        VALUE str;
+
+        str = rb_str_new( p, q - p);
+        return flt ? rb_float_new( rb_str_to_dbl( str, Qfalse)) :
+                     rb_str_to_inum( str, 10, Qfalse);
+    }
+}
+
+VALUE
+json_literal( struct json_parser *j, const char *word, int len, VALUE val)
+{
+    if (j->e - j->p < len || memcmp( j->p, word, len) != 0)
+        json_error( j);
+    j->p += len;
+    return val;
+}
+
+void
+json_skip( struct json_parser *j)
+{
+    while (j->p < j->e && (*j->p == ' ' || *j->p == '\t' ||
+                           *j->p == '\n' || *j->p == '\r'))
+        ++j->p;
+}
+
+void
+json_error( struct json_parser *j)
+{
+    rb_raise( rb_ePgError, "Malformed JSON value at offset %ld.",
+                            (long) (j->p - j->s));
+}
+
+int
+json_hex4( struct json_parser *j, const char *p)
+{
+    int i, u;
+
+    if (j->e - p < 4)
+        json_error( j);
+    for (u = 0, i = 0; i < 4; ++i, ++p) {
+        u <<= 4;
+        if (*p >= '0' && *p <= '9')
+            u |= *p - '0';
+        else if (*p >= 'a' && *p <= 'f')
+            u |= *p - 'a' + 10;
+        else if (*p >= 'A' && *p <= 'F')
+            u |= *p - 'A' + 10;
+        else
+            json_error( j);
+    }
+    return u;
+}
+
+char *
+json_utf8( char *b, unsigned long u)
+{
+    if (u < 0x80)
+        *b++ = (char) u;
+    else if (u < 0x800) {
+        *b++ = (char) (0xc0 |  (u >> 6));
+        *b++ = (char) (0x80 |  (u        & 0x3f));
+    } else if (u < 0x10000) {
+        *b++ = (char) (0xe0 |  (u >> 12));
+        *b++ = (char) (0x80 | ((u >> 6)  & 0x3f));
+        *b++ = (char) (0x80 |  (u        & 0x3f));
+    } else {
+        *b++ = (char) (0xf0 |  (u >> 18));
+        *b++ = (char) (0x80 | ((u >> 12) & 0x3f));
+        *b++ = (char) (0x80 | ((u >> 6)  & 0x3f));
+        *b++ = (char) (0x80 |  (u        & 0x3f));
+    }
+    return b;
+}
+
+VALUE
+json_mkstring( struct pgconn_data *c, const char *s, long l, int key)
+{
+    if (!key)
+        return pgconn_mkstringn( c, s, l);
+#if defined( RUBY_ENCODING) && defined( HAVE_FUNC_RB_ENC_INTERNED_STR)
+    if (NIL_P( c->internal) || c->internal == c->external)
+        return rb_enc_interned_str( s, l, rb_to_encoding( c->external));
+    return rb_str_to_interned_str( pgconn_mkstringn( c, s, l));
+#else
+    return rb_obj_freeze( pgconn_mkstringn( c, s, l));
+#endif
+}
+
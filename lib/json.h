@@ -0,0 +1,14 @@
+/*
+ *  json.h  --  Parse JSON values
+ */
+
+#ifndef __JSON_H
+#define __JSON_H
+
+#include "conn.h"
+
+
+extern VALUE pg_json_parse( struct pgconn_data *c, const char *s, int l);
+
+#endif
+
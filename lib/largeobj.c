@@ -0,0 +1,656 @@
+/*
+ *  largeobj.c  --  PostgreSQL large objects
+ */
+
+
+#include "largeobj.h"
+
+#include "conn_exec.h"
+
+#include <ruby/thread.h>
+#include <libpq/libpq-fs.h>
+
+
+#define LO_CHUNK  0x40000
+
+
+struct pglo_data {
+    VALUE conn;
+    Oid   oid;
+    int   fd;
+    int   chunk;
+};
+
+struct lo_transfer {
+    PGconn   *conn;
+    PGcancel *cancel;
+    int       fd;
+    char     *buf;
+    size_t    len;
+    int       ret;
+};
+
+
+static void   pglo_mark( void *ptr);
+static size_t pglo_memsize( const void *ptr);
+static VALUE  pglo_alloc( VALUE cls);
+static struct pglo_data *get_pglo( VALUE obj);
+static struct pgconn_data *pglo_conn( struct pglo_data *lo);
+
+static VALUE pglo_s_create( int argc, VALUE *argv, VALUE cls);
+static VALUE pglo_s_unlink( VALUE cls, VALUE conn, VALUE oid);
+static VALUE pglo_s_open( int argc, VALUE *argv, VALUE cls);
+static VALUE pglo_init( int argc, VALUE *argv, VALUE self);
+static int   lo_mode( VALUE mode);
+
+static VALUE pglo_oid( VALUE self);
+static VALUE pglo_chunk( VALUE self);
+static VALUE pglo_set_chunk( VALUE self, VALUE chunk);
+static VALUE pglo_close( VALUE self);
+static VALUE pglo_closed_p( VALUE self);
+static VALUE pglo_read( int argc, VALUE *argv, VALUE self);
+static VALUE pglo_readpartial( int argc, VALUE *argv, VALUE self);
+static VALUE pglo_write( VALUE self, VALUE str);
+static VALUE pglo_seek( int argc, VALUE *argv, VALUE self);
+static VALUE pglo_tell( VALUE self);
+static VALUE pglo_set_pos( VALUE self, VALUE pos);
+static VALUE pglo_rewind( VALUE self);
+static VALUE pglo_size( VALUE self);
+static VALUE pglo_eof_p( VALUE self);
+static VALUE pglo_truncate( VALUE self, VALUE len);
+static VALUE pglo_binmode( VALUE self);
+
+static int   lo_transfer( struct pglo_data *lo, void *(*func)( void *), char *buf, size_t len);
+static void *lo_read_nogvl( void *arg);
+static void *lo_write_nogvl( void *arg);
+static void  lo_ubf( void *arg);
+static long long lo_seek( struct pglo_data *lo, long long off, int whence);
+
+
+static VALUE rb_cPgLargeObject;
+
+static ID id_chunk;
+
+
+static const rb_data_type_t pglo_data_data_type = {
+    "pgsql:lo",
+    { &pglo_mark, RUBY_TYPED_DEFAULT_FREE, &pglo_memsize,},
+    0, 0, RUBY_TYPED_FREE_IMMEDIATELY
+};
+
+
+
+void
+pglo_mark( void *ptr)
+{
+    struct pglo_data *lo = ptr;
+
+    rb_gc_mark( lo->conn);
+}
+
+size_t
+pglo_memsize( const void *ptr)
+{
+    return sizeof (struct pglo_data);
+}
+
+VALUE
+pglo_alloc( VALUE cls)
+{
+    struct pglo_data *lo;
+    VALUE obj;
+
+    obj = TypedData_Make_Struct( cls, struct pglo_data, &pglo_data_data_type, lo);
+    lo->conn  = Qnil;
+    lo->oid   = InvalidOid;
+    lo->fd    = -1;
+    lo->chunk = LO_CHUNK;
+    return obj;
+}
+
+struct pglo_data *
+get_pglo( VALUE obj)
+{
+    struct pglo_data *lo;
+
+    TypedData_Get_Struct( obj, struct pglo_data, &pglo_data_data_type, lo);
+    if (lo->fd < 0)
+        rb_raise( rb_eIOError, "closed large object");
+    return lo;
+}
+
+struct pgconn_data *
+pglo_conn( struct pglo_data *lo)
+{
+    return get_pgconn( lo->conn);
+}
+
+
+/*
+ * Document-class: Pg::LargeObject
+ *
+ * An IO-like access to a large object.  Large objects can only be
+ * used inside a transaction, and the object will be closed when the
+ * transaction ends.
+ *
+ *   conn.transaction do
+ *     Pg::LargeObject.open conn, oid do |lo|
+ *       File.open "video.mp4", "wb" do |f|
+ *         IO.copy_stream lo, f
+ *       end
+ *     end
+ *   end
+ *
+ * Data will be transferred in pieces of +chunk+ bytes without holding
+ * the GVL.
+ */
+
+/*
+ * call-seq:
+ *    Pg::LargeObject.create( conn, oid = nil)  -> oid
+ *
+ * Create an empty large object and return its OID.
+ */
+VALUE
+pglo_s_create( int argc, VALUE *argv, VALUE cls)
+{
+    VALUE conn, oid;
+    struct pgconn_data *c;
+    Oid r;
+
+    rb_scan_args( argc, argv, "11", &conn, &oid);
+    c = get_pgconn( conn);
+    r = lo_create( c->conn, NIL_P( oid) ? InvalidOid : NUM2UINT( oid));
+    if (r == InvalidOid)
+        pg_raise_connexec( c);
+    return UINT2NUM( r);
+}
+
+/*
+ * call-seq:
+ *    Pg::LargeObject.unlink( conn, oid)  -> nil
+ *
+ * Delete a large object.
+ */
+VALUE
+pglo_s_unlink( VALUE cls, VALUE conn, VALUE oid)
+{
+    struct pgconn_data *c;
+
+    c = get_pgconn( conn);
+    if (lo_unlink( c->conn, NUM2UINT( oid)) < 0)
+        pg_raise_connexec( c);
+    return Qnil;
+}
+
+/*
+ * call-seq:
+ *    Pg::LargeObject.open( conn, oid, mode = "r", chunk: 262144)                -> lo
+ *    Pg::LargeObject.open( conn, oid, mode = "r", chunk: 262144) { |lo| ... }   -> obj
+ *
+ * Open the large object +oid+.  If a block is given, the object will be
+ * closed afterwards.
+ */
+VALUE
+pglo_s_open( int argc, VALUE *argv, VALUE cls)
+{
+    VALUE lo;
+
+    lo = rb_class_new_instance_kw( argc, argv, cls, RB_PASS_CALLED_KEYWORDS);
+    return rb_block_given_p() ?
+        rb_ensure( rb_yield, lo, pglo_close, lo) : lo;
+}
+
+/*
+ * call-seq:
+ *    Pg::LargeObject.new( conn, oid, mode = "r", chunk: 262144)  -> lo
+ *
+ * Open the large object +oid+.  +mode+ is <code>"r"</code>,
+ * <code>"w"</code> or <code>"rw"</code>.
+ */
+VALUE
+pglo_init( int argc, VALUE *argv, VALUE self)
+{
+    VALUE conn, oid, mode, opts;
+    struct pglo_data *lo;
+    struct pgconn_data *c;
+
+    rb_scan_args( argc, argv, "21:", &conn, &oid, &mode, &opts);
+    TypedData_Get_Struct( self, struct pglo_data, &pglo_data_data_type, lo);
+    c = get_pgconn( conn);
+    if (!NIL_P( opts)) {
+        VALUE ch;
+
+        rb_get_kwargs( opts, &id_chunk, 0, 1, &ch);
+        if (ch != Qundef)
+            pglo_set_chunk( self, ch);
+    }
+    lo->conn = conn;
+    lo->oid  = NUM2UINT( oid);
+    lo->fd   = lo_open( c->conn, lo->oid, lo_mode( mode));
+    if (lo->fd < 0)
+        pg_raise_connexec( c);
+    return self;
+}
+
+int
+lo_mode( VALUE mode)
+{
+    const char *m;
+    int ret;
+
+    if (NIL_P( mode))
+        return INV_READ;
+    ret = 0;
+    for (m = StringValueCStr( mode); *m; ++m)
+        switch (*m) {
+            case 'r': ret |= INV_READ;  break;
+            case 'w': ret |= INV_WRITE; break;
+            case '+': ret |= INV_READ | INV_WRITE; break;
+            case 'b':                   break;
+            default:
+                rb_raise( rb_eArgError, "Invalid access mode: %"PRIsVALUE, mode);
+                break;
+        }
+    return ret;
+}
+
+
+/*
+ * call-seq:
+ *    lo.oid()  -> int
+ */
+VALUE
+pglo_oid( VALUE self)
+{
+    struct pglo_data *lo;
+
+    TypedData_Get_Struct( self, struct pglo_data, &pglo_data_data_type, lo);
+    return UINT2NUM( lo->oid);
+}
+
+/*
+ * call-seq:
+ *    lo.chunk()  -> int
+ *
+ * The number of bytes that will be transferred at once.
+ */
+VALUE
+pglo_chunk( VALUE self)
+{
+    struct pglo_data *lo;
+
+    TypedData_Get_Struct( self, struct pglo_data, &pglo_data_data_type, lo);
+    return INT2FIX( lo->chunk);
+}
+
+/*
+ * call-seq:
+ *    lo.chunk = int
+ */
+VALUE
+pglo_set_chunk( VALUE self, VALUE chunk)
+{
+    struct pglo_data *lo;
+    int n;
+
+    TypedData_Get_Struct( self, struct pglo_data, &pglo_data_data_type, lo);
+    n = NUM2INT( chunk);
+    if (n < 1)
+        rb_raise( rb_eArgError, "Chunk size must be positive.");
+    lo->chunk = n;
+    return chunk;
+}
+
+/*
+ * call-seq:
+ *    lo.close()  -> nil
+ */
+VALUE
+pglo_close( VALUE self)
+{
+    struct pglo_data *lo;
+    int fd;
+
+    TypedData_Get_Struct( self, struct pglo_data, &pglo_data_data_type, lo);
+    if (lo->fd >= 0) {
+        fd = lo->fd;
+        lo->fd = -1;
+        if (PQtransactionStatus( pglo_conn( lo)->conn) == PQTRANS_INTRANS &&
+                lo_close( pglo_conn( lo)->conn, fd) < 0)
+            pg_raise_connexec( pglo_conn( lo));
+    }
+    return Qnil;
+}
+
+/*
+ * call-seq:
+ *    lo.closed?()  -> true or false
+ */
+VALUE
+pglo_closed_p( VALUE self)
+{
+    struct pglo_data *lo;
+
+    TypedData_Get_Struct( self, struct pglo_data, &pglo_data_data_type, lo);
+    return lo->fd < 0 ? Qtrue : Qfalse;
+}
+
+/*
+ * call-seq:
+ *    lo.read( length = nil, outbuf = nil)  -> str or nil
+ *
+ * Read +length+ bytes or everything up to the end.  Returns +nil+ at the
+ * end of the object if +length+ is given, like IO#read.
+ */
+VALUE
+pglo_read( int argc, VALUE *argv, VALUE self)
+{
+    struct pglo_data *lo;
+    VALUE length, buf;
+    long len, total;
+    int all, r;
+
+    rb_scan_args( argc, argv, "02", &length, &buf);
+    lo = get_pglo( self);
+    all = NIL_P( length);
+    len = all ? 0 : NUM2LONG( length);
+    if (len < 0)
+        rb_raise( rb_eArgError, "negative length %ld given", len);
+    if (NIL_P( buf))
+        buf = rb_str_buf_new( all ? lo->chunk : len);
+    else {
+        StringValue( buf);
+        rb_str_modify( buf);
+        rb_str_set_len( buf, 0);
+    }
+    rb_enc_associate( buf, rb_ascii8bit_encoding());
+
+    total = 0;
+    for (;;) {
+        long n;
+
+        n = all ? lo->chunk : len - total;
+        if (n > lo->chunk)
+            n = lo->chunk;
+        if (n == 0)
+            break;
+        if ((long) rb_str_capacity( buf) < total + n)
+            rb_str_modify_expand( buf, n > total ? n : total);
+        r = lo_transfer( lo, &lo_read_nogvl, RSTRING_PTR( buf) + total, n);
+        if (r < 0) {
+            rb_str_set_len( buf, total);
+            pg_raise_connexec( pglo_conn( lo));
+        }
+        total += r;
+        rb_str_set_len( buf, total);
+        if (r < n)
+            break;
+    }
+    rb_str_resize( buf, total);
+    if (total == 0 && len > 0)
+        return Qnil;
+    return buf;
+}
+
+/*
+ * call-seq:
+ *    lo.readpartial( length, outbuf = nil)  -> str
+ *
+ * Read at most +length+ bytes.  Raises EOFError at the end.  This is
+ * what IO.copy_stream uses.
+ */
+VALUE
+pglo_readpartial( int argc, VALUE *argv, VALUE self)
+{
+    VALUE length, buf, ret;
+
+    rb_scan_args( argc, argv, "11", &length, &buf);
+    ret = pglo_read( argc, argv, self);
+    if (NIL_P( ret))
+        rb_eof_error();
+    return ret;
+}
+
+/*
+ * call-seq:
+ *    lo.write( str)  -> int
+ *
+ * Write +str+ and return the number of bytes written.
+ */
+VALUE
+pglo_write( VALUE self, VALUE str)
+{
+    struct pglo_data *lo;
+    long total, len;
+    int r;
+
+    lo = get_pglo( self);
+    str = rb_str_new_frozen( rb_obj_as_string( str));
+    len = RSTRING_LEN( str);
+    for (total = 0; total < len; total += r) {
+        long n;
+
+        n = len - total;
+        if (n > lo->chunk)
+            n = lo->chunk;
+        r = lo_transfer( lo, &lo_write_nogvl, RSTRING_PTR( str) + total, n);
+        if (r < 0)
+            pg_raise_connexec( pglo_conn( lo));
+    }
+    RB_GC_GUARD( str);
+    return LONG2NUM( total);
+}
+
+/*
+ * call-seq:
+ *    lo.seek( offset, whence = IO::SEEK_SET)  -> 0
+ */
+VALUE
+pglo_seek( int argc, VALUE *argv, VALUE self)
+{
+    VALUE offset, whence;
+    int w;
+
+    rb_scan_args( argc, argv, "11", &offset, &whence);
+    w = NIL_P( whence) ? SEEK_SET : NUM2INT( whence);
+    lo_seek( get_pglo( self), NUM2LL( offset), w);
+    return INT2FIX( 0);
+}
+
+/*
+ * call-seq:
+ *    lo.tell()  -> int
+ *    lo.pos()   -> int
+ */
+VALUE
+pglo_tell( VALUE self)
+{
+    struct pglo_data *lo;
+    long long r;
+
+    lo = get_pglo( self);
+    r = lo_tell64( pglo_conn( lo)->conn, lo->fd);
+    if (r < 0)
+        pg_raise_connexec( pglo_conn( lo));
+    return LL2NUM( r);
+}
+
+/*
+ * call-seq:
+ *    lo.pos = int
+ */
+VALUE
+pglo_set_pos( VALUE self, VALUE pos)
+{
+    lo_seek( get_pglo( self), NUM2LL( pos), SEEK_SET);
+    return pos;
+}
+
+/*
+ * call-seq:
+ *    lo.rewind()  -> 0
+ */
+VALUE
+pglo_rewind( VALUE self)
+{
+    lo_seek( get_pglo( self), 0, SEEK_SET);
+    return INT2FIX( 0);
+}
+
+/*
+ * call-seq:
+ *    lo.size()  -> int
+ */
+VALUE
+pglo_size( VALUE self)
+{
+    struct pglo_data *lo;
+    long long pos, ret;
+
+    lo = get_pglo( self);
+    pos = lo_seek( lo, 0, SEEK_CUR);
+    ret = lo_seek( lo, 0, SEEK_END);
+    lo_seek( lo, pos, SEEK_SET);
+    return LL2NUM( ret);
+}
+
+/*
+ * call-seq:
+ *    lo.eof?()  -> true or false
+ */
+VALUE
+pglo_eof_p( VALUE self)
+{
+    struct pglo_data *lo;
+    long long pos;
+
+    lo = get_pglo( self);
+    pos = lo_seek( lo, 0, SEEK_CUR);
+    return lo_seek( lo, 0, SEEK_END) <= pos ?
+            Qtrue : (lo_seek( lo, pos, SEEK_SET), Qfalse);
+}
+
+/*
+ * call-seq:
+ *    lo.truncate( len)  -> 0
+ */
+VALUE
+pglo_truncate( VALUE self, VALUE len)
+{
+    struct pglo_data *lo;
+
+    lo = get_pglo( self);
+    if (lo_truncate64( pglo_conn( lo)->conn, lo->fd, NUM2LL( len)) < 0)
+        pg_raise_connexec( pglo_conn( lo));
+    return INT2FIX( 0);
+}
+
+/*
+ * call-seq:
+ *    lo.binmode()  -> lo
+ *
+ * Large objects are always binary.
+ */
+VALUE
+pglo_binmode( VALUE self)
+{
+    return self;
+}
+
+
+/*
+ * Call +func+ without the GVL.  An interrupt cancels the request.
+ */
+int
+lo_transfer( struct pglo_data *lo, void *(*func)( void *), char *buf, size_t len)
+{
+    struct lo_transfer t;
+
+    t.conn   = pglo_conn( lo)->conn;
+    t.cancel = PQgetCancel( t.conn);
+    t.fd     = lo->fd;
+    t.buf    = buf;
+    t.len    = len;
+    t.ret    = -1;
+    rb_thread_call_without_gvl( func, &t, &lo_ubf, &t);
+    PQfreeCancel( t.cancel);
+    rb_thread_check_ints();
+    return t.ret;
+}
+
+void *
+lo_read_nogvl( void *arg)
+{
+    struct lo_transfer *t = arg;
+
+    t->ret = lo_read( t->conn, t->fd, t->buf, t->len);
+    return NULL;
+}
+
+void *
+lo_write_nogvl( void *arg)
+{
+    struct lo_transfer *t = arg;
+
+    t->ret = lo_write( t->conn, t->fd, t->buf, t->len);
+    return NULL;
+}
+
+void
+lo_ubf( void *arg)
+{
+    struct lo_transfer *t = arg;
+    char errbuf[ 256];
+
+    if (t->cancel != NULL)
+        PQcancel( t->cancel, errbuf, sizeof errbuf);
+}
+
+long long
+lo_seek( struct pglo_data *lo, long long off, int whence)
+{
+    long long r;
+
+    r = lo_lseek64( pglo_conn( lo)->conn, lo->fd, off, whence);
+    if (r < 0)
+        pg_raise_connexec( pglo_conn( lo));
+    return r;
+}
+
+
+
+void
+Init_pgsql_largeobj( void)
+{
+    rb_cPgLargeObject = rb_define_class_under( rb_mPg, "LargeObject", rb_cObject);
+
+    rb_define_alloc_func( rb_cPgLargeObject, pglo_alloc);
+    rb_define_singleton_method( rb_cPgLargeObject, "create", &pglo_s_create, -1);
+    rb_define_singleton_method( rb_cPgLargeObject, "unlink", &pglo_s_unlink, 2);
+    rb_define_singleton_method( rb_cPgLargeObject, "open", &pglo_s_open, -1);
+    rb_define_method( rb_cPgLargeObject, "initialize", &pglo_init, -1);
+
+    rb_define_method( rb_cPgLargeObject, "oid", &pglo_oid, 0);
+    rb_define_method( rb_cPgLargeObject, "chunk", &pglo_chunk, 0);
+    rb_define_method( rb_cPgLargeObject, "chunk=", &pglo_set_chunk, 1);
+    rb_define_method( rb_cPgLargeObject, "close", &pglo_close, 0);
+    rb_define_method( rb_cPgLargeObject, "closed?", &pglo_closed_p, 0);
+
+    rb_define_method( rb_cPgLargeObject, "read", &pglo_read, -1);
+    rb_define_method( rb_cPgLargeObject, "readpartial", &pglo_readpartial, -1);
+    rb_define_method( rb_cPgLargeObject, "write", &pglo_write, 1);
+    rb_define_method( rb_cPgLargeObject, "seek", &pglo_seek, -1);
+    rb_define_method( rb_cPgLargeObject, "tell", &pglo_tell, 0);
+    rb_define_alias( rb_cPgLargeObject, "pos", "tell");
+    rb_define_method( rb_cPgLargeObject, "pos=", &pglo_set_pos, 1);
+    rb_define_method( rb_cPgLargeObject, "rewind", &pglo_rewind, 0);
+    rb_define_method( rb_cPgLargeObject, "size", &pglo_size, 0);
+    rb_define_method( rb_cPgLargeObject, "eof?", &pglo_eof_p, 0);
+    rb_define_alias( rb_cPgLargeObject, "eof", "eof?");
+    rb_define_method( rb_cPgLargeObject, "truncate", &pglo_truncate, 1);
+    rb_define_method( rb_cPgLargeObject, "binmode", &pglo_binmode, 0);
+
+    id_chunk = rb_intern( "chunk");
+}
+
@@ -0,0 +1,14 @@
+/*
+ *  largeobj.h  --  PostgreSQL large objects
+ */
+
+#ifndef __LARGEOBJ_H
+#define __LARGEOBJ_H
+
+#include "conn.h"
+
+
+extern void Init_pgsql_largeobj( void);
+
+#endif
+
@@ -6,6 +6,14 @@
 
 #include "conn.h"
 #include "result.h"
+#include "binary.h"
+#include "parallel.h"
+#include "pgoutput.h"
+#include "largeobj.h"
+#include "typemap.h"
+#include "row.h"
+#include "column.h"
+#include "arrow.h"
 
 
 #define PGSQL_VERSION "1.9.3"
@@ -42,5 +50,13 @@ Init_pgsql( void)
 
     Init_pgsql_conn();
     Init_pgsql_result();
+    Init_pgsql_binary();
+    Init_pgsql_parallel();
+    Init_pgsql_pgoutput();
+    Init_pgsql_largeobj();
+    Init_pgsql_typemap();
+    Init_pgsql_row();
+    Init_pgsql_column();
+    Init_pgsql_arrow();
 }
 
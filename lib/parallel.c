@@ -0,0 +1,1373 @@
+/*
+ *  parallel.c  --  Work distributed over several connections
+ */
+
+
+#include "parallel.h"
+
+#include "result.h"
+
+#include <ruby/io.h>
+#include <ruby/thread.h>
+
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+
+#define PARALLEL_WORKERS  4
+#define PARALLEL_CHUNK    0x10000
+#define PARALLEL_BATCH    1000
+
+#define FORMAT_TEXT    0
+#define FORMAT_CSV     1
+#define FORMAT_BINARY  2
+
+static const char *format_options[] = {
+    "", " (FORMAT csv)", " (FORMAT binary)"
+};
+
+
+struct copy_worker {
+    struct parallel_worker w;
+    const char            *cmd;
+    const char            *data;
+    long                   start;
+    long                   len;
+    int                    csv;
+    long                   rows;
+};
+
+struct copy_source {
+    VALUE       str;
+    char       *map;
+    size_t      maplen;
+    const char *data;
+    long        len;
+};
+
+struct export_worker {
+    struct parallel_worker w;
+    int                    fd;
+    const char            *cmd;
+    long                   rows;
+};
+
+struct export_run {
+    struct parallel_job   j;
+    struct export_worker *ew;
+    VALUE                 coord;
+    VALUE                 table;
+    VALUE                 columns;
+    VALUE                 cmds;
+    int                   format;
+    long                  rows;
+    VALUE                 errors;
+};
+
+struct scan_worker {
+    struct parallel_worker w;
+    struct scan_run       *s;
+    const char            *cmd;
+};
+
+struct scan_run {
+    struct parallel_job  j;
+    struct scan_worker  *sw;
+    VALUE                conn;
+    VALUE                cmds;
+    const char          *fetch;
+    pthread_mutex_t      lock;
+    pthread_cond_t       cond;
+    PGresult           **queue;
+    int                  cap;
+    int                  head;
+    int                  count;
+    int                  active;
+    PGresult            *current;
+    long                 rows;
+};
+
+struct copy_load {
+    struct parallel_job  j;
+    struct copy_worker  *cw;
+    struct copy_source  *s;
+    long                 rows;
+    VALUE                errors;
+};
+
+
+extern VALUE pg_parallel_connect( VALUE params, int n);
+static VALUE parallel_connect_one( VALUE params);
+static VALUE parallel_connect_n( VALUE args);
+extern void  pg_parallel_init( struct parallel_job *j, VALUE conns, void *workers, size_t size, void *(*func)( void *));
+extern struct parallel_worker *pg_parallel_worker( struct parallel_job *j, int i);
+extern void  pg_parallel_start( struct parallel_job *j);
+extern void  pg_parallel_wait( struct parallel_job *j);
+extern void  pg_parallel_run( struct parallel_job *j);
+extern void  pg_parallel_cleanup( struct parallel_job *j);
+static void *parallel_join( void *arg);
+static void  parallel_ubf( void *arg);
+extern void  pg_parallel_error( struct parallel_worker *w, PGresult *res);
+extern VALUE pg_parallel_errors( struct parallel_job *j);
+extern int   pg_parallel_workers( VALUE val);
+extern void  pg_parallel_raise( VALUE cls, VALUE errors);
+static int   parallel_format( VALUE val, int binary);
+static long  parallel_blocks( VALUE conn, VALUE table);
+static VALUE parallel_ctid_range( long nblocks, int i, int n);
+
+static VALUE pgparallelcopy_s_load( int argc, VALUE *argv, VALUE cls);
+static void  copy_load_source( struct copy_source *s, VALUE source);
+static void  copy_unload_source( struct copy_source *s);
+static long  copy_record_len( const char *p, long len, int csv);
+static int   copy_split( const char *p, long len, int csv, int n, long *bounds);
+static long  copy_error_offset( struct copy_worker *cw, PGresult *res);
+static void *copy_worker_run( void *arg);
+static VALUE copy_load_run( VALUE arg);
+static VALUE copy_load_cleanup( VALUE arg);
+
+static VALUE pgparallelexport_s_run( int argc, VALUE *argv, VALUE cls);
+static VALUE export_run( VALUE arg);
+static VALUE export_cleanup( VALUE arg);
+static VALUE export_command( struct export_run *e, VALUE cond);
+static int   export_write( struct export_worker *ew, const char *p, long l);
+static void *export_worker_run( void *arg);
+
+static VALUE pgconn_parallel_scan( int argc, VALUE *argv, VALUE self);
+static VALUE scan_conditions( VALUE conn, VALUE table, VALUE key, int n);
+static VALUE scan_run( VALUE arg);
+static VALUE scan_cleanup( VALUE arg);
+static void  scan_wakeup( struct parallel_job *j);
+static void *scan_pop( void *arg);
+static int   scan_push( struct scan_run *s, volatile int *interrupted, PGresult *res);
+static int   scan_exec( struct parallel_worker *w, const char *cmd);
+static void *scan_worker_run( void *arg);
+
+
+VALUE rb_ePgParallelError;
+
+static VALUE rb_mPgParallelCopy;
+static VALUE rb_ePgParallelCopyError;
+static VALUE rb_mPgParallelExport;
+static VALUE rb_ePgParallelExportError;
+
+static ID id_close;
+static ID id_errors;
+static ID id_workers;
+static ID id_format;
+static ID id_header;
+static ID id_text;
+static ID id_csv;
+static ID id_binary;
+static ID id_columns;
+static ID id_exec;
+static ID id_select_value;
+static ID id_quote;
+static ID id_quote_identifier;
+static ID id_select_values;
+static ID id_where;
+static ID id_partitions;
+static ID id_key;
+static ID id_batch;
+
+
+
+/*
+ * Open +n+ connections.  +params+ may be anything Pg::Conn.new accepts
+ * or a Pg::Conn whose parameters will be copied.  If one of them fails,
+ * the others will be closed again.
+ */
+VALUE
+pg_parallel_connect( VALUE params, int n)
+{
+    VALUE conns;
+    int i;
+
+    if (rb_obj_is_kind_of( params, rb_cPgConn))
+        params = pg_conninfo( params);
+    conns = rb_ary_new2( n);
+    for (i = 0; i < n; ++i) {
+        VALUE c;
+        int state;
+
+        c = rb_protect( &parallel_connect_one, params, &state);
+        if (state) {
+            long j;
+
+            for (j = 0; j < RARRAY_LEN( conns); ++j)
+                rb_funcall( RARRAY_AREF( conns, j), id_close, 0);
+            rb_jump_tag( state);
+        }
+        rb_ary_push( conns, c);
+    }
+    return conns;
+}
+
+VALUE
+parallel_connect_one( VALUE params)
+{
+    return rb_class_new_instance( 1, &params, rb_cPgConn);
+}
+
+VALUE
+parallel_connect_n( VALUE args)
+{
+    return pg_parallel_connect( RARRAY_AREF( args, 0),
+                                            NUM2INT( RARRAY_AREF( args, 1)));
+}
+
+/*
+ * +workers+ points to an array of structures that all begin with a
+ * <code>struct parallel_worker</code>; +size+ is the size of one element.
+ * There must be exactly one element for every connection in +conns+.
+ */
+void
+pg_parallel_init( struct parallel_job *j, VALUE conns, void *workers, size_t size, void *(*func)( void *))
+{
+    int i;
+
+    j->conns       = conns;
+    j->workers     = workers;
+    j->size        = size;
+    j->n           = RARRAY_LEN( conns);
+    j->func        = func;
+    j->wakeup      = NULL;
+    j->interrupted = 0;
+    for (i = 0; i < j->n; ++i) {
+        struct parallel_worker *w = pg_parallel_worker( j, i);
+
+        w->conn        = get_pgconn( RARRAY_AREF( conns, i))->conn;
+        w->cancel      = NULL;
+        w->started     = 0;
+        w->interrupted = &j->interrupted;
+        w->errmsg      = NULL;
+        w->erroffset   = -1;
+    }
+}
+
+struct parallel_worker *
+pg_parallel_worker( struct parallel_job *j, int i)
+{
+    return (struct parallel_worker *) (j->workers + i * j->size);
+}
+
+/*
+ * Start a native thread for every worker.
+ */
+void
+pg_parallel_start( struct parallel_job *j)
+{
+    int i, err;
+
+    for (i = 0; i < j->n; ++i) {
+        struct parallel_worker *w = pg_parallel_worker( j, i);
+
+        w->cancel = PQgetCancel( w->conn);
+    }
+    for (err = 0, i = 0; i < j->n && err == 0; ++i) {
+        struct parallel_worker *w = pg_parallel_worker( j, i);
+
+        err = pthread_create( &w->thread, NULL, j->func, w);
+        if (err == 0)
+            w->started = 1;
+    }
+    if (err != 0) {
+        parallel_ubf( j);
+        rb_thread_call_without_gvl( &parallel_join, j, RUBY_UBF_IO, NULL);
+        rb_syserr_fail( err, "pthread_create");
+    }
+}
+
+/*
+ * Wait for all workers without holding the GVL.  An interrupt cancels
+ * the statements of all workers.
+ */
+void
+pg_parallel_wait( struct parallel_job *j)
+{
+    rb_thread_call_without_gvl( &parallel_join, j, &parallel_ubf, j);
+    rb_thread_check_ints();
+}
+
+void
+pg_parallel_run( struct parallel_job *j)
+{
+    pg_parallel_start( j);
+    pg_parallel_wait( j);
+}
+
+/*
+ * To be called from an ensure clause.  After an exception the workers
+ * that are still running will be cancelled and waited for.  All
+ * connections will be closed.
+ */
+void
+pg_parallel_cleanup( struct parallel_job *j)
+{
+    int i;
+
+    for (i = 0; i < j->n; ++i)
+        if (pg_parallel_worker( j, i)->started) {
+            parallel_ubf( j);
+            rb_thread_call_without_gvl( &parallel_join, j, RUBY_UBF_IO, NULL);
+            break;
+        }
+    for (i = 0; i < j->n; ++i) {
+        struct parallel_worker *w = pg_parallel_worker( j, i);
+
+        if (w->cancel != NULL) {
+            PQfreeCancel( w->cancel);
+            w->cancel = NULL;
+        }
+        free( w->errmsg);
+        w->errmsg = NULL;
+        rb_funcall( RARRAY_AREF( j->conns, i), id_close, 0);
+    }
+}
+
+void *
+parallel_join( void *arg)
+{
+    struct parallel_job *j = arg;
+    int i;
+
+    for (i = 0; i < j->n; ++i) {
+        struct parallel_worker *w = pg_parallel_worker( j, i);
+
+        if (w->started) {
+            pthread_join( w->thread, NULL);
+            w->started = 0;
+        }
+    }
+    return NULL;
+}
+
+void
+parallel_ubf( void *arg)
+{
+    struct parallel_job *j = arg;
+    char errbuf[ 256];
+    int i;
+
+    j->interrupted = 1;
+    for (i = 0; i < j->n; ++i) {
+        struct parallel_worker *w = pg_parallel_worker( j, i);
+
+        if (w->started && w->cancel != NULL)
+            PQcancel( w->cancel, errbuf, sizeof errbuf);
+    }
+    if (j->wakeup != NULL)
+        (*j->wakeup)( j);
+}
+
+/*
+ * Remember the first error of a worker.  This is called from the
+ * worker's thread and must not touch any Ruby object.
+ */
+void
+pg_parallel_error( struct parallel_worker *w, PGresult *res)
+{
+    const char *msg;
+
+    if (w->errmsg != NULL)
+        return;
+    msg = res != NULL ? PQresultErrorMessage( res) : NULL;
+    if (msg == NULL || *msg == '\0')
+        msg = PQerrorMessage( w->conn);
+    w->errmsg = strdup( msg);
+}
+
+/*
+ * Collect the workers' errors as pairs <code>[ offset, message]</code>.
+ */
+VALUE
+pg_parallel_errors( struct parallel_job *j)
+{
+    VALUE ret;
+    int i;
+
+    ret = rb_ary_new();
+    for (i = 0; i < j->n; ++i) {
+        struct parallel_worker *w = pg_parallel_worker( j, i);
+
+        if (w->errmsg != NULL) {
+            struct pgconn_data *c = get_pgconn( RARRAY_AREF( j->conns, i));
+
+            rb_ary_push( ret, rb_assoc_new( LONG2NUM( w->erroffset),
+                                            pgconn_mkstring( c, w->errmsg)));
+        }
+    }
+    return ret;
+}
+
+int
+pg_parallel_workers( VALUE val)
+{
+    int n;
+
+    n = val == Qundef || NIL_P( val) ? PARALLEL_WORKERS : NUM2INT( val);
+    if (n < 1)
+        rb_raise( rb_eArgError, "Number of workers must be positive.");
+    return n;
+}
+
+void
+pg_parallel_raise( VALUE cls, VALUE errors)
+{
+    VALUE err;
+
+    err = rb_exc_new_str( cls, rb_sprintf( "%ld of the workers failed: %"PRIsVALUE,
+                    RARRAY_LEN( errors), RARRAY_AREF( RARRAY_AREF( errors, 0), 1)));
+    rb_ivar_set( err, id_errors, errors);
+    rb_exc_raise( err);
+}
+
+/*
+ * Evaluate the format: option.
+ */
+int
+parallel_format( VALUE val, int binary)
+{
+    ID f;
+
+    if (val == Qundef || NIL_P( val))
+        return FORMAT_TEXT;
+    f = rb_to_id( val);
+    if (f == id_text)
+        return FORMAT_TEXT;
+    if (f == id_csv)
+        return FORMAT_CSV;
+    if (f == id_binary && binary)
+        return FORMAT_BINARY;
+    rb_raise( rb_eArgError, "Unknown format: %"PRIsVALUE, val);
+    return FORMAT_TEXT;
+}
+
+/*
+ * The number of blocks the table has at the moment.
+ */
+long
+parallel_blocks( VALUE conn, VALUE table)
+{
+    VALUE blocks;
+
+    blocks = rb_funcall( conn, id_select_value, 2,
+            rb_str_new_cstr( "SELECT pg_relation_size( $1::regclass)"
+                             " / current_setting( 'block_size')::bigint;"),
+            table);
+    return NUM2LONG( rb_Integer( blocks));
+}
+
+/*
+ * A condition that selects the +i+th of +n+ ranges of blocks.  The first
+ * and the last range are open so that nothing gets lost when the table
+ * grows.  Returns +nil+ if there is just one range.
+ */
+VALUE
+parallel_ctid_range( long nblocks, int i, int n)
+{
+    VALUE ret;
+
+    ret = Qnil;
+    if (i > 0)
+        ret = rb_sprintf( "ctid >= '(%ld,0)'::tid", nblocks * i / n);
+    if (i < n - 1) {
+        if (NIL_P( ret))
+            ret = rb_str_new( NULL, 0);
+        else
+            rb_str_cat_cstr( ret, " AND ");
+        rb_str_catf( ret, "ctid < '(%ld,0)'::tid", nblocks * (i + 1) / n);
+    }
+    return ret;
+}
+
+
+
+/*
+ * Document-module: Pg::ParallelCopy
+ *
+ * Load large amounts of data over several connections at once.
+ */
+
+/*
+ * call-seq:
+ *    Pg::ParallelCopy.load( conn_params, table, source, workers: 4, format: :text, header: false)  -> int
+ *
+ * Split +source+ on line boundaries and stream the pieces concurrently
+ * over +workers+ connections using <code>COPY table FROM STDIN</code>.
+ * Returns the number of rows loaded.
+ *
+ *   File.open "big.csv" do |f|
+ *     Pg::ParallelCopy.load({ dbname: "dw"}, "facts", f,
+ *                                     workers: 8, format: :csv, header: true)
+ *   end
+ *
+ * +conn_params+ is what you would pass to Pg::Conn.new, or an open
+ * Pg::Conn whose parameters will be used.  +table+ will be inserted
+ * into the +COPY+ command as it is, so it may contain a column list.
+ *
+ * +source+ may be a String holding the data or an IO.  Regular files
+ * will be mapped into memory from their current position on; other IOs
+ * will be read completely first.  With <code>format: :csv</code>, quoted
+ * line breaks will be respected when splitting.
+ *
+ * Every connection runs in its own native thread without the GVL and
+ * commits its part on its own.  If some parts fail, a
+ * Pg::ParallelCopy::Error will be raised after all workers have finished;
+ * its +errors+ method returns pairs of the byte offset in +source+ where
+ * the failing line starts (or the part starts if that cannot be
+ * determined) and the error message.  The other parts stay loaded.
+ */
+VALUE
+pgparallelcopy_s_load( int argc, VALUE *argv, VALUE cls)
+{
+    VALUE params, table, source, opts;
+    ID kw[ 3];
+    VALUE kv[ 3];
+    int n, csv, state;
+    struct copy_source s;
+    struct copy_load l;
+    volatile VALUE cmd;
+    VALUE conns, bv;
+    long *bounds;
+    long skip;
+    int i;
+
+    rb_scan_args( argc, argv, "3:", &params, &table, &source, &opts);
+    kw[ 0] = id_workers, kw[ 1] = id_format, kw[ 2] = id_header;
+    kv[ 0] = kv[ 1] = kv[ 2] = Qundef;
+    if (!NIL_P( opts))
+        rb_get_kwargs( opts, kw, 0, 3, kv);
+    n = pg_parallel_workers( kv[ 0]);
+    csv = parallel_format( kv[ 1], 0);
+
+    cmd = rb_sprintf( "COPY %"PRIsVALUE" FROM STDIN%s;",
+                        rb_obj_as_string( table), format_options[ csv]);
+
+    copy_load_source( &s, source);
+    skip = kv[ 2] != Qundef && RTEST( kv[ 2]) ?
+                                    copy_record_len( s.data, s.len, csv) : 0;
+    bounds = ALLOCV_N( long, bv, n + 1);
+    n = copy_split( s.data + skip, s.len - skip, csv, n, bounds);
+    if (n == 0) {
+        ALLOCV_END( bv);
+        copy_unload_source( &s);
+        return INT2FIX( 0);
+    }
+
+    conns = rb_protect( &parallel_connect_n,
+                                rb_assoc_new( params, INT2FIX( n)), &state);
+    if (state) {
+        copy_unload_source( &s);
+        rb_jump_tag( state);
+    }
+
+    cmd = pgconn_encode_in4out( get_pgconn( RARRAY_AREF( conns, 0)), cmd);
+    l.cw = ALLOC_N( struct copy_worker, n);
+    pg_parallel_init( &l.j, conns, l.cw, sizeof *l.cw, &copy_worker_run);
+    for (i = 0; i < n; ++i) {
+        struct copy_worker *cw = l.cw + i;
+
+        cw->cmd   = RSTRING_PTR( cmd);
+        cw->start = skip + bounds[ i];
+        cw->data  = s.data + cw->start;
+        cw->len   = bounds[ i + 1] - bounds[ i];
+        cw->csv   = csv;
+        cw->rows  = 0;
+    }
+    ALLOCV_END( bv);
+    l.s      = &s;
+    l.rows   = 0;
+    l.errors = Qnil;
+    rb_ensure( &copy_load_run, (VALUE) &l, &copy_load_cleanup, (VALUE) &l);
+    RB_GC_GUARD( cmd);
+
+    if (RARRAY_LEN( l.errors) > 0)
+        pg_parallel_raise( rb_ePgParallelCopyError, l.errors);
+    return LONG2NUM( l.rows);
+}
+
+void
+copy_load_source( struct copy_source *s, VALUE source)
+{
+    VALUE f;
+
+    s->str    = Qnil;
+    s->map    = NULL;
+    s->maplen = 0;
+    f = TYPE( source) == T_STRING ? Qnil : rb_io_check_io( source);
+    if (!NIL_P( f)) {
+        rb_io_t *fptr;
+        struct stat st;
+        int fd;
+
+        GetOpenFile( f, fptr);
+        rb_io_check_readable( fptr);
+        fd = rb_io_descriptor( f);
+        if (!rb_io_read_pending( fptr) && fstat( fd, &st) == 0 &&
+                S_ISREG( st.st_mode) && st.st_size > 0) {
+            off_t pos;
+
+            pos = lseek( fd, 0, SEEK_CUR);
+            if (pos >= 0 && pos < st.st_size) {
+                s->map = mmap( NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+                if (s->map == MAP_FAILED)
+                    s->map = NULL;
+                else {
+                    s->maplen = st.st_size;
+                    s->data   = s->map + pos;
+                    s->len    = st.st_size - pos;
+                    lseek( fd, 0, SEEK_END);
+                    return;
+                }
+            }
+        }
+    }
+    if (TYPE( source) == T_STRING)
+        s->str = rb_str_new_frozen( source);
+    else {
+        static ID id_read = 0;
+        VALUE str;
+
+        if (id_read == 0)
+            id_read = rb_intern( "read");
+        str = rb_funcall( source, id_read, 0);
+        s->str = rb_str_new_frozen( StringValue( str));
+    }
+    s->data = RSTRING_PTR( s->str);
+    s->len  = RSTRING_LEN( s->str);
+}
+
+void
+copy_unload_source( struct copy_source *s)
+{
+    if (s->map != NULL) {
+        munmap( s->map, s->maplen);
+        s->map = NULL;
+    }
+    RB_GC_GUARD( s->str);
+}
+
+/*
+ * Length of the first record including its line break.  In CSV, line
+ * breaks inside quotes do not count.
+ */
+long
+copy_record_len( const char *p, long len, int csv)
+{
+    const char *q, *e;
+
+    if (!csv) {
+        q = memchr( p, '\n', len);
+        return q != NULL ? q - p + 1 : len;
+    }
+    for (q = p, e = p + len; q < e; ++q)
+        if (*q == '"') {
+            q = memchr( q + 1, '"', e - q - 1);
+            if (q == NULL)
+                return len;
+        } else if (*q == '\n')
+            return q - p + 1;
+    return len;
+}
+
+/*
+ * Fill +bounds+ with the start offsets of at most +n+ parts of roughly
+ * the same size, followed by +len+.  Returns the number of parts.
+ */
+int
+copy_split( const char *p, long len, int csv, int n, long *bounds)
+{
+    long pos, target;
+    int i, m;
+
+    for (m = 0, pos = 0, i = 1; pos < len; ++i) {
+        target = i < n ? len / n * i : len;
+        if (target <= pos)
+            continue;
+        bounds[ m++] = pos;
+        if (csv) {
+            while (pos < target)
+                pos += copy_record_len( p + pos, len - pos, csv);
+        } else {
+            const char *q = memchr( p + target - 1, '\n', len - target + 1);
+            pos = q != NULL ? q - p + 1 : len;
+        }
+    }
+    bounds[ m] = len;
+    return m;
+}
+
+/*
+ * Find the offset of the line the server complained about.  The context
+ * reads like "COPY tab, line 42, column ...".  The server counts
+ * CSV records, not physical lines, so do the same.
+ */
+long
+copy_error_offset( struct copy_worker *cw, PGresult *res)
+{
+    const char *ctx, *p;
+    long line, pos;
+
+    ctx = PQresultErrorField( res, PG_DIAG_CONTEXT);
+    if (ctx == NULL || (p = strstr( ctx, ", line ")) == NULL)
+        return cw->start;
+    line = strtol( p + 7, NULL, 10);
+    for (pos = 0; --line > 0 && pos < cw->len; )
+        pos += copy_record_len( cw->data + pos, cw->len - pos, cw->csv);
+    return cw->start + pos;
+}
+
+void *
+copy_worker_run( void *arg)
+{
+    struct copy_worker *cw = arg;
+    struct parallel_worker *w = &cw->w;
+    PGresult *res;
+    long pos, l;
+
+    res = PQexec( w->conn, cw->cmd);
+    if (PQresultStatus( res) != PGRES_COPY_IN) {
+        pg_parallel_error( w, res);
+        w->erroffset = cw->start;
+        PQclear( res);
+        return NULL;
+    }
+    PQclear( res);
+    for (pos = 0; pos < cw->len && !*w->interrupted; pos += l) {
+        l = cw->len - pos;
+        if (l > PARALLEL_CHUNK)
+            l = PARALLEL_CHUNK;
+        if (PQputCopyData( w->conn, cw->data + pos, l) < 0)
+            break;
+    }
+    PQputCopyEnd( w->conn, *w->interrupted ? "Interrupted." : NULL);
+    while ((res = PQgetResult( w->conn)) != NULL) {
+        if (PQresultStatus( res) == PGRES_COMMAND_OK)
+            cw->rows = strtol( PQcmdTuples( res), NULL, 10);
+        else if (w->errmsg == NULL) {
+            pg_parallel_error( w, res);
+            w->erroffset = copy_error_offset( cw, res);
+        }
+        PQclear( res);
+    }
+    return NULL;
+}
+
+VALUE
+copy_load_run( VALUE arg)
+{
+    struct copy_load *l = (struct copy_load *) arg;
+    int i;
+
+    pg_parallel_run( &l->j);
+    for (i = 0; i < l->j.n; ++i)
+        l->rows += l->cw[ i].rows;
+    l->errors = pg_parallel_errors( &l->j);
+    return Qnil;
+}
+
+VALUE
+copy_load_cleanup( VALUE arg)
+{
+    struct copy_load *l = (struct copy_load *) arg;
+
+    pg_parallel_cleanup( &l->j);
+    xfree( l->cw);
+    copy_unload_source( l->s);
+    return Qnil;
+}
+
+
+
+/*
+ * Document-module: Pg::ParallelExport
+ *
+ * Dump a table over several connections that share one snapshot.
+ */
+
+/*
+ * call-seq:
+ *    Pg::ParallelExport.run( conn_params, table, outputs, columns: nil, format: :text)  -> int
+ *
+ * Export +table+ with one connection per element of +outputs+.  A
+ * coordinating connection opens a repeatable read transaction and
+ * exports its snapshot by <code>pg_export_snapshot()</code>; the worker
+ * connections import it by <code>SET TRANSACTION SNAPSHOT</code>, so
+ * together they see exactly the same state of the table.  The table's
+ * blocks are divided into ranges of physical row positions (+ctid+) of
+ * the same size and every worker COPYs its range to its own output.
+ * Returns the total number of rows.
+ *
+ *   outs = (0...4).map { |i| File.open "facts.#{i}", "w" }
+ *   Pg::ParallelExport.run conn, "facts", outs, format: :csv
+ *
+ * +conn_params+ is the same as in Pg::ParallelCopy.load.  The +outputs+
+ * must be IO objects that have a file descriptor, because the workers
+ * write to them from native threads without the GVL.  +columns+ will be
+ * inserted into the statement as it is and defaults to <code>*</code>.
+ * +format+ may be <code>:text</code>, <code>:csv</code> or
+ * <code>:binary</code>; every output becomes a complete COPY stream that
+ * can be loaded on its own.
+ *
+ * The order of the rows within an output is not defined.  Block ranges
+ * are scanned efficiently since PostgreSQL 14; older servers read the
+ * whole table in every worker.
+ *
+ * If some workers fail, a Pg::ParallelExport::Error will be raised; its
+ * +errors+ are pairs of the index of the output and the message.
+ */
+VALUE
+pgparallelexport_s_run( int argc, VALUE *argv, VALUE cls)
+{
+    VALUE params, table, outputs, opts;
+    ID kw[ 2];
+    VALUE kv[ 2];
+    struct export_run e;
+    int *fds;
+    VALUE conns, fv;
+    int n, i;
+
+    rb_scan_args( argc, argv, "3:", &params, &table, &outputs, &opts);
+    kw[ 0] = id_columns, kw[ 1] = id_format;
+    kv[ 0] = kv[ 1] = Qundef;
+    if (!NIL_P( opts))
+        rb_get_kwargs( opts, kw, 0, 2, kv);
+    e.format  = parallel_format( kv[ 1], 1);
+    e.columns = kv[ 0] == Qundef || NIL_P( kv[ 0]) ?
+                            rb_str_new_cstr( "*") : rb_obj_as_string( kv[ 0]);
+    e.table   = rb_obj_as_string( table);
+
+    outputs = rb_convert_type( outputs, T_ARRAY, "Array", "to_ary");
+    n = RARRAY_LEN( outputs);
+    if (n < 1)
+        rb_raise( rb_eArgError, "No outputs given.");
+    fds = ALLOCV_N( int, fv, n);
+    for (i = 0; i < n; ++i) {
+        VALUE f;
+        rb_io_t *fptr;
+
+        f = rb_io_get_io( RARRAY_AREF( outputs, i));
+        GetOpenFile( f, fptr);
+        rb_io_check_writable( fptr);
+        rb_io_flush( f);
+        fds[ i] = rb_io_descriptor( f);
+    }
+
+    conns = pg_parallel_connect( params, n + 1);
+    e.coord  = rb_ary_shift( conns);
+    e.cmds   = rb_ary_new2( n);
+    e.ew     = ALLOC_N( struct export_worker, n);
+    pg_parallel_init( &e.j, conns, e.ew, sizeof *e.ew, &export_worker_run);
+    for (i = 0; i < n; ++i) {
+        e.ew[ i].w.erroffset = i;
+        e.ew[ i].fd          = fds[ i];
+        e.ew[ i].cmd         = NULL;
+        e.ew[ i].rows        = 0;
+    }
+    ALLOCV_END( fv);
+    e.rows   = 0;
+    e.errors = Qnil;
+    rb_ensure( &export_run, (VALUE) &e, &export_cleanup, (VALUE) &e);
+    RB_GC_GUARD( outputs);
+
+    if (RARRAY_LEN( e.errors) > 0)
+        pg_parallel_raise( rb_ePgParallelExportError, e.errors);
+    return LONG2NUM( e.rows);
+}
+
+VALUE
+export_run( VALUE arg)
+{
+    struct export_run *e = (struct export_run *) arg;
+    VALUE snap, set;
+    long nblocks;
+    int n, i;
+
+    rb_funcall( e->coord, id_exec, 1,
+            rb_str_new_cstr( "BEGIN ISOLATION LEVEL REPEATABLE READ READ ONLY;"));
+    snap = rb_funcall( e->coord, id_select_value, 1,
+            rb_str_new_cstr( "SELECT pg_export_snapshot();"));
+    nblocks = parallel_blocks( e->coord, e->table);
+
+    n = e->j.n;
+    set = rb_str_plus( rb_str_new_cstr( "SET TRANSACTION SNAPSHOT "),
+                                rb_funcall( e->coord, id_quote, 1, snap));
+    for (i = 0; i < n; ++i) {
+        VALUE c, cmd;
+
+        c = RARRAY_AREF( e->j.conns, i);
+        rb_funcall( c, id_exec, 1,
+            rb_str_new_cstr( "BEGIN ISOLATION LEVEL REPEATABLE READ READ ONLY;"));
+        rb_funcall( c, id_exec, 1, set);
+        cmd = export_command( e, parallel_ctid_range( nblocks, i, n));
+        rb_ary_push( e->cmds, cmd);
+        e->ew[ i].cmd = RSTRING_PTR( cmd);
+    }
+
+    pg_parallel_run( &e->j);
+    for (i = 0; i < n; ++i)
+        e->rows += e->ew[ i].rows;
+    e->errors = pg_parallel_errors( &e->j);
+    return Qnil;
+}
+
+VALUE
+export_cleanup( VALUE arg)
+{
+    struct export_run *e = (struct export_run *) arg;
+
+    pg_parallel_cleanup( &e->j);
+    xfree( e->ew);
+    rb_funcall( e->coord, id_close, 0);
+    return Qnil;
+}
+
+VALUE
+export_command( struct export_run *e, VALUE cond)
+{
+    VALUE cmd;
+
+    cmd = rb_sprintf( "COPY (SELECT %"PRIsVALUE" FROM %"PRIsVALUE,
+                                                        e->columns, e->table);
+    if (!NIL_P( cond))
+        rb_str_catf( cmd, " WHERE %"PRIsVALUE, cond);
+    rb_str_catf( cmd, ") TO STDOUT%s;", format_options[ e->format]);
+    return pgconn_encode_in4out( get_pgconn( e->coord), cmd);
+}
+
+int
+export_write( struct export_worker *ew, const char *p, long l)
+{
+    while (l > 0) {
+        ssize_t r;
+
+        r = write( ew->fd, p, l);
+        if (r < 0) {
+            if (errno == EINTR)
+                continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                struct pollfd pfd;
+
+                pfd.fd     = ew->fd;
+                pfd.events = POLLOUT;
+                if (*ew->w.interrupted)
+                    return EINTR;
+                poll( &pfd, 1, 100);
+                continue;
+            }
+            return errno;
+        }
+        p += r, l -= r;
+    }
+    return 0;
+}
+
+void *
+export_worker_run( void *arg)
+{
+    struct export_worker *ew = arg;
+    struct parallel_worker *w = &ew->w;
+    PGresult *res;
+    char *b;
+    int r, err;
+    char errbuf[ 256];
+
+    res = PQexec( w->conn, ew->cmd);
+    if (PQresultStatus( res) != PGRES_COPY_OUT) {
+        pg_parallel_error( w, res);
+        PQclear( res);
+        return NULL;
+    }
+    PQclear( res);
+    err = 0;
+    while ((r = PQgetCopyData( w->conn, &b, 0)) > 0) {
+        if (err == 0 && (err = export_write( ew, b, r)) != 0) {
+            w->errmsg = strdup( strerror( err));
+            PQcancel( w->cancel, errbuf, sizeof errbuf);
+        }
+        PQfreemem( b);
+    }
+    while ((res = PQgetResult( w->conn)) != NULL) {
+        if (PQresultStatus( res) == PGRES_COMMAND_OK)
+            ew->rows = strtol( PQcmdTuples( res), NULL, 10);
+        else
+            pg_parallel_error( w, res);
+        PQclear( res);
+    }
+    return NULL;
+}
+
+
+
+/*
+ * call-seq:
+ *    conn.parallel_scan( table, columns: nil, where: nil, partitions: 4, key: nil, batch: 1000) { |rows| ... }  -> int
+ *
+ * Read +table+ over +partitions+ further connections at once and yield
+ * the rows in batches of at most +batch+ rows as they arrive.  Returns
+ * the number of rows.
+ *
+ *   conn.parallel_scan "events", columns: "id, payload",
+ *                         where: "kind = 'click'", partitions: 8 do |rows|
+ *     rows.each { |id, payload| ... }
+ *   end
+ *
+ * The worker connections are opened with the parameters of +conn+ and
+ * closed afterwards.  Each of them declares a cursor over its part and
+ * fetches from it in a native thread without the GVL while the block
+ * runs.  The batches of the different parts are interleaved; within a
+ * part they keep the scan order.
+ *
+ * By default the table is split into ranges of blocks (+ctid+), which
+ * PostgreSQL 14 and later scan efficiently.  If a column name is given
+ * as +key+, the table will be split at the quantiles of that column
+ * taken from the +pg_stats+ histogram instead; this needs an index on
+ * +key+ and a recent +ANALYZE+ to be balanced.  Without statistics it
+ * falls back to block ranges.
+ *
+ * +columns+ and +where+ will be inserted into the query as they are.
+ * The parts are read in separate transactions and are not guaranteed to
+ * be consistent with each other; see Pg::ParallelExport for that.
+ *
+ * If some workers fail, a Pg::ParallelError will be raised after the
+ * others have finished; its +errors+ are pairs of the partition number
+ * and the message.
+ */
+VALUE
+pgconn_parallel_scan( int argc, VALUE *argv, VALUE self)
+{
+    VALUE table, opts;
+    ID kw[ 5];
+    VALUE kv[ 5];
+    VALUE columns, where, key, conds, conns;
+    struct scan_run s;
+    int n, batch, i;
+
+    rb_scan_args( argc, argv, "1:", &table, &opts);
+    RETURN_ENUMERATOR( self, argc, argv);
+    kw[ 0] = id_columns, kw[ 1] = id_where, kw[ 2] = id_partitions;
+    kw[ 3] = id_key, kw[ 4] = id_batch;
+    kv[ 0] = kv[ 1] = kv[ 2] = kv[ 3] = kv[ 4] = Qundef;
+    if (!NIL_P( opts))
+        rb_get_kwargs( opts, kw, 0, 5, kv);
+    table   = rb_obj_as_string( table);
+    columns = kv[ 0] == Qundef || NIL_P( kv[ 0]) ?
+                            rb_str_new_cstr( "*") : rb_obj_as_string( kv[ 0]);
+    where   = kv[ 1] == Qundef || NIL_P( kv[ 1]) ?
+                            Qnil : rb_obj_as_string( kv[ 1]);
+    n       = pg_parallel_workers( kv[ 2]);
+    key     = kv[ 3] == Qundef ? Qnil : kv[ 3];
+    batch   = kv[ 4] == Qundef || NIL_P( kv[ 4]) ?
+                            PARALLEL_BATCH : NUM2INT( kv[ 4]);
+    if (batch < 1)
+        rb_raise( rb_eArgError, "Batch size must be positive.");
+
+    conds = scan_conditions( self, table, key, n);
+    s.cmds = rb_ary_new2( n + 1);
+    rb_ary_push( s.cmds, pgconn_encode_in4out( get_pgconn( self),
+                rb_sprintf( "FETCH FORWARD %d FROM pg_parallel_scan;", batch)));
+    for (i = 0; i < n; ++i) {
+        VALUE cmd, cond;
+
+        cmd = rb_sprintf( "DECLARE pg_parallel_scan NO SCROLL CURSOR FOR"
+                          " SELECT %"PRIsVALUE" FROM %"PRIsVALUE, columns, table);
+        cond = RARRAY_AREF( conds, i);
+        if (!NIL_P( where) && !NIL_P( cond))
+            rb_str_catf( cmd, " WHERE (%"PRIsVALUE") AND (%"PRIsVALUE")",
+                                                                where, cond);
+        else if (!NIL_P( where) || !NIL_P( cond))
+            rb_str_catf( cmd, " WHERE %"PRIsVALUE, NIL_P( where) ? cond : where);
+        rb_str_cat_cstr( cmd, ";");
+        rb_ary_push( s.cmds, pgconn_encode_in4out( get_pgconn( self), cmd));
+    }
+
+    conns = pg_parallel_connect( self, n);
+    s.sw = ALLOC_N( struct scan_worker, n);
+    pg_parallel_init( &s.j, conns, s.sw, sizeof *s.sw, &scan_worker_run);
+    s.j.wakeup = &scan_wakeup;
+    for (i = 0; i < n; ++i) {
+        s.sw[ i].w.erroffset = i;
+        s.sw[ i].s           = &s;
+        s.sw[ i].cmd         = RSTRING_PTR( RARRAY_AREF( s.cmds, i + 1));
+    }
+    s.conn    = self;
+    s.fetch   = RSTRING_PTR( RARRAY_AREF( s.cmds, 0));
+    s.cap     = 2 * n;
+    s.queue   = ALLOC_N( PGresult *, s.cap);
+    s.head    = 0;
+    s.count   = 0;
+    s.active  = n;
+    s.current = NULL;
+    s.rows    = 0;
+    pthread_mutex_init( &s.lock, NULL);
+    pthread_cond_init( &s.cond, NULL);
+    rb_ensure( &scan_run, (VALUE) &s, &scan_cleanup, (VALUE) &s);
+    RB_GC_GUARD( s.cmds);
+    return LONG2NUM( s.rows);
+}
+
+/*
+ * One condition (or +nil+) for every partition.
+ */
+VALUE
+scan_conditions( VALUE conn, VALUE table, VALUE key, int n)
+{
+    VALUE ret, bounds, k;
+    long nblocks, m;
+    int i;
+
+    ret = rb_ary_new2( n);
+    if (!NIL_P( key)) {
+        bounds = rb_funcall( conn, id_select_values, 3, rb_str_new_cstr(
+                "SELECT unnest( s.histogram_bounds::text::text[])"
+                " FROM pg_stats s"
+                " JOIN pg_class c ON c.relname = s.tablename"
+                " JOIN pg_namespace n ON n.oid = c.relnamespace"
+                                    " AND n.nspname = s.schemaname"
+                " WHERE c.oid = $1::regclass AND s.attname = $2;"),
+                table, rb_obj_as_string( key));
+        m = RARRAY_LEN( bounds);
+        if (m > 1) {
+            k = rb_funcall( conn, id_quote_identifier, 1, rb_obj_as_string( key));
+            for (i = 0; i < n; ++i) {
+                VALUE c, lo, hi;
+
+                lo = i > 0     ? RARRAY_AREF( bounds, (m - 1) *  i      / n) : Qnil;
+                hi = i < n - 1 ? RARRAY_AREF( bounds, (m - 1) * (i + 1) / n) : Qnil;
+                if (NIL_P( lo) && NIL_P( hi))
+                    c = Qnil;
+                else if (NIL_P( lo))
+                    c = rb_sprintf( "%"PRIsVALUE" < %"PRIsVALUE" OR %"PRIsVALUE" IS NULL",
+                                    k, rb_funcall( conn, id_quote, 1, hi), k);
+                else if (NIL_P( hi))
+                    c = rb_sprintf( "%"PRIsVALUE" >= %"PRIsVALUE,
+                                    k, rb_funcall( conn, id_quote, 1, lo));
+                else
+                    c = rb_sprintf( "%"PRIsVALUE" >= %"PRIsVALUE" AND %"PRIsVALUE" < %"PRIsVALUE,
+                                    k, rb_funcall( conn, id_quote, 1, lo),
+                                    k, rb_funcall( conn, id_quote, 1, hi));
+                rb_ary_push( ret, c);
+            }
+            return ret;
+        }
+    }
+    nblocks = parallel_blocks( conn, table);
+    for (i = 0; i < n; ++i)
+        rb_ary_push( ret, parallel_ctid_range( nblocks, i, n));
+    return ret;
+}
+
+VALUE
+scan_run( VALUE arg)
+{
+    struct scan_run *s = (struct scan_run *) arg;
+    VALUE errors;
+
+    pg_parallel_start( &s->j);
+    for (;;) {
+        VALUE res, rows;
+        struct pgresult_data *r;
+        int i, m;
+
+        rb_thread_call_without_gvl( &scan_pop, s, &parallel_ubf, &s->j);
+        rb_thread_check_ints();
+        if (s->current == NULL)
+            break;
+        res = pgresult_new( s->current, s->conn, Qnil, Qnil);
+        s->current = NULL;
+        TypedData_Get_Struct( res, struct pgresult_data, &pgresult_data_data_type, r);
+        m = PQntuples( r->res);
+        rows = rb_ary_new2( m);
+        for (i = 0; i < m; ++i)
+            rb_ary_push( rows, pg_fetchrow( r, i));
+        pgresult_clear( res);
+        s->rows += m;
+        rb_yield( rows);
+    }
+    pg_parallel_wait( &s->j);
+    errors = pg_parallel_errors( &s->j);
+    if (RARRAY_LEN( errors) > 0)
+        pg_parallel_raise( rb_ePgParallelError, errors);
+    if (s->j.interrupted)
+        rb_raise( rb_ePgError, "Parallel scan was interrupted.");
+    return Qnil;
+}
+
+VALUE
+scan_cleanup( VALUE arg)
+{
+    struct scan_run *s = (struct scan_run *) arg;
+
+    pg_parallel_cleanup( &s->j);
+    if (s->current != NULL)
+        PQclear( s->current);
+    for (; s->count; --s->count) {
+        PQclear( s->queue[ s->head]);
+        s->head = (s->head + 1) % s->cap;
+    }
+    pthread_cond_destroy( &s->cond);
+    pthread_mutex_destroy( &s->lock);
+    xfree( s->queue);
+    xfree( s->sw);
+    return Qnil;
+}
+
+void
+scan_wakeup( struct parallel_job *j)
+{
+    struct scan_run *s = (struct scan_run *) j;
+
+    pthread_mutex_lock( &s->lock);
+    pthread_cond_broadcast( &s->cond);
+    pthread_mutex_unlock( &s->lock);
+}
+
+void *
+scan_pop( void *arg)
+{
+    struct scan_run *s = arg;
+
+    pthread_mutex_lock( &s->lock);
+    while (s->count == 0 && s->active > 0 && !s->j.interrupted)
+        pthread_cond_wait( &s->cond, &s->lock);
+    if (s->count > 0 && !s->j.interrupted) {
+        s->current = s->queue[ s->head];
+        s->head = (s->head + 1) % s->cap;
+        --s->count;
+        pthread_cond_broadcast( &s->cond);
+    }
+    pthread_mutex_unlock( &s->lock);
+    return NULL;
+}
+
+/*
+ * Hand a result over to the main thread.  Waits while the queue is full
+ * so that a slow block holds back the workers.
+ */
+int
+scan_push( struct scan_run *s, volatile int *interrupted, PGresult *res)
+{
+    int ok;
+
+    pthread_mutex_lock( &s->lock);
+    while (s->count == s->cap && !*interrupted)
+        pthread_cond_wait( &s->cond, &s->lock);
+    ok = !*interrupted;
+    if (ok) {
+        s->queue[ (s->head + s->count) % s->cap] = res;
+        ++s->count;
+        pthread_cond_broadcast( &s->cond);
+    }
+    pthread_mutex_unlock( &s->lock);
+    return ok;
+}
+
+int
+scan_exec( struct parallel_worker *w, const char *cmd)
+{
+    PGresult *res;
+    int ok;
+
+    res = PQexec( w->conn, cmd);
+    ok = PQresultStatus( res) == PGRES_COMMAND_OK;
+    if (!ok)
+        pg_parallel_error( w, res);
+    PQclear( res);
+    return ok;
+}
+
+void *
+scan_worker_run( void *arg)
+{
+    struct scan_worker *sw = arg;
+    struct parallel_worker *w = &sw->w;
+    struct scan_run *s = sw->s;
+    PGresult *res;
+
+    if (scan_exec( w, "BEGIN READ ONLY;") && scan_exec( w, sw->cmd))
+        while (!*w->interrupted) {
+            res = PQexec( w->conn, s->fetch);
+            if (PQresultStatus( res) != PGRES_TUPLES_OK) {
+                pg_parallel_error( w, res);
+                PQclear( res);
+                break;
+            }
+            if (PQntuples( res) == 0 || !scan_push( s, w->interrupted, res)) {
+                PQclear( res);
+                break;
+            }
+        }
+    PQclear( PQexec( w->conn, "ROLLBACK;"));
+
+    pthread_mutex_lock( &s->lock);
+    --s->active;
+    pthread_cond_broadcast( &s->cond);
+    pthread_mutex_unlock( &s->lock);
+    return NULL;
+}
+
+
+/*
+ * Document-class: Pg::ParallelError
+ *
+ * One or more workers of a parallel operation failed.  The +errors+
+ * method returns pairs of an offset and the error message.
+ */
+
+/*
+ * Document-class: Pg::ParallelCopy::Error
+ *
+ * Some parts of a Pg::ParallelCopy.load could not be loaded.
+ */
+
+/*
+ * Document-class: Pg::ParallelExport::Error
+ *
+ * Some workers of a Pg::ParallelExport.run failed.
+ */
+
+void
+Init_pgsql_parallel( void)
+{
+    rb_ePgParallelError = rb_define_class_under( rb_mPg, "ParallelError",
+                                                                rb_ePgError);
+    rb_define_attr( rb_ePgParallelError, "errors", 1, 0);
+
+    rb_mPgParallelCopy = rb_define_module_under( rb_mPg, "ParallelCopy");
+    rb_ePgParallelCopyError = rb_define_class_under( rb_mPgParallelCopy,
+                                            "Error", rb_ePgParallelError);
+    rb_define_singleton_method( rb_mPgParallelCopy, "load",
+                                            &pgparallelcopy_s_load, -1);
+
+    rb_mPgParallelExport = rb_define_module_under( rb_mPg, "ParallelExport");
+    rb_ePgParallelExportError = rb_define_class_under( rb_mPgParallelExport,
+                                            "Error", rb_ePgParallelError);
+    rb_define_singleton_method( rb_mPgParallelExport, "run",
+                                            &pgparallelexport_s_run, -1);
+
+    rb_define_method( rb_cPgConn, "parallel_scan", &pgconn_parallel_scan, -1);
+
+    id_close    = rb_intern( "close");
+    id_errors   = rb_intern( "@errors");
+    id_workers  = rb_intern( "workers");
+    id_format   = rb_intern( "format");
+    id_header   = rb_intern( "header");
+    id_text     = rb_intern( "text");
+    id_csv      = rb_intern( "csv");
+    id_binary   = rb_intern( "binary");
+    id_columns  = rb_intern( "columns");
+    id_exec     = rb_intern( "exec");
+    id_select_value = rb_intern( "select_value");
+    id_quote    = rb_intern( "quote");
+    id_quote_identifier = rb_intern( "quote_identifier");
+    id_select_values = rb_intern( "select_values");
+    id_where    = rb_intern( "where");
+    id_partitions = rb_intern( "partitions");
+    id_key      = rb_intern( "key");
+    id_batch    = rb_intern( "batch");
+}
+
@@ -0,0 +1,56 @@
+/*
+ *  parallel.h  --  Work distributed over several connections
+ */
+
+#ifndef __PARALLEL_H
+#define __PARALLEL_H
+
+#include "conn.h"
+
+#include <pthread.h>
+
+
+/*
+ * Every kind of worker starts with this.  The worker's thread runs
+ * without the GVL and must not call any Ruby function.
+ */
+struct parallel_worker {
+    PGconn       *conn;
+    PGcancel     *cancel;
+    pthread_t     thread;
+    int           started;
+    volatile int *interrupted;
+    char         *errmsg;
+    long          erroffset;
+};
+
+struct parallel_job {
+    VALUE          conns;
+    char          *workers;
+    size_t         size;
+    int            n;
+    void        *(*func)( void *);
+    void         (*wakeup)( struct parallel_job *);
+    volatile int   interrupted;
+};
+
+
+extern VALUE rb_ePgParallelError;
+
+
+extern VALUE pg_parallel_connect( VALUE params, int n);
+extern void  pg_parallel_init( struct parallel_job *j, VALUE conns, void *workers, size_t size, void *(*func)( void *));
+extern struct parallel_worker *pg_parallel_worker( struct parallel_job *j, int i);
+extern void  pg_parallel_start( struct parallel_job *j);
+extern void  pg_parallel_wait( struct parallel_job *j);
+extern void  pg_parallel_run( struct parallel_job *j);
+extern void  pg_parallel_cleanup( struct parallel_job *j);
+extern void  pg_parallel_error( struct parallel_worker *w, PGresult *res);
+extern VALUE pg_parallel_errors( struct parallel_job *j);
+extern int   pg_parallel_workers( VALUE val);
+extern void  pg_parallel_raise( VALUE cls, VALUE errors);
+
+extern void Init_pgsql_parallel( void);
+
+#endif
+
@@ -0,0 +1,581 @@
+/*
+ *  pgoutput.c  --  Decoder for the pgoutput logical replication plugin
+ */
+
+
+#include "pgoutput.h"
+
+#include "conn_repl.h"
+#include "result.h"
+#include "binary.h"
+
+
+struct pgoutput_data {
+    VALUE conn;
+    VALUE relations;
+    VALUE plans;            /* OID => column decoders */
+    VALUE scratch;
+};
+
+struct pgoutput_reader {
+    const char *p;
+    const char *e;
+};
+
+
+static void   pgoutput_mark( void *ptr);
+static size_t pgoutput_memsize( const void *ptr);
+static VALUE  pgoutput_alloc( VALUE cls);
+static struct pgoutput_data *get_pgoutput( VALUE obj);
+
+static VALUE pgoutput_init( VALUE self, VALUE conn);
+static VALUE pgoutput_relations( VALUE self);
+static VALUE pgoutput_decode( VALUE self, VALUE data);
+
+static void        rd_need(   struct pgoutput_reader *r, long n);
+static int         rd_int8(   struct pgoutput_reader *r);
+static int         rd_int16(  struct pgoutput_reader *r);
+static long        rd_int32(  struct pgoutput_reader *r);
+static long long   rd_int64(  struct pgoutput_reader *r);
+static VALUE       rd_lsn(    struct pgoutput_reader *r);
+static VALUE       rd_time(   struct pgoutput_reader *r);
+static VALUE       rd_string( struct pgoutput_reader *r, struct pgconn_data *c);
+static VALUE       rd_relation( struct pgoutput_reader *r, struct pgoutput_data *d, VALUE *plan);
+static VALUE       rd_tuple(  struct pgoutput_reader *r, struct pgoutput_data *d, VALUE plan);
+
+static VALUE decode_relation( struct pgoutput_reader *r, struct pgoutput_data *d);
+
+
+static VALUE rb_cPgOutput;
+
+static VALUE rb_cPgBegin;
+static VALUE rb_cPgCommit;
+static VALUE rb_cPgOrigin;
+static VALUE rb_cPgRelation;
+static VALUE rb_cPgColumn;
+static VALUE rb_cPgType;
+static VALUE rb_cPgInsert;
+static VALUE rb_cPgUpdate;
+static VALUE rb_cPgDelete;
+static VALUE rb_cPgTruncate;
+static VALUE rb_cPgMessage;
+
+static VALUE pg_unchanged;
+
+static ID id_data;
+
+
+static const rb_data_type_t pgoutput_data_data_type = {
+    "pgsql:pgoutput",
+    { &pgoutput_mark, RUBY_TYPED_DEFAULT_FREE, &pgoutput_memsize,},
+    0, 0, RUBY_TYPED_FREE_IMMEDIATELY
+};
+
+
+
+void
+pgoutput_mark( void *ptr)
+{
+    struct pgoutput_data *d = ptr;
+
+    rb_gc_mark( d->conn);
+    rb_gc_mark( d->relations);
+    rb_gc_mark( d->plans);
+    rb_gc_mark( d->scratch);
+}
+
+size_t
+pgoutput_memsize( const void *ptr)
+{
+    return sizeof (struct pgoutput_data);
+}
+
+VALUE
+pgoutput_alloc( VALUE cls)
+{
+    struct pgoutput_data *d;
+    VALUE obj;
+
+    obj = TypedData_Make_Struct( cls, struct pgoutput_data, &pgoutput_data_data_type, d);
+    d->conn      = Qnil;
+    d->relations = Qnil;
+    d->plans     = Qnil;
+    d->scratch   = Qnil;
+    return obj;
+}
+
+struct pgoutput_data *
+get_pgoutput( VALUE obj)
+{
+    struct pgoutput_data *d;
+
+    TypedData_Get_Struct( obj, struct pgoutput_data, &pgoutput_data_data_type, d);
+    if (NIL_P( d->conn))
+        rb_raise( rb_ePgError, "Decoder is not initialized.");
+    return d;
+}
+
+
+/*
+ * Document-class: Pg::Replication::PgOutput
+ *
+ * Decodes the messages of the +pgoutput+ plugin (protocol version 1)
+ * that arrive through Pg::Conn#start_replication.
+ *
+ *   c = Pg::Conn.new dbname: "shop", replication: "database"
+ *   dec = Pg::Replication::PgOutput.new c
+ *   c.start_replication "search_index", nil,
+ *           proto_version: 1, publication_names: "products" do |x|
+ *     case (m = dec.decode x)
+ *       when Pg::Replication::Insert then
+ *         index m.relation.name, m.new
+ *       when Pg::Replication::Commit then
+ *         c.flush_lsn = m.end_lsn
+ *     end
+ *   end
+ *
+ * Relation messages are remembered by their OID so that the changes
+ * can refer to them.  Column values are converted like query results;
+ * see Pg::Conn#translate_results=.  The converters are chosen when the
+ * Relation message arrives.  Values of unchanged TOASTed columns in
+ * updates are Pg::Replication::UNCHANGED.
+ */
+
+/*
+ * call-seq:
+ *    Pg::Replication::PgOutput.new( conn)  -> decoder
+ *
+ * Create a decoder.  +conn+ determines the string encodings.
+ */
+VALUE
+pgoutput_init( VALUE self, VALUE conn)
+{
+    struct pgoutput_data *d;
+
+    TypedData_Get_Struct( self, struct pgoutput_data, &pgoutput_data_data_type, d);
+    get_pgconn( conn);
+    d->conn      = conn;
+    d->relations = rb_hash_new();
+    d->plans     = rb_hash_new();
+    d->scratch   = rb_str_buf_new( 0);
+    return self;
+}
+
+/*
+ * call-seq:
+ *    decoder.relations()  -> hash
+ *
+ * The Pg::Replication::Relation messages seen so far, keyed by OID.
+ */
+VALUE
+pgoutput_relations( VALUE self)
+{
+    return get_pgoutput( self)->relations;
+}
+
+/*
+ * call-seq:
+ *    decoder.decode( data)  -> message
+ *
+ * Decode one message.  +data+ may be a String or a
+ * Pg::Replication::XLogData.
+ */
+VALUE
+pgoutput_decode( VALUE self, VALUE data)
+{
+    struct pgoutput_data *d;
+    struct pgconn_data *c;
+    struct pgoutput_reader r;
+    VALUE ret;
+
+    d = get_pgoutput( self);
+    c = get_pgconn( d->conn);
+    if (TYPE( data) != T_STRING)
+        data = rb_funcall( data, id_data, 0);
+    StringValue( data);
+    r.p = RSTRING_PTR( data);
+    r.e = r.p + RSTRING_LEN( data);
+
+    switch (rd_int8( &r)) {
+        case 'B':
+            {
+                VALUE lsn, tm;
+
+                lsn = rd_lsn( &r);
+                tm  = rd_time( &r);
+                ret = rb_struct_new( rb_cPgBegin, lsn, tm,
+                                            UINT2NUM( (unsigned int) rd_int32( &r)));
+            }
+            break;
+        case 'C':
+            {
+                VALUE lsn, end;
+
+                rd_int8( &r);
+                lsn = rd_lsn( &r);
+                end = rd_lsn( &r);
+                ret = rb_struct_new( rb_cPgCommit, lsn, end, rd_time( &r));
+            }
+            break;
+        case 'O':
+            {
+                VALUE lsn;
+
+                lsn = rd_lsn( &r);
+                ret = rb_struct_new( rb_cPgOrigin, lsn, rd_string( &r, c));
+            }
+            break;
+        case 'R':
+            ret = decode_relation( &r, d);
+            break;
+        case 'Y':
+            {
+                VALUE oid, nsp;
+
+                oid = UINT2NUM( (unsigned int) rd_int32( &r));
+                nsp = rd_string( &r, c);
+                ret = rb_struct_new( rb_cPgType, oid, nsp, rd_string( &r, c));
+            }
+            break;
+        case 'I':
+            {
+                VALUE rel, plan;
+
+                rel = rd_relation( &r, d, &plan);
+                if (rd_int8( &r) != 'N')
+                    rb_raise( rb_ePgError, "Malformed pgoutput insert message.");
+                ret = rb_struct_new( rb_cPgInsert, rel, rd_tuple( &r, d, plan));
+            }
+            break;
+        case 'U':
+            {
+                VALUE rel, plan, key, old;
+                int t;
+
+                rel = rd_relation( &r, d, &plan);
+                key = old = Qnil;
+                t = rd_int8( &r);
+                if (t == 'K' || t == 'O') {
+                    if (t == 'K')
+                        key = rd_tuple( &r, d, plan);
+                    else
+                        old = rd_tuple( &r, d, plan);
+                    t = rd_int8( &r);
+                }
+                if (t != 'N')
+                    rb_raise( rb_ePgError, "Malformed pgoutput update message.");
+                ret = rb_struct_new( rb_cPgUpdate, rel, key, old, rd_tuple( &r, d, plan));
+            }
+            break;
+        case 'D':
+            {
+                VALUE rel, plan, key, old;
+                int t;
+
+                rel = rd_relation( &r, d, &plan);
+                key = old = Qnil;
+                t = rd_int8( &r);
+                if (t == 'K')
+                    key = rd_tuple( &r, d, plan);
+                else if (t == 'O')
+                    old = rd_tuple( &r, d, plan);
+                else
+                    rb_raise( rb_ePgError, "Malformed pgoutput delete message.");
+                ret = rb_struct_new( rb_cPgDelete, rel, key, old);
+            }
+            break;
+        case 'T':
+            {
+                VALUE rels;
+                long n;
+                int opts;
+
+                n = rd_int32( &r);
+                opts = rd_int8( &r);
+                rels = rb_ary_new2( n);
+                for (; n > 0; --n)
+                    rb_ary_push( rels, rd_relation( &r, d, NULL));
+                ret = rb_struct_new( rb_cPgTruncate, rels,
+                                            opts & 1 ? Qtrue : Qfalse,
+                                            opts & 2 ? Qtrue : Qfalse);
+            }
+            break;
+        case 'M':
+            {
+                VALUE tr, lsn, prefix;
+                long l;
+
+                tr = rd_int8( &r) & 1 ? Qtrue : Qfalse;
+                lsn = rd_lsn( &r);
+                prefix = rd_string( &r, c);
+                l = rd_int32( &r);
+                rd_need( &r, l);
+                ret = rb_struct_new( rb_cPgMessage, tr, lsn, prefix,
+                                            rb_str_new( r.p, l));
+                r.p += l;
+            }
+            break;
+        default:
+            rb_raise( rb_ePgError, "Unknown pgoutput message type '%c'.",
+                                                    *RSTRING_PTR( data));
+            break;
+    }
+    RB_GC_GUARD( data);
+    return ret;
+}
+
+VALUE
+decode_relation( struct pgoutput_reader *r, struct pgoutput_data *d)
+{
+    struct pgconn_data *c;
+    struct pg_column *pc;
+    VALUE oid, nsp, name, cols, plan, ret;
+    char ident;
+    int n, i;
+
+    c = get_pgconn( d->conn);
+    oid   = UINT2NUM( (unsigned int) rd_int32( r));
+    nsp   = rd_string( r, c);
+    name  = rd_string( r, c);
+    ident = (char) rd_int8( r);
+    n     = rd_int16( r);
+    cols = rb_ary_new2( n);
+    plan = pg_plan_new( n, &pc);
+    for (i = 0; i < n; ++i) {
+        VALUE key, cname;
+        Oid typ;
+        int typmod;
+
+        key    = rd_int8( r) & 1 ? Qtrue : Qfalse;
+        cname  = rd_string( r, c);
+        typ    = (Oid) rd_int32( r);
+        typmod = (int) rd_int32( r);
+        pg_column_init( pc + i, c, typ, typmod, 0);
+        rb_ary_push( cols, rb_struct_new( rb_cPgColumn, cname,
+                            UINT2NUM( typ), INT2FIX( typmod), key));
+    }
+    rb_ary_freeze( cols);
+    ret = rb_struct_new( rb_cPgRelation, oid, nsp, name,
+                            rb_str_new( &ident, 1), cols);
+    rb_hash_aset( d->relations, oid, ret);
+    rb_hash_aset( d->plans, oid, plan);
+    return ret;
+}
+
+
+void
+rd_need( struct pgoutput_reader *r, long n)
+{
+    if (n < 0 || r->e - r->p < n)
+        rb_raise( rb_ePgError, "Malformed pgoutput message.");
+}
+
+int
+rd_int8( struct pgoutput_reader *r)
+{
+    rd_need( r, 1);
+    return (unsigned char) *r->p++;
+}
+
+int
+rd_int16( struct pgoutput_reader *r)
+{
+    int ret;
+
+    rd_need( r, 2);
+    ret = pg_get_int16( r->p);
+    r->p += 2;
+    return ret;
+}
+
+long
+rd_int32( struct pgoutput_reader *r)
+{
+    long ret;
+
+    rd_need( r, 4);
+    ret = pg_get_int32( r->p);
+    r->p += 4;
+    return ret;
+}
+
+long long
+rd_int64( struct pgoutput_reader *r)
+{
+    long long ret;
+
+    rd_need( r, 8);
+    ret = pg_get_int64( r->p);
+    r->p += 8;
+    return ret;
+}
+
+VALUE
+rd_lsn( struct pgoutput_reader *r)
+{
+    return ULL2NUM( (unsigned long long) rd_int64( r));
+}
+
+VALUE
+rd_time( struct pgoutput_reader *r)
+{
+    return pg_binary_timestamp( rd_int64( r), 1);
+}
+
+VALUE
+rd_string( struct pgoutput_reader *r, struct pgconn_data *c)
+{
+    const char *z;
+    VALUE ret;
+
+    z = memchr( r->p, '\0', r->e - r->p);
+    if (z == NULL)
+        rb_raise( rb_ePgError, "Malformed pgoutput message.");
+    ret = pgconn_mkstringn( c, r->p, z - r->p);
+    r->p = z + 1;
+    return ret;
+}
+
+/*
+ * Look up the relation a change refers to.  If +plan+ is given, it gets
+ * the column decoders built when the Relation message was read.
+ */
+VALUE
+rd_relation( struct pgoutput_reader *r, struct pgoutput_data *d, VALUE *plan)
+{
+    VALUE oid, ret;
+
+    oid = UINT2NUM( (unsigned int) rd_int32( r));
+    ret = rb_hash_lookup2( d->relations, oid, Qundef);
+    if (ret == Qundef)
+        rb_raise( rb_ePgError, "Change refers to unknown relation %"PRIsVALUE".", oid);
+    if (plan != NULL)
+        *plan = rb_hash_aref( d->plans, oid);
+    return ret;
+}
+
+/*
+ * Read the column values.  Text values are converted like query results
+ * by their column's type; binary values like binary COPY data.
+ */
+VALUE
+rd_tuple( struct pgoutput_reader *r, struct pgoutput_data *d, VALUE plan)
+{
+    struct pgconn_data *c;
+    const struct pg_column *cols, *col;
+    struct pg_column none;
+    VALUE ret;
+    int ncols, n, i;
+
+    c = get_pgconn( d->conn);
+    cols = pg_plan_columns( plan, &ncols);
+    pg_column_init( &none, c, InvalidOid, -1, 0);
+    n = rd_int16( r);
+    ret = rb_ary_new2( n);
+    for (i = 0; i < n; ++i) {
+        VALUE v;
+        int kind;
+        long l;
+
+        col = i < ncols ? cols + i : &none;
+        kind = rd_int8( r);
+        switch (kind) {
+            case 'n':
+                v = Qnil;
+                break;
+            case 'u':
+                v = pg_unchanged;
+                break;
+            case 't':
+            case 'b':
+                l = rd_int32( r);
+                rd_need( r, l);
+                if (kind == 'b')
+                    v = pg_binary_value( c, r->p, l, col->typ, col->typmod);
+                else {
+                    char *s;
+
+                    rb_str_resize( d->scratch, l);
+                    s = RSTRING_PTR( d->scratch);
+                    memcpy( s, r->p, l);
+                    s[ l] = '\0';
+                    v = (*col->decode)( c, s, l, col);
+                }
+                r->p += l;
+                break;
+            default:
+                rb_raise( rb_ePgError, "Malformed pgoutput tuple data.");
+                break;
+        }
+        rb_ary_push( ret, v);
+    }
+    return ret;
+}
+
+
+
+/*
+ * Document-class: Pg::Replication::Begin
+ *
+ * Start of a transaction: final LSN, commit time and transaction id.
+ */
+
+/*
+ * Document-class: Pg::Replication::Commit
+ *
+ * End of a transaction.  Acknowledge +end_lsn+ after it is processed.
+ */
+
+/*
+ * Document-class: Pg::Replication::Relation
+ *
+ * Describes a table.  +columns+ holds Pg::Replication::Column structs;
+ * +replica_identity+ is one of <code>"d"</code>, <code>"n"</code>,
+ * <code>"f"</code> or <code>"i"</code>.
+ */
+
+/*
+ * Document-class: Pg::Replication::Update
+ *
+ * +key+ holds the old key columns if the key changed, +old+ the old row
+ * for tables with <code>REPLICA IDENTITY FULL</code>; both may be +nil+.
+ */
+
+void
+Init_pgsql_pgoutput( void)
+{
+
+#ifdef RDOC_NEEDS_THIS
+    rb_mPgReplication = rb_define_module_under( rb_mPg, "Replication");
+#endif
+
+    rb_cPgOutput = rb_define_class_under( rb_mPgReplication, "PgOutput", rb_cObject);
+    rb_define_alloc_func( rb_cPgOutput, pgoutput_alloc);
+    rb_define_method( rb_cPgOutput, "initialize", &pgoutput_init, 1);
+    rb_define_method( rb_cPgOutput, "relations", &pgoutput_relations, 0);
+    rb_define_method( rb_cPgOutput, "decode", &pgoutput_decode, 1);
+
+#define STRUCT_DEF( c, n, ...) \
+    c = rb_struct_define_under( rb_mPgReplication, n, __VA_ARGS__, NULL)
+    STRUCT_DEF( rb_cPgBegin,    "Begin",    "final_lsn", "time", "xid");
+    STRUCT_DEF( rb_cPgCommit,   "Commit",   "lsn", "end_lsn", "time");
+    STRUCT_DEF( rb_cPgOrigin,   "Origin",   "lsn", "name");
+    STRUCT_DEF( rb_cPgRelation, "Relation", "oid", "namespace", "name",
+                                            "replica_identity", "columns");
+    STRUCT_DEF( rb_cPgColumn,   "Column",   "name", "type", "typmod", "key");
+    STRUCT_DEF( rb_cPgType,     "Type",     "oid", "namespace", "name");
+    STRUCT_DEF( rb_cPgInsert,   "Insert",   "relation", "new");
+    STRUCT_DEF( rb_cPgUpdate,   "Update",   "relation", "key", "old", "new");
+    STRUCT_DEF( rb_cPgDelete,   "Delete",   "relation", "key", "old");
+    STRUCT_DEF( rb_cPgTruncate, "Truncate", "relations", "cascade",
+                                            "restart_identity");
+    STRUCT_DEF( rb_cPgMessage,  "Message",  "transactional", "lsn", "prefix",
+                                            "content");
+#undef STRUCT_DEF
+
+    pg_unchanged = rb_obj_freeze( rb_obj_alloc( rb_cObject));
+    rb_define_const( rb_mPgReplication, "UNCHANGED", pg_unchanged);
+
+    id_data = rb_intern( "data");
+}
+
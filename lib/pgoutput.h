@@ -0,0 +1,14 @@
+/*
+ *  pgoutput.h  --  Decoder for the pgoutput logical replication plugin
+ */
+
+#ifndef __PGOUTPUT_H
+#define __PGOUTPUT_H
+
+#include "conn.h"
+
+
+extern void Init_pgsql_pgoutput( void);
+
+#endif
+
@@ -6,6 +6,14 @@
 #include "result.h"
 
 #include "conn_quote.h"
+#include "binary.h"
+#include "datetime.h"
+#include "json.h"
+#include "typemap.h"
+#include "row.h"
+
+#include <math.h>
+#include <limits.h>
 
 
 static VALUE pgreserror_new( VALUE result, VALUE cmd, VALUE par);
@@ -32,15 +40,68 @@ extern VALUE pgresult_clear( VALUE self);
 static VALUE pgresult_status( VALUE self);
 
 static VALUE pgresult_fields( VALUE self);
+extern VALUE pg_result_fields( struct pgresult_data *r);
 static VALUE pgresult_field_indices( VALUE self);
+extern VALUE pg_result_indices( struct pgresult_data *r);
 static VALUE pgresult_num_fields( VALUE self);
 static VALUE pgresult_fieldname( VALUE self, VALUE index);
 static VALUE pgresult_fieldnum( VALUE self, VALUE name);
 
+static VALUE pgresult_each_row( int argc, VALUE *argv, VALUE self);
 extern VALUE pgresult_each( VALUE self);
 static VALUE pgresult_aref( int argc, VALUE *argv, VALUE self);
+static VALUE pgresult_to_a( VALUE self);
+static VALUE pgresult_flatten( VALUE self);
 extern VALUE pg_fetchrow( struct pgresult_data *r, int num);
+extern VALUE pg_result_rows( struct pgresult_data *r);
+extern VALUE pg_result_flatten( struct pgresult_data *r);
 extern VALUE pg_fetchresult( struct pgresult_data *r, int row, int col);
+extern VALUE pg_fetchcell( struct pgresult_data *r, struct pgconn_data *c, int row, int col);
+extern VALUE pg_translate_value( struct pgconn_data *c, const char *string, Oid typ, int typmod);
+extern Oid   pg_array_element( Oid typ);
+extern VALUE pg_numeric_value( struct pgconn_data *c, long long m, int scale, int typmod);
+static int   numeric_parse( const char *s, int l, long long *m, int *scale);
+static VALUE numeric_digits( const char *s, int l, int *scale);
+static VALUE numeric_special( const char *s, int l);
+extern void  pg_column_init( struct pg_column *col, struct pgconn_data *c, Oid typ, int typmod, int format);
+static void  column_setup( struct pg_column *col, struct pgconn_data *c, Oid typ, int typmod, int format, int translate);
+static void  column_init( struct pg_column *col, struct pgconn_data *c, Oid typ, int typmod, int depth);
+static int   column_typemap( struct pg_column *col, struct pgconn_data *c, Oid typ, int typmod, int depth);
+static void  column_builtin( struct pg_column *col, struct pgconn_data *c, Oid typ, int typmod);
+extern VALUE pg_numeric_text( struct pgconn_data *c, const char *s, int l, int typmod);
+extern struct pg_column *pg_result_plan( struct pgresult_data *r, struct pgconn_data *c);
+extern VALUE pg_plan_new( int n, struct pg_column **cols);
+extern struct pg_column *pg_plan_columns( VALUE plan, int *n);
+static void   pgplan_mark( void *ptr);
+static void   pgplan_free( void *ptr);
+static size_t pgplan_memsize( const void *ptr);
+extern void  pg_result_inherit_plan( struct pgresult_data *r, struct pgresult_data *prev);
+
+static VALUE decode_string(  struct pgconn_data *c, const char *s, int l, const struct pg_column *col);
+static VALUE decode_raw(     struct pgconn_data *c, const char *s, int l, const struct pg_column *col);
+static VALUE decode_integer( struct pgconn_data *c, const char *s, int l, const struct pg_column *col);
+static VALUE decode_numeric( struct pgconn_data *c, const char *s, int l, const struct pg_column *col);
+static VALUE decode_numeric_mode( struct pgconn_data *c, const char *s, int l, const struct pg_column *col);
+static VALUE decode_float(   struct pgconn_data *c, const char *s, int l, const struct pg_column *col);
+static VALUE decode_bool(    struct pgconn_data *c, const char *s, int l, const struct pg_column *col);
+static VALUE decode_bytea(   struct pgconn_data *c, const char *s, int l, const struct pg_column *col);
+static int   bytea_hex( char *d, const char *s, long n);
+static VALUE decode_json(    struct pgconn_data *c, const char *s, int l, const struct pg_column *col);
+static VALUE decode_array(   struct pgconn_data *c, const char *s, int l, const struct pg_column *col);
+static VALUE array_parse( struct pgconn_data *c, const char **p, const char *e, char *buf,
+                                const struct pg_column *ec);
+static VALUE array_element( struct pgconn_data *c, const char **p, const char *e, char *buf,
+                                const struct pg_column *ec);
+static VALUE decode_parse(   struct pgconn_data *c, const char *s, int l, const struct pg_column *col);
+static VALUE decode_date(    struct pgconn_data *c, const char *s, int l, const struct pg_column *col);
+static VALUE decode_time(    struct pgconn_data *c, const char *s, int l, const struct pg_column *col);
+static VALUE decode_timestamp( struct pgconn_data *c, const char *s, int l, const struct pg_column *col);
+static VALUE decode_hstore(  struct pgconn_data *c, const char *s, int l, const struct pg_column *col);
+static const char *hstore_string( const char *p, const char *e, char *buf, int *len);
+static VALUE decode_composite( struct pgconn_data *c, const char *s, int l, const struct pg_column *col);
+static VALUE decode_ruby(    struct pgconn_data *c, const char *s, int l, const struct pg_column *col);
+static VALUE decode_binary(  struct pgconn_data *c, const char *s, int l, const struct pg_column *col);
+
 static VALUE pgresult_num_tuples( VALUE self);
 
 static VALUE pgresult_type( VALUE self, VALUE index);
@@ -55,14 +116,53 @@ static VALUE pgresult_cmdstatus( VALUE self);
 static VALUE pgresult_oid( VALUE self);
 
 
-static VALUE rb_cPgResult;
+VALUE rb_cPgResult;
 static VALUE rb_ePgResError;
 
 static ID id_new;
 static ID id_parse;
 static ID id_result;
+static ID id_lazy;
+static unsigned short hexval[ 256];
+
+static const struct {
+    Oid arr;
+    Oid elem;
+} array_types[] = {
+    { BOOLARRAYOID,        BOOLOID        },
+    { BYTEAARRAYOID,       BYTEAOID       },
+    { CHARARRAYOID,        CHAROID        },
+    { NAMEARRAYOID,        NAMEOID        },
+    { INT2ARRAYOID,        INT2OID        },
+    { INT4ARRAYOID,        INT4OID        },
+    { INT8ARRAYOID,        INT8OID        },
+    { OIDARRAYOID,         OIDOID         },
+    { TEXTARRAYOID,        TEXTOID        },
+    { VARCHARARRAYOID,     VARCHAROID     },
+    { BPCHARARRAYOID,      BPCHAROID      },
+    { FLOAT4ARRAYOID,      FLOAT4OID      },
+    { FLOAT8ARRAYOID,      FLOAT8OID      },
+    { NUMERICARRAYOID,     NUMERICOID     },
+    { MONEYARRAYOID,       CASHOID        },
+    { DATEARRAYOID,        DATEOID        },
+    { TIMEARRAYOID,        TIMEOID        },
+    { TIMETZARRAYOID,      TIMETZOID      },
+    { TIMESTAMPARRAYOID,   TIMESTAMPOID   },
+    { TIMESTAMPTZARRAYOID, TIMESTAMPTZOID },
+    { UUIDARRAYOID,        UUIDOID        },
+    { JSONARRAYOID,        JSONOID        },
+    { JSONBARRAYOID,       JSONBOID       },
+    { InvalidOid,          InvalidOid     }
+};
+
+static ID id_BigDecimal;
+static ID id_pow;
+static ID id_mul;
+static ID id_call;
+
+static VALUE sym_json;
+static VALUE sym_hstore;
 
-static int translate_results = 1;
 
 
 
@@ -72,6 +172,18 @@ const rb_data_type_t pgresult_data_data_type = {
     0, 0, RUBY_TYPED_FREE_IMMEDIATELY
 };
 
+/* A column plan that is owned by a Ruby object. */
+struct pg_plan {
+    int               n;
+    struct pg_column *cols;
+};
+
+static const rb_data_type_t pgplan_data_type = {
+    "pgsql:plan",
+    { &pgplan_mark, &pgplan_free, &pgplan_memsize,},
+    0, 0, RUBY_TYPED_FREE_IMMEDIATELY
+};
+
 
 
 
@@ -205,16 +317,18 @@ pgreserror_diag( VALUE self, VALUE field)
 
 /*
  * call-seq:
- *   Pg::Conn.translate_results = boolean
+ *   Pg::Result.translate_results = boolean
  *
  * When true (default), results are translated to an appropriate Ruby class.
  * When false, results are returned as +Strings+.
  *
+ * This is the default for connections created afterwards.  Set it per
+ * connection by Pg::Conn#translate_results= or Pg::Conn#translating.
  */
 VALUE
 pgresult_s_translate_results_set( VALUE cls, VALUE fact)
 {
-    translate_results = RTEST( fact) ? 1 : 0;
+    pg_translate_default = RTEST( fact) ? PG_TRANSLATE_TYPED : PG_TRANSLATE_RAW;
     return Qnil;
 }
 
@@ -227,6 +341,12 @@ pgresult_mark( void *ptr)
     rb_gc_mark( rd->conn);
     rb_gc_mark( rd->fields);
     rb_gc_mark( rd->indices);
+    if (rd->plan != NULL) {
+        int i;
+
+        for (i = 0; i < rd->nplan; ++i)
+            rb_gc_mark( rd->plan[ i].cls);
+    }
 }
 
 void
@@ -235,13 +355,16 @@ pgresult_free( void *ptr)
     struct pgresult_data *rd = ptr;
     if (rd->res != NULL)
         PQclear( rd->res);
+    if (rd->plan != NULL)
+        ruby_xfree( rd->plan);
     ruby_xfree( ptr);
 }
 
 size_t
 pgresult_memsize( const void *ptr)
 {
-    return sizeof (struct pgresult_data);
+    const struct pgresult_data *rd = ptr;
+    return sizeof (struct pgresult_data) + rd->nplan * sizeof (struct pg_column);
 }
 
 
@@ -257,6 +380,9 @@ pgresult_alloc( VALUE cls)
     r->conn    = Qnil;
     r->fields  = Qnil;
     r->indices = Qnil;
+    r->plan    = NULL;
+    r->nplan   = 0;
+    r->translate = PG_TRANSLATE_TYPED;
     return obj;
 }
 
@@ -272,6 +398,7 @@ pgresult_new( PGresult *result, VALUE conn, VALUE cmd, VALUE par)
     r->conn    = conn;
     r->fields  = Qnil;
     r->indices = Qnil;
+    r->translate = get_pgconn( conn)->translate;
     switch (PQresultStatus( result)) {
         case PGRES_EMPTY_QUERY:
         case PGRES_COMMAND_OK:
@@ -351,6 +478,12 @@ pgresult_fields( VALUE self)
     struct pgresult_data *r;
 
     TypedData_Get_Struct( self, struct pgresult_data, &pgresult_data_data_type, r);
+    return pg_result_fields( r);
+}
+
+VALUE
+pg_result_fields( struct pgresult_data *r)
+{
     if (NIL_P( r->fields)) {
         VALUE ary;
         int n, i;
@@ -385,6 +518,12 @@ pgresult_field_indices( VALUE self)
     struct pgresult_data *r;
 
     TypedData_Get_Struct( self, struct pgresult_data, &pgresult_data_data_type, r);
+    return pg_result_indices( r);
+}
+
+VALUE
+pg_result_indices( struct pgresult_data *r)
+{
     if (NIL_P( r->indices)) {
         VALUE hsh;
         int n, i;
@@ -473,12 +612,30 @@ pgresult_fieldnum( VALUE self, VALUE name)
 /*
  * call-seq:
  *    res.each { |tuple| ... }  ->  nil or int
+ *    res.each( lazy: true) { |row| ... }  ->  nil or int
  *
  * Invokes the block for each tuple (row) in the result.
  *
+ * With +lazy+ set, the rows are Pg::Row objects that decode a value only
+ * when it is asked for.
+ *
  * Return the number of rows the query resulted in, or +nil+ if there
  * wasn't any (like <code>Numeric#nonzero?</code>).
  */
+VALUE
+pgresult_each_row( int argc, VALUE *argv, VALUE self)
+{
+    VALUE opts, lazy;
+
+    rb_scan_args( argc, argv, "0:", &opts);
+    lazy = Qnil;
+    if (!NIL_P( opts))
+        rb_get_kwargs( opts, &id_lazy, 0, 1, &lazy);
+    if (lazy != Qundef && RTEST( lazy))
+        return pg_result_each_as( self, PG_ROW_LAZY);
+    return pgresult_each( self);
+}
+
 VALUE
 pgresult_each( VALUE self)
 {
@@ -530,93 +687,975 @@ pgresult_aref( int argc, VALUE *argv, VALUE self)
 }
 
 
+/*
+ * call-seq:
+ *    res.to_a     ->  ary
+ *    res.values   ->  ary
+ *
+ * All rows as arrays.  Unlike <code>Enumerable#to_a</code> this does not
+ * call Pg::Result#each.
+ */
+VALUE
+pgresult_to_a( VALUE self)
+{
+    struct pgresult_data *r;
+
+    TypedData_Get_Struct( self, struct pgresult_data, &pgresult_data_data_type, r);
+    return pg_result_rows( r);
+}
+
+/*
+ * call-seq:
+ *    res.flatten   ->  ary
+ *
+ * All values of all rows in one array, row by row.
+ */
+VALUE
+pgresult_flatten( VALUE self)
+{
+    struct pgresult_data *r;
+
+    TypedData_Get_Struct( self, struct pgresult_data, &pgresult_data_data_type, r);
+    return pg_result_flatten( r);
+}
+
+
 VALUE
 pg_fetchrow( struct pgresult_data *r, int num)
 {
+    struct pgconn_data *c;
     VALUE row;
     int n, i;
 
     n = PQnfields( r->res);
     if (num < PQntuples( r->res)) {
+        c = get_pgconn( r->conn);
         row = rb_ary_new2( n);
         for (i = 0; n; ++i, --n)
-            rb_ary_store( row, i, pg_fetchresult( r, num, i));
+            rb_ary_store( row, i, pg_fetchcell( r, c, num, i));
     } else
         row = Qnil;
     return row;
 }
 
+VALUE
+pg_result_rows( struct pgresult_data *r)
+{
+    struct pgconn_data *c;
+    VALUE ret, row;
+    int m, n, j, i;
+
+    c = get_pgconn( r->conn);
+    m = PQntuples( r->res), n = PQnfields( r->res);
+    ret = rb_ary_new_capa( m);
+    for (j = 0; j < m; ++j) {
+        row = rb_ary_new_capa( n);
+        for (i = 0; i < n; ++i)
+            rb_ary_push( row, pg_fetchcell( r, c, j, i));
+        rb_ary_push( ret, row);
+    }
+    return ret;
+}
+
+VALUE
+pg_result_flatten( struct pgresult_data *r)
+{
+    struct pgconn_data *c;
+    VALUE ret;
+    int m, n, j, i;
+
+    c = get_pgconn( r->conn);
+    m = PQntuples( r->res), n = PQnfields( r->res);
+    ret = rb_ary_new_capa( (long) m * n);
+    for (j = 0; j < m; ++j)
+        for (i = 0; i < n; ++i)
+            rb_ary_push( ret, pg_fetchcell( r, c, j, i));
+    return ret;
+}
+
 VALUE
 pg_fetchresult( struct pgresult_data *r, int row, int col)
 {
-    char *string;
-    Oid typ;
-    VALUE cls, ret;
+    return pg_fetchcell( r, get_pgconn( r->conn), row, col);
+}
+
+VALUE
+pg_fetchcell( struct pgresult_data *r, struct pgconn_data *c, int row, int col)
+{
+    const struct pg_column *p;
 
     if (PQgetisnull( r->res, row, col))
         return Qnil;
+    p = (r->plan != NULL ? r->plan : pg_result_plan( r, c)) + col;
+    return (*p->decode)( c, PQgetvalue( r->res, row, col),
+                            PQgetlength( r->res, row, col), p);
+}
 
-    string = PQgetvalue( r->res, row, col);
-    if (string == NULL)
-        return Qnil;
+/*
+ * Make a Ruby object out of a value in PostgreSQL's text representation.
+ * This is what +pg_fetchresult+ does but it can be used for values
+ * that did not arrive inside a +PGresult+, e.g. from +COPY+.
+ */
+VALUE
+pg_translate_value( struct pgconn_data *c, const char *string, Oid typ, int typmod)
+{
+    struct pg_column col;
+
+    pg_column_init( &col, c, typ, typmod, 0);
+    return (*col.decode)( c, string, strlen( string), &col);
+}
+
+/*
+ * The text +s+ of a numeric value, without looking at the type map.
+ * The binary decoder formats its values that way.
+ */
+VALUE
+pg_numeric_text( struct pgconn_data *c, const char *s, int l, int typmod)
+{
+    struct pg_column col;
+
+    col.typ     = NUMERICOID;
+    col.typmod  = typmod;
+    col.cls     = Qnil;
+    col.elem    = NULL;
+    col.elemtyp = InvalidOid;
+    col.decode  = &decode_string;
+    column_builtin( &col, c, NUMERICOID, typmod);
+    return (*col.decode)( c, s, l, &col);
+}
+
+/*
+ * The element type of the array type +typ+, +InvalidOid+ if it isn't one
+ * we know.
+ */
+Oid
+pg_array_element( Oid typ)
+{
+    int i;
 
-    if (!translate_results)
-        return pgconn_mkstring( get_pgconn( r->conn), string);
+    for (i = 0; array_types[ i].arr != InvalidOid; ++i)
+        if (array_types[ i].arr == typ)
+            return array_types[ i].elem;
+    return InvalidOid;
+}
+
+/*
+ * The number <code>m * 10 ** -scale</code> in the connection's numeric
+ * mode.  +Qundef+ if that doesn't fit into C types or the mode is
+ * +:bigdecimal+; the caller then has to go the long way.
+ */
+VALUE
+pg_numeric_value( struct pgconn_data *c, long long m, int scale, int typmod)
+{
+    static const double pow10d[] = {
+        1e0,  1e1,  1e2,  1e3,  1e4,  1e5,  1e6,  1e7,  1e8,  1e9,  1e10, 1e11,
+        1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22
+    };
+    long long a;
+    int k;
+
+    if (typmod >= VARHDRSZ && ((typmod - VARHDRSZ) & 0xffff) == 0 && scale == 0)
+        return LL2NUM( m);
+    a = m < 0 ? -m : m;
+    switch (c != NULL ? c->numeric_mode : PG_NUMERIC_BIGDECIMAL) {
+    case PG_NUMERIC_FLOAT:
+        /* Both operands exact, so the division rounds correctly. */
+        if (scale <= 22 && a <= (1LL << 53))
+            return rb_float_new( (double) m / pow10d[ scale]);
+        break;
+    case PG_NUMERIC_RATIONAL:
+        if (scale <= 18)
+            return rb_rational_new( LL2NUM( m), LL2NUM( pg_pow10[ scale]));
+        break;
+    case PG_NUMERIC_SCALED:
+        if (typmod < VARHDRSZ)
+            break;
+        k = ((typmod - VARHDRSZ) & 0xffff) - scale;
+        if (k >= 0 && k <= 18 && a <= LLONG_MAX / pg_pow10[ k])
+            return LL2NUM( m * pg_pow10[ k]);
+        break;
+    default:
+        break;
+    }
+    return Qundef;
+}
+
+/* Up to 18 significant digits. */
+int
+numeric_parse( const char *s, int l, long long *m, int *scale)
+{
+    const char *e;
+    int neg, point, n;
+
+    e = s + l;
+    neg = s < e && *s == '-';
+    if (neg)
+        ++s;
+    for (*m = 0, *scale = 0, point = 0, n = 0; s < e; ++s) {
+        if (*s == '.' && !point) {
+            point = 1;
+            continue;
+        }
+        if (*s < '0' || *s > '9')
+            return 0;
+        if (point)
+            ++*scale;
+        if (*m == 0 && *s == '0')
+            continue;
+        if (++n > 18)
+            return 0;
+        *m = *m * 10 + (*s - '0');
+    }
+    if (neg)
+        *m = -*m;
+    return 1;
+}
+
+VALUE
+numeric_digits( const char *s, int l, int *scale)
+{
+    VALUE str;
+    char *b, *p;
+    int point;
+
+    str = rb_str_buf_new( l);
+    b = p = RSTRING_PTR( str);
+    for (*scale = 0, point = 0; l; ++s, --l)
+        if (*s == '.')
+            point = 1;
+        else {
+            *p++ = *s;
+            if (point)
+                ++*scale;
+        }
+    rb_str_set_len( str, p - b);
+    return rb_str_to_inum( str, 10, 0);
+}
+
+VALUE
+numeric_special( const char *s, int l)
+{
+    if (l == 3 && memcmp( s, "NaN", 3) == 0)
+        return rb_float_new( nan( ""));
+    if (l == 8 && memcmp( s, "Infinity", 8) == 0)
+        return rb_float_new( HUGE_VAL);
+    if (l == 9 && memcmp( s, "-Infinity", 9) == 0)
+        return rb_float_new( -HUGE_VAL);
+    return Qundef;
+}
+
+/*
+ * Choose the decoder for values of type +typ+ in text (+format+ 0) or
+ * binary (+format+ 1) representation.
+ */
+void
+pg_column_init( struct pg_column *col, struct pgconn_data *c, Oid typ, int typmod, int format)
+{
+    column_setup( col, c, typ, typmod, format,
+                  c != NULL ? c->translate : PG_TRANSLATE_TYPED);
+}
+
+void
+column_setup( struct pg_column *col, struct pgconn_data *c, Oid typ, int typmod, int format, int translate)
+{
+    if (format != 0) {
+        /* Binary values do not go through the type map. */
+        col->typ     = typ;
+        col->typmod  = typmod;
+        col->cls     = Qnil;
+        col->elem    = NULL;
+        col->elemtyp = InvalidOid;
+        col->decode  = &decode_binary;
+        return;
+    }
+    if (translate == PG_TRANSLATE_RAW) {
+        col->typ     = typ;
+        col->typmod  = typmod;
+        col->cls     = Qnil;
+        col->elem    = NULL;
+        col->elemtyp = InvalidOid;
+        col->decode  = &decode_raw;
+        return;
+    }
+    column_init( col, c, typ, typmod, 0);
+}
+
+/*
+ * Type map entries may refer to other types, composites to themselves;
+ * +depth+ stops that.
+ */
+#define MAX_TYPEMAP_DEPTH  8
+
+void
+column_init( struct pg_column *col, struct pgconn_data *c, Oid typ, int typmod, int depth)
+{
+    Oid elem;
+
+    col->typ     = typ;
+    col->typmod  = typmod;
+    col->cls     = Qnil;
+    col->elem    = NULL;
+    col->elemtyp = InvalidOid;
+    col->decode  = &decode_string;
+    if (column_typemap( col, c, typ, typmod, depth))
+        return;
+    elem = pg_array_element( typ);
+    if (elem == InvalidOid && c != NULL && !NIL_P( c->type_map))
+        elem = pg_typemap_element( c->type_map, typ);
+    if (elem != InvalidOid) {
+        column_init( col, c, elem, typmod, depth);
+        col->elem    = col->decode;
+        col->elemtyp = elem;
+        col->typ     = typ;
+        col->decode  = &decode_array;
+        return;
+    }
+    column_builtin( col, c, typ, typmod);
+}
+
+/*
+ * The decoders of the builtin types.
+ */
+void
+column_builtin( struct pg_column *col, struct pgconn_data *c, Oid typ, int typmod)
+{
+    int mode;
 
-    typ = PQftype( r->res, col);
-    cls = Qnil;
-    ret = Qnil;
     switch (typ) {
     case NUMERICOID:
-        {
-            int typmod;
-
-            typmod = PQfmod( r->res, col);
-            if (typmod == -1 || (typmod - VARHDRSZ) & 0xffff) {
-                ret = rb_funcall( Qnil, rb_intern( "BigDecimal"), 1, rb_str_new2( string));
-                break;
-            }
+        if (typmod == -1 || (typmod - VARHDRSZ) & 0xffff) {
+            mode = c != NULL ? c->numeric_mode : PG_NUMERIC_BIGDECIMAL;
+            if (mode == PG_NUMERIC_BIGDECIMAL ||
+                    (mode == PG_NUMERIC_SCALED && typmod == -1))
+                col->decode = &decode_numeric;
+            else
+                col->decode = &decode_numeric_mode;
+            break;
         }
         /* fall through if scale == 0 */
     case INT8OID:
     case INT4OID:
     case INT2OID:
     case OIDOID:
-        ret = rb_cstr_to_inum( string, 10, 0);
+        col->decode = &decode_integer;
         break;
     case FLOAT8OID:
     case FLOAT4OID:
-        ret = rb_float_new( rb_cstr_to_dbl( string, Qfalse));
+        col->decode = &decode_float;
         break;
     case BOOLOID:
-        ret = strchr( "tTyY", *string) != NULL ? Qtrue : Qfalse;
+        col->decode = &decode_bool;
         break;
     case BYTEAOID:
-        ret = rb_str_new2( string);
+        col->decode = &decode_bytea;
         break;
     case DATEOID:
-        cls = rb_cDate;
+        col->cls    = rb_cDate;
+        col->decode = &decode_date;
         break;
     case TIMEOID:
     case TIMETZOID:
-        cls = rb_cTime;
+        col->cls    = rb_cTime;
+        col->decode = &decode_time;
         break;
     case TIMESTAMPOID:
     case TIMESTAMPTZOID:
-        cls = rb_cDateTime;
+        col->cls    = rb_cDateTime;
+        col->decode = &decode_timestamp;
         break;
     case CASHOID:
-        cls = pg_monetary_class();
+        col->cls    = pg_monetary_class();
+        col->decode = &decode_parse;
+        break;
+    case JSONOID:
+    case JSONBOID:
+        if (c != NULL && c->decode_json)
+            col->decode = &decode_json;
         break;
     default:
         break;
     }
-    if (NIL_P( ret)) {
-        ret = pgconn_mkstring( get_pgconn( r->conn), string);
-        if (RTEST( cls))
-            ret = rb_funcall( cls, id_parse, 1, ret);
+}
+
+/*
+ * Apply what the connection's Pg::TypeMap says about +typ+, if anything.
+ */
+int
+column_typemap( struct pg_column *col, struct pgconn_data *c, Oid typ, int typmod, int depth)
+{
+    VALUE e;
+
+    if (c == NULL || NIL_P( c->type_map) || depth >= MAX_TYPEMAP_DEPTH)
+        return 0;
+    e = pg_typemap_decoder( c->type_map, typ);
+    if (e == Qundef)
+        return 0;
+    if (RB_INTEGER_TYPE_P( e)) {
+        column_init( col, c, NUM2UINT( e), typmod, depth + 1);
+        col->typ = typ;
+    } else if (e == sym_json)
+        col->decode = &decode_json;
+    else if (e == sym_hstore)
+        col->decode = &decode_hstore;
+    else if (RB_TYPE_P( e, T_ARRAY)) {
+        struct pg_column *ac;
+        VALUE plan;
+        long n, i;
+
+        /* The attributes' decoders, built once for the whole column. */
+        n = RARRAY_LEN( e);
+        plan = pg_plan_new( (int) n, &ac);
+        for (i = 0; i < n; ++i)
+            column_init( ac + i, c, NUM2UINT( RARRAY_AREF( e, i)), -1, depth + 1);
+        col->cls    = plan;
+        col->decode = &decode_composite;
+    } else {
+        col->cls    = e;
+        col->decode = &decode_ruby;
     }
-    return ret;
+    return 1;
+}
+
+struct pg_column *
+pg_result_plan( struct pgresult_data *r, struct pgconn_data *c)
+{
+    struct pg_column *plan, *cols;
+    VALUE tmp;
+    int n, i;
+
+    if (r->plan != NULL)
+        return r->plan;
+    n = PQnfields( r->res);
+    /* Built in a plan object first, so the objects the decoders refer
+       to are marked meanwhile and nothing leaks when a type map raises. */
+    tmp = pg_plan_new( n, &cols);
+    for (i = 0; i < n; ++i)
+        column_setup( cols + i, c, PQftype( r->res, i), PQfmod( r->res, i),
+                                PQfformat( r->res, i), r->translate);
+    plan = ALLOC_N( struct pg_column, n > 0 ? n : 1);
+    MEMCPY( plan, cols, struct pg_column, n);
+    r->plan  = plan;
+    r->nplan = n;
+    RB_GC_GUARD( tmp);
+    return plan;
+}
+
+/*
+ * A hidden object owning +n+ columns, for plans that live longer than a
+ * result or belong to a column.  The columns are returned in +cols+ and
+ * still have to be set up.
+ */
+VALUE
+pg_plan_new( int n, struct pg_column **cols)
+{
+    struct pg_plan *p;
+    VALUE obj;
+    int i;
+
+    obj = TypedData_Make_Struct( 0, struct pg_plan, &pgplan_data_type, p);
+    p->cols = ALLOC_N( struct pg_column, n > 0 ? n : 1);
+    for (i = 0; i < n; ++i) {
+        p->cols[ i].decode  = &decode_string;
+        p->cols[ i].typ     = InvalidOid;
+        p->cols[ i].typmod  = -1;
+        p->cols[ i].cls     = Qnil;
+        p->cols[ i].elem    = NULL;
+        p->cols[ i].elemtyp = InvalidOid;
+    }
+    p->n  = n;
+    *cols = p->cols;
+    return obj;
+}
+
+struct pg_column *
+pg_plan_columns( VALUE plan, int *n)
+{
+    struct pg_plan *p;
+
+    TypedData_Get_Struct( plan, struct pg_plan, &pgplan_data_type, p);
+    *n = p->n;
+    return p->cols;
+}
+
+void
+pgplan_mark( void *ptr)
+{
+    struct pg_plan *p = ptr;
+    int i;
+
+    for (i = 0; i < p->n; ++i)
+        rb_gc_mark( p->cols[ i].cls);
+}
+
+void
+pgplan_free( void *ptr)
+{
+    struct pg_plan *p = ptr;
+
+    ruby_xfree( p->cols);
+    ruby_xfree( ptr);
+}
+
+size_t
+pgplan_memsize( const void *ptr)
+{
+    const struct pg_plan *p = ptr;
+
+    return sizeof (struct pg_plan) + p->n * sizeof (struct pg_column);
+}
+
+/*
+ * In single row mode every row arrives in a result of its own, all of
+ * them with the same row description.  Pass the decoders on, unless the
+ * result belongs to another statement with different columns.
+ */
+void
+pg_result_inherit_plan( struct pgresult_data *r, struct pgresult_data *prev)
+{
+    int i;
+
+    if (r->plan != NULL || prev->plan == NULL || r->translate != prev->translate)
+        return;
+    if (PQresultStatus( r->res) != PGRES_SINGLE_TUPLE &&
+            PQresultStatus( r->res) != PGRES_TUPLES_OK)
+        return;
+    if (PQnfields( r->res) != prev->nplan)
+        return;
+    for (i = 0; i < prev->nplan; ++i)
+        if (PQftype( r->res, i) != prev->plan[ i].typ ||
+                PQfmod( r->res, i) != prev->plan[ i].typmod ||
+                (PQfformat( r->res, i) != 0) != (prev->plan[ i].decode == &decode_binary))
+            return;
+    r->plan     = prev->plan;
+    r->nplan    = prev->nplan;
+    prev->plan  = NULL;
+    prev->nplan = 0;
+    /* Single rows of one statement have the same field names, too. */
+    if (NIL_P( prev->fields))
+        return;
+    for (i = 0; i < r->nplan; ++i) {
+        VALUE f;
+        const char *s;
+
+        f = RARRAY_AREF( prev->fields, i);
+        s = PQfname( r->res, i);
+        if ((long) strlen( s) != RSTRING_LEN( f) ||
+                memcmp( s, RSTRING_PTR( f), RSTRING_LEN( f)) != 0)
+            return;
+    }
+    r->fields = prev->fields;
+}
+
+
+VALUE
+decode_string( struct pgconn_data *c, const char *s, int l, const struct pg_column *col)
+{
+    return pgconn_mkstringn( c, s, l);
+}
+
+/*
+ * Untranslated values skip the conversion to the internal encoding.
+ */
+VALUE
+decode_raw( struct pgconn_data *c, const char *s, int l, const struct pg_column *col)
+{
+#ifdef RUBY_ENCODING
+    return rb_enc_str_new( s, l, rb_to_encoding( c->external));
+#else
+    return rb_str_new( s, l);
+#endif
+}
+
+VALUE
+decode_integer( struct pgconn_data *c, const char *s, int l, const struct pg_column *col)
+{
+    const char *p, *e;
+    long long v;
+
+    /* Up to 18 digits fit into a long long without further checks. */
+    p = s, e = s + l;
+    if (p < e && *p == '-')
+        ++p;
+    if (p < e && e - p <= 18) {
+        for (v = 0; p < e && *p >= '0' && *p <= '9'; ++p)
+            v = v * 10 + (*p - '0');
+        if (p == e)
+            return LL2NUM( *s == '-' ? -v : v);
+    }
+    return rb_cstr_to_inum( s, 10, 0);
+}
+
+VALUE
+decode_numeric( struct pgconn_data *c, const char *s, int l, const struct pg_column *col)
+{
+    return rb_funcall( Qnil, id_BigDecimal, 1, rb_usascii_str_new( s, l));
+}
+
+VALUE
+decode_numeric_mode( struct pgconn_data *c, const char *s, int l, const struct pg_column *col)
+{
+    long long m;
+    int scale;
+    VALUE r;
+
+    if (numeric_parse( s, l, &m, &scale) &&
+            (r = pg_numeric_value( c, m, scale, col->typmod)) != Qundef)
+        return r;
+    if ((r = numeric_special( s, l)) != Qundef)
+        return r;
+    switch (c->numeric_mode) {
+    case PG_NUMERIC_FLOAT:
+        return rb_float_new( rb_cstr_to_dbl( s, Qfalse));
+    case PG_NUMERIC_RATIONAL:
+        r = numeric_digits( s, l, &scale);
+        return rb_rational_new( r, rb_funcall( INT2FIX( 10), id_pow, 1, INT2FIX( scale)));
+    case PG_NUMERIC_SCALED:
+        if (col->typmod < VARHDRSZ)
+            break;
+        r = numeric_digits( s, l, &scale);
+        scale = ((col->typmod - VARHDRSZ) & 0xffff) - scale;
+        if (scale > 0)
+            r = rb_funcall( r, id_mul, 1, rb_funcall( INT2FIX( 10), id_pow, 1, INT2FIX( scale)));
+        return r;
+    default:
+        break;
+    }
+    return decode_numeric( c, s, l, col);
+}
+
+VALUE
+decode_float( struct pgconn_data *c, const char *s, int l, const struct pg_column *col)
+{
+    return rb_float_new( rb_cstr_to_dbl( s, Qfalse));
+}
+
+VALUE
+decode_bool( struct pgconn_data *c, const char *s, int l, const struct pg_column *col)
+{
+    return strchr( "tTyY", *s) != NULL ? Qtrue : Qfalse;
+}
+
+VALUE
+decode_bytea( struct pgconn_data *c, const char *s, int l, const struct pg_column *col)
+{
+    VALUE r;
+    unsigned char *u;
+    size_t n;
+
+    if (l >= 2 && s[ 0] == '\\' && s[ 1] == 'x') {
+        r = rb_str_new( NULL, (l - 2) / 2);
+        if ((l & 1) || bytea_hex( RSTRING_PTR( r), s + 2, l - 2) != 0)
+            rb_raise( rb_ePgError, "Malformed bytea value.");
+        return r;
+    }
+    /* bytea_output = escape */
+    u = PQunescapeBytea( (const unsigned char *) s, &n);
+    if (u == NULL)
+        rb_raise( rb_eNoMemError, "Could not unescape bytea value.");
+    r = rb_str_new( (char *) u, n);
+    PQfreemem( u);
+    return r;
+}
+
+/*
+ * Decode +n+ hex digits.  Invalid ones set bit 8 in +hexval+; collect
+ * them over four bytes at a time and check once.
+ */
+int
+bytea_hex( char *d, const char *s, long n)
+{
+    const unsigned char *u;
+    unsigned short a, b, c, e, bad;
+
+    u = (const unsigned char *) s;
+    for (bad = 0; n >= 8; n -= 8, u += 8, d += 4) {
+        a = (hexval[ u[ 0]] << 4) | hexval[ u[ 1]];
+        b = (hexval[ u[ 2]] << 4) | hexval[ u[ 3]];
+        c = (hexval[ u[ 4]] << 4) | hexval[ u[ 5]];
+        e = (hexval[ u[ 6]] << 4) | hexval[ u[ 7]];
+        bad |= a | b | c | e;
+        d[ 0] = (char) a;
+        d[ 1] = (char) b;
+        d[ 2] = (char) c;
+        d[ 3] = (char) e;
+    }
+    for (; n >= 2; n -= 2, u += 2, ++d) {
+        a = (hexval[ u[ 0]] << 4) | hexval[ u[ 1]];
+        bad |= a;
+        *d = (char) a;
+    }
+    return (bad & 0xff00) != 0;
+}
+
+VALUE
+decode_parse( struct pgconn_data *c, const char *s, int l, const struct pg_column *col)
+{
+    return rb_funcall( col->cls, id_parse, 1, pgconn_mkstringn( c, s, l));
+}
+
+/*
+ * Dates and times in other styles than +ISO+ still go through the
+ * class's +parse+ method.
+ */
+VALUE
+decode_date( struct pgconn_data *c, const char *s, int l, const struct pg_column *col)
+{
+    VALUE r;
+
+    r = pg_parse_date( s, l);
+    return r != Qundef ? r : decode_parse( c, s, l, col);
+}
+
+VALUE
+decode_time( struct pgconn_data *c, const char *s, int l, const struct pg_column *col)
+{
+    VALUE r;
+
+    r = pg_parse_time( s, l, col->typ == TIMETZOID);
+    return r != Qundef ? r : decode_parse( c, s, l, col);
+}
+
+VALUE
+decode_timestamp( struct pgconn_data *c, const char *s, int l, const struct pg_column *col)
+{
+    VALUE r;
+
+    r = pg_parse_timestamp( s, l, col->typ == TIMESTAMPTZOID);
+    return r != Qundef ? r : decode_parse( c, s, l, col);
+}
+
+VALUE
+decode_json( struct pgconn_data *c, const char *s, int l, const struct pg_column *col)
+{
+    return pg_json_parse( c, s, l);
+}
+
+/*
+ * Arrays in text representation, like <code>{{1,NULL},{"a b",4}}</code>.
+ * The elements are decoded as if they were column values of the element
+ * type.
+ */
+VALUE
+decode_array( struct pgconn_data *c, const char *s, int l, const struct pg_column *col)
+{
+    struct pg_column ec;
+    const char *p, *e;
+    VALUE v, r;
+    char *buf;
+
+    ec = *col;
+    ec.typ    = col->elemtyp;
+    ec.decode = col->elem;
+    ec.elem   = NULL;
+
+    p = s, e = s + l;
+    if (p < e && *p == '[') {             /* dimension decoration */
+        while (p < e && *p != '=')
+            ++p;
+        ++p;
+    }
+    if (p >= e || *p != '{')
+        rb_raise( rb_ePgError, "Malformed array value.");
+    buf = ALLOCV_N( char, v, l + 1);
+    r = array_parse( c, &p, e, buf, &ec);
+    ALLOCV_END( v);
+    return r;
+}
+
+VALUE
+array_parse( struct pgconn_data *c, const char **p, const char *e, char *buf,
+                const struct pg_column *ec)
+{
+    VALUE ary;
+
+    ary = rb_ary_new();
+    ++*p;
+    if (*p < e && **p == '}') {
+        ++*p;
+        return ary;
+    }
+    for (;;) {
+        if (*p >= e)
+            break;
+        if (**p == '{')
+            rb_ary_push( ary, array_parse( c, p, e, buf, ec));
+        else
+            rb_ary_push( ary, array_element( c, p, e, buf, ec));
+        if (*p >= e)
+            break;
+        if (**p == '}') {
+            ++*p;
+            return ary;
+        }
+        if (**p != ',')
+            break;
+        ++*p;
+    }
+    rb_raise( rb_ePgError, "Malformed array value.");
+    return Qnil;
+}
+
+VALUE
+array_element( struct pgconn_data *c, const char **p, const char *e, char *buf,
+                const struct pg_column *ec)
+{
+    const char *q;
+    char *b;
+
+    q = *p, b = buf;
+    if (q < e && *q == '"') {
+        for (++q; q < e && *q != '"'; ++q) {
+            if (*q == '\\' && q + 1 < e)
+                ++q;
+            *b++ = *q;
+        }
+        if (q >= e)
+            rb_raise( rb_ePgError, "Malformed array value.");
+        ++q;
+    } else {
+        for (; q < e && *q != ',' && *q != '}'; ++q)
+            *b++ = *q;
+        if (b - buf == 4 && strncasecmp( buf, "NULL", 4) == 0) {
+            *p = q;
+            return Qnil;
+        }
+    }
+    *b = '\0';
+    *p = q;
+    return (*ec->decode)( c, buf, b - buf, ec);
+}
+
+/*
+ * Hstore values like <code>"a"=>"1", "b"=>NULL</code> become hashes.
+ */
+VALUE
+decode_hstore( struct pgconn_data *c, const char *s, int l, const struct pg_column *col)
+{
+    const char *p, *e;
+    char *buf;
+    VALUE v, h, k;
+    int n;
+
+    h = rb_hash_new();
+    buf = ALLOCV_N( char, v, l + 1);
+    p = s, e = s + l;
+    for (;;) {
+        while (p < e && (*p == ' ' || *p == ','))
+            ++p;
+        if (p >= e)
+            break;
+        if ((p = hstore_string( p, e, buf, &n)) == NULL)
+            break;
+        k = pgconn_mkstringn( c, buf, n);
+        while (p < e && *p == ' ')
+            ++p;
+        if (e - p < 2 || p[ 0] != '=' || p[ 1] != '>')
+            break;
+        for (p += 2; p < e && *p == ' '; ++p)
+            ;
+        if (e - p >= 4 && memcmp( p, "NULL", 4) == 0) {
+            rb_hash_aset( h, k, Qnil);
+            p += 4;
+            continue;
+        }
+        if ((p = hstore_string( p, e, buf, &n)) == NULL)
+            break;
+        rb_hash_aset( h, k, pgconn_mkstringn( c, buf, n));
+    }
+    ALLOCV_END( v);
+    if (p != e)
+        rb_raise( rb_ePgError, "Malformed hstore value.");
+    return h;
+}
+
+const char *
+hstore_string( const char *p, const char *e, char *buf, int *len)
+{
+    char *b;
+
+    if (p >= e || *p != '"')
+        return NULL;
+    for (b = buf, ++p; p < e && *p != '"'; ++p) {
+        if (*p == '\\' && p + 1 < e)
+            ++p;
+        *b++ = *p;
+    }
+    if (p >= e)
+        return NULL;
+    *len = b - buf;
+    return p + 1;
+}
+
+/*
+ * Composite values like <code>(1,"a b",)</code> become arrays.  The
+ * attributes are decoded by their own types, +col->cls+ holds the plan
+ * for them.
+ */
+VALUE
+decode_composite( struct pgconn_data *c, const char *s, int l, const struct pg_column *col)
+{
+    const struct pg_column *ac;
+    const char *p, *e;
+    char *buf, *b;
+    VALUE v, r, val;
+    int i, n, quoted, any;
+
+    p = s, e = s + l;
+    if (p >= e || *p != '(')
+        rb_raise( rb_ePgError, "Malformed composite value.");
+    ac = pg_plan_columns( col->cls, &n);
+    r = rb_ary_new_capa( n);
+    if (l == 2 && p[ 1] == ')') {
+        /* Every attribute is NULL. */
+        for (i = 0; i < n; ++i)
+            rb_ary_push( r, Qnil);
+        return r;
+    }
+    buf = ALLOCV_N( char, v, l + 1);
+    for (i = 0, ++p; p < e; ++i) {
+        quoted = any = 0;
+        for (b = buf; p < e && (quoted || (*p != ',' && *p != ')')); ++p) {
+            any = 1;
+            if (*p == '"') {
+                if (quoted && p + 1 < e && p[ 1] == '"')
+                    *b++ = *++p;
+                else
+                    quoted = !quoted;
+            } else if (*p == '\\' && p + 1 < e)
+                *b++ = *++p;
+            else
+                *b++ = *p;
+        }
+        if (!any)
+            val = Qnil;
+        else if (i < n) {
+            *b = '\0';
+            val = (*ac[ i].decode)( c, buf, b - buf, ac + i);
+        } else
+            val = pgconn_mkstringn( c, buf, b - buf);
+        rb_ary_push( r, val);
+        if (p < e && *p == ')') {
+            ++p;
+            break;
+        }
+        ++p;
+    }
+    ALLOCV_END( v);
+    if (p != e || p[ -1] != ')')
+        rb_raise( rb_ePgError, "Malformed composite value.");
+    return r;
+}
+
+VALUE
+decode_ruby( struct pgconn_data *c, const char *s, int l, const struct pg_column *col)
+{
+    return rb_funcall( col->cls, id_call, 1, pgconn_mkstringn( c, s, l));
+}
+
+VALUE
+decode_binary( struct pgconn_data *c, const char *s, int l, const struct pg_column *col)
+{
+    return pg_binary_value( c, s, l, col->typ, col->typmod);
 }
 
 /*
@@ -886,10 +1925,14 @@ Init_pgsql_result( void)
     rb_define_method( rb_cPgResult, "fieldname", &pgresult_fieldname, 1);
     rb_define_method( rb_cPgResult, "fieldnum", &pgresult_fieldnum, 1);
 
-    rb_define_method( rb_cPgResult, "each", &pgresult_each, 0);
+    rb_define_method( rb_cPgResult, "each", &pgresult_each_row, -1);
     rb_include_module( rb_cPgResult, rb_mEnumerable);
-    rb_define_alias( rb_cPgResult, "rows", "entries");
-    rb_define_alias( rb_cPgResult, "result", "entries");
+    rb_define_method( rb_cPgResult, "to_a", &pgresult_to_a, 0);
+    rb_define_alias( rb_cPgResult, "entries", "to_a");
+    rb_define_alias( rb_cPgResult, "values", "to_a");
+    rb_define_alias( rb_cPgResult, "rows", "to_a");
+    rb_define_alias( rb_cPgResult, "result", "to_a");
+    rb_define_method( rb_cPgResult, "flatten", &pgresult_flatten, 0);
     rb_define_method( rb_cPgResult, "[]", &pgresult_aref, -1);
     rb_define_method( rb_cPgResult, "num_tuples", &pgresult_num_tuples, 0);
 
@@ -919,5 +1962,25 @@ Init_pgsql_result( void)
     id_new    = rb_intern( "new");
     id_parse  = rb_intern( "parse");
     id_result = rb_intern( "result");
+    id_lazy   = rb_intern( "lazy");
+
+    {
+        int i;
+
+        for (i = 0; i < 256; ++i)
+            hexval[ i] = 0x100;
+        for (i = 0; i < 10; ++i)
+            hexval[ '0' + i] = i;
+        for (i = 0; i < 6; ++i)
+            hexval[ 'a' + i] = hexval[ 'A' + i] = 10 + i;
+    }
+
+    id_BigDecimal = rb_intern( "BigDecimal");
+    id_pow        = rb_intern( "**");
+    id_mul        = rb_intern( "*");
+    id_call       = rb_intern( "call");
+
+    sym_json   = ID2SYM( rb_intern( "json"));
+    sym_hstore = ID2SYM( rb_intern( "hstore"));
 }
 
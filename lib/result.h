@@ -9,15 +9,38 @@
 #include "conn.h"
 
 
+struct pg_column;
+
+typedef VALUE (*pg_decoder)( struct pgconn_data *c, const char *s, int l,
+                                const struct pg_column *col);
+
+/*
+ * How to make a Ruby object out of the values of one column.  Chosen
+ * once per result instead of once per value.
+ */
+struct pg_column {
+    pg_decoder decode;
+    Oid        typ;
+    int        typmod;
+    VALUE      cls;
+    pg_decoder elem;        /* for arrays */
+    Oid        elemtyp;
+};
+
 struct pgresult_data {
-    PGresult *res;
-    VALUE     conn;
-    VALUE     fields;
-    VALUE     indices;
+    PGresult         *res;
+    VALUE             conn;
+    VALUE             fields;
+    VALUE             indices;
+    struct pg_column *plan;
+    int               nplan;
+    int               translate;
 };
 
 
 
+extern VALUE rb_cPgResult;
+
 extern const rb_data_type_t pgresult_data_data_type;
 
 
@@ -25,7 +48,21 @@ extern VALUE pgresult_new( PGresult *result, VALUE conn, VALUE cmd, VALUE par);
 extern VALUE pgresult_clear( VALUE self);
 extern VALUE pgresult_each( VALUE self);
 extern VALUE pg_fetchrow( struct pgresult_data *r, int num);
+extern VALUE pg_result_rows( struct pgresult_data *r);
+extern VALUE pg_result_flatten( struct pgresult_data *r);
 extern VALUE pg_fetchresult( struct pgresult_data *r, int row, int col);
+extern VALUE pg_fetchcell( struct pgresult_data *r, struct pgconn_data *c, int row, int col);
+extern VALUE pg_result_fields( struct pgresult_data *r);
+extern VALUE pg_result_indices( struct pgresult_data *r);
+extern VALUE pg_translate_value( struct pgconn_data *c, const char *string, Oid typ, int typmod);
+extern VALUE pg_numeric_text( struct pgconn_data *c, const char *s, int l, int typmod);
+extern Oid   pg_array_element( Oid typ);
+extern VALUE pg_numeric_value( struct pgconn_data *c, long long m, int scale, int typmod);
+extern void  pg_column_init( struct pg_column *col, struct pgconn_data *c, Oid typ, int typmod, int format);
+extern struct pg_column *pg_result_plan( struct pgresult_data *r, struct pgconn_data *c);
+extern VALUE pg_plan_new( int n, struct pg_column **cols);
+extern struct pg_column *pg_plan_columns( VALUE plan, int *n);
+extern void  pg_result_inherit_plan( struct pgresult_data *r, struct pgresult_data *prev);
 
 
 extern void Init_pgsql_result( void);
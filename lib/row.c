@@ -0,0 +1,713 @@
+/*
+ *  row.c  --  Rows as hashes, structs and lazy views
+ */
+
+
+#include "row.h"
+
+#include "conn_exec.h"
+
+
+/*
+ * Connections remember the keys of this many different row shapes.
+ */
+#define SHAPE_CACHE_MAX  64
+
+/* Slots of a shape entry. */
+#define SHAPE_FIELDS   0
+#define SHAPE_SYMBOLS  1
+#define SHAPE_STRUCT   2
+
+
+struct pgrow_data {
+    VALUE  result;
+    int    num;
+    int    n;
+    VALUE *vals;            /* Qundef until decoded */
+};
+
+
+extern int   pg_row_as( VALUE sym);
+extern VALUE pg_row_fetch( struct pgresult_data *r, int num, int as);
+extern VALUE pg_result_each_as( VALUE res, int as);
+extern VALUE pg_row_new( VALUE res, int num);
+static VALUE row_keys( struct pgresult_data *r, int as);
+static VALUE row_build( struct pgresult_data *r, struct pgconn_data *c, int num, int as, VALUE keys);
+static VALUE row_shape( struct pgresult_data *r);
+static VALUE row_hash( struct pgresult_data *r, struct pgconn_data *c, int num, VALUE keys);
+static VALUE row_struct( struct pgresult_data *r, struct pgconn_data *c, int num, VALUE cls);
+static VALUE shape_symbols( VALUE shape);
+static VALUE shape_struct( VALUE shape);
+static VALUE struct_members( VALUE syms);
+
+static VALUE pgresult_each_hash( int argc, VALUE *argv, VALUE self);
+static VALUE pgresult_each_struct( VALUE self);
+static VALUE pgresult_struct( VALUE self);
+
+static VALUE pgconn_query_hash( int argc, VALUE *argv, VALUE self);
+static VALUE query_hash_each( VALUE res);
+
+static void   pgrow_mark( void *ptr);
+static void   pgrow_free( void *ptr);
+static size_t pgrow_memsize( const void *ptr);
+static struct pgrow_data *get_pgrow( VALUE obj);
+static struct pgresult_data *pgrow_result( struct pgrow_data *w);
+static int    pgrow_index( struct pgrow_data *w, VALUE key);
+static VALUE  pgrow_value( struct pgrow_data *w, int i);
+
+static VALUE pgrow_aref( VALUE self, VALUE key);
+static VALUE pgrow_fetch( int argc, VALUE *argv, VALUE self);
+static VALUE pgrow_dig( int argc, VALUE *argv, VALUE self);
+static VALUE pgrow_fields( VALUE self);
+static VALUE pgrow_size( VALUE self);
+static VALUE pgrow_to_a( VALUE self);
+static VALUE pgrow_to_h( VALUE self);
+static VALUE pgrow_inspect( VALUE self);
+
+
+VALUE rb_cPgRow;
+
+
+static VALUE sym_array;
+static VALUE sym_hash;
+static VALUE sym_symbol_hash;
+static VALUE sym_struct;
+static VALUE sym_lazy;
+
+static ID id_new;
+static ID id_dig;
+
+
+static const rb_data_type_t pgrow_data_data_type = {
+    "pgsql:row",
+    { &pgrow_mark, &pgrow_free, &pgrow_memsize,},
+    0, 0, RUBY_TYPED_FREE_IMMEDIATELY
+};
+
+
+
+int
+pg_row_as( VALUE sym)
+{
+    if (NIL_P( sym) || sym == sym_array)
+        return PG_ROW_ARRAY;
+    if (sym == sym_lazy)
+        return PG_ROW_LAZY;
+    if (sym == sym_hash)
+        return PG_ROW_HASH;
+    if (sym == sym_symbol_hash)
+        return PG_ROW_SYMBOL_HASH;
+    if (sym == sym_struct)
+        return PG_ROW_STRUCT;
+    rb_raise( rb_eArgError, "Unknown row shape: %"PRIsVALUE".", sym);
+    return PG_ROW_ARRAY;
+}
+
+/*
+ * Row +num+ of the result in the shape +as+, or +nil+ if there is no
+ * such row.
+ */
+VALUE
+pg_row_fetch( struct pgresult_data *r, int num, int as)
+{
+    if (as == PG_ROW_ARRAY)
+        return pg_fetchrow( r, num);
+    if (num >= PQntuples( r->res))
+        return Qnil;
+    return row_build( r, get_pgconn( r->conn), num, as, row_keys( r, as));
+}
+
+VALUE
+pg_result_each_as( VALUE res, int as)
+{
+    struct pgresult_data *r;
+    struct pgconn_data *c;
+    VALUE keys;
+    int m, j;
+
+    TypedData_Get_Struct( res, struct pgresult_data, &pgresult_data_data_type, r);
+    m = PQntuples( r->res);
+    if (m == 0)
+        return Qnil;
+    if (as == PG_ROW_LAZY) {
+        for (j = 0; j < m; j++)
+            rb_yield( pg_row_new( res, j));
+    } else if (as == PG_ROW_ARRAY) {
+        for (j = 0; j < m; j++)
+            rb_yield( pg_fetchrow( r, j));
+    } else {
+        /* The keys are looked up once for all rows. */
+        c = get_pgconn( r->conn);
+        keys = row_keys( r, as);
+        for (j = 0; j < m; j++)
+            rb_yield( row_build( r, c, j, as, keys));
+        RB_GC_GUARD( keys);
+    }
+    return INT2FIX( m);
+}
+
+/*
+ * A Pg::Row for row +num+ of the result +res+.
+ */
+VALUE
+pg_row_new( VALUE res, int num)
+{
+    struct pgresult_data *r;
+    struct pgrow_data *w;
+    VALUE obj;
+    int i;
+
+    TypedData_Get_Struct( res, struct pgresult_data, &pgresult_data_data_type, r);
+    obj = TypedData_Make_Struct( rb_cPgRow, struct pgrow_data, &pgrow_data_data_type, w);
+    w->result = res;
+    w->num    = num;
+    w->n      = PQnfields( r->res);
+    w->vals   = ALLOC_N( VALUE, w->n > 0 ? w->n : 1);
+    for (i = 0; i < w->n; ++i)
+        w->vals[ i] = Qundef;
+    return obj;
+}
+
+
+/*
+ * What rows shaped +as+ are built from: the field names, their Symbols
+ * or the Struct class.
+ */
+VALUE
+row_keys( struct pgresult_data *r, int as)
+{
+    VALUE shape;
+
+    shape = row_shape( r);
+    switch (as) {
+    case PG_ROW_HASH:
+        return RARRAY_AREF( shape, SHAPE_FIELDS);
+    case PG_ROW_SYMBOL_HASH:
+        return shape_symbols( shape);
+    default:
+        return shape_struct( shape);
+    }
+}
+
+VALUE
+row_build( struct pgresult_data *r, struct pgconn_data *c, int num, int as, VALUE keys)
+{
+    if (as == PG_ROW_STRUCT)
+        return row_struct( r, c, num, keys);
+    return row_hash( r, c, num, keys);
+}
+
+/*
+ * The keys for rows of this result.  Results with the same field names
+ * share them, so repeated queries neither build new key strings nor new
+ * Struct classes.
+ */
+VALUE
+row_shape( struct pgresult_data *r)
+{
+    struct pgconn_data *c;
+    VALUE fields, shape;
+
+    c = get_pgconn( r->conn);
+    fields = pg_result_fields( r);
+    if (NIL_P( c->shapes))
+        c->shapes = rb_hash_new();
+    shape = rb_hash_lookup( c->shapes, fields);
+    if (NIL_P( shape)) {
+        if (RHASH_SIZE( c->shapes) >= SHAPE_CACHE_MAX)
+            rb_hash_clear( c->shapes);
+        shape = rb_ary_new3( 3, fields, Qnil, Qnil);
+        rb_hash_aset( c->shapes, fields, shape);
+    } else
+        r->fields = RARRAY_AREF( shape, SHAPE_FIELDS);
+    return shape;
+}
+
+VALUE
+row_hash( struct pgresult_data *r, struct pgconn_data *c, int num, VALUE keys)
+{
+    VALUE h;
+    int n, i;
+
+    n = PQnfields( r->res);
+    h = rb_hash_new();
+    for (i = 0; i < n; ++i)
+        rb_hash_aset( h, RARRAY_AREF( keys, i), pg_fetchcell( r, c, num, i));
+    return h;
+}
+
+VALUE
+row_struct( struct pgresult_data *r, struct pgconn_data *c, int num, VALUE cls)
+{
+    VALUE *vals, v, s;
+    int n, i;
+
+    n = PQnfields( r->res);
+    vals = ALLOCV_N( VALUE, v, n);
+    for (i = 0; i < n; ++i)
+        vals[ i] = pg_fetchcell( r, c, num, i);
+    s = rb_class_new_instance( n, vals, cls);
+    ALLOCV_END( v);
+    return s;
+}
+
+VALUE
+shape_symbols( VALUE shape)
+{
+    VALUE syms, fields;
+    long n, i;
+
+    syms = RARRAY_AREF( shape, SHAPE_SYMBOLS);
+    if (NIL_P( syms)) {
+        fields = RARRAY_AREF( shape, SHAPE_FIELDS);
+        n = RARRAY_LEN( fields);
+        syms = rb_ary_new_capa( n);
+        for (i = 0; i < n; ++i)
+            rb_ary_push( syms, rb_str_intern( RARRAY_AREF( fields, i)));
+        rb_ary_freeze( syms);
+        rb_ary_store( shape, SHAPE_SYMBOLS, syms);
+    }
+    return syms;
+}
+
+VALUE
+shape_struct( VALUE shape)
+{
+    VALUE cls, syms;
+
+    cls = RARRAY_AREF( shape, SHAPE_STRUCT);
+    if (NIL_P( cls)) {
+        syms = struct_members( shape_symbols( shape));
+        cls = rb_funcallv( rb_cStruct, id_new,
+                            RARRAY_LENINT( syms), RARRAY_CONST_PTR( syms));
+        rb_ary_store( shape, SHAPE_STRUCT, cls);
+    }
+    return cls;
+}
+
+/*
+ * Struct members must be unique.  A name that appeared before gets a
+ * suffix not used by another field: +id+, +id_2+, +id_3+.
+ */
+VALUE
+struct_members( VALUE syms)
+{
+    VALUE names, seen, ret, s;
+    long n, i, k;
+
+    n = RARRAY_LEN( syms);
+    names = rb_hash_new();
+    for (i = 0; i < n; ++i)
+        rb_hash_aset( names, RARRAY_AREF( syms, i), Qtrue);
+    if (RHASH_SIZE( names) == (size_t) n)
+        return syms;
+    seen = rb_hash_new();
+    ret = syms;
+    for (i = 0; i < n; ++i) {
+        s = RARRAY_AREF( syms, i);
+        for (k = 2; RTEST( rb_hash_lookup( seen, s)); ++k) {
+            s = rb_str_intern( rb_sprintf( "%"PRIsVALUE"_%ld",
+                                    rb_sym2str( RARRAY_AREF( syms, i)), k));
+            if (RTEST( rb_hash_lookup( names, s)))
+                s = RARRAY_AREF( syms, i);
+        }
+        if (s != RARRAY_AREF( syms, i)) {
+            if (ret == syms)
+                ret = rb_ary_dup( syms);
+            rb_ary_store( ret, i, s);
+        }
+        rb_hash_aset( seen, s, Qtrue);
+    }
+    return ret;
+}
+
+
+/*
+ * call-seq:
+ *    res.each_hash( symbols = false) { |hash| ... }  ->  nil or int
+ *
+ * Like Pg::Result#each but yield every row as a +Hash+.  The keys are
+ * the frozen field names, or Symbols if +symbols+ is true.
+ *
+ *   res = conn.exec "SELECT 1 AS a, 'x' AS b;"
+ *   res.each_hash { |h| p h }        # {"a"=>1, "b"=>"x"}
+ *   res.each_hash true do |h| p h end   # {:a=>1, :b=>"x"}
+ */
+VALUE
+pgresult_each_hash( int argc, VALUE *argv, VALUE self)
+{
+    VALUE sym;
+
+    rb_scan_args( argc, argv, "01", &sym);
+    RETURN_ENUMERATOR( self, argc, argv);
+    return pg_result_each_as( self, RTEST( sym) ? PG_ROW_SYMBOL_HASH : PG_ROW_HASH);
+}
+
+/*
+ * call-seq:
+ *    res.each_struct { |struct| ... }  ->  nil or int
+ *
+ * Like Pg::Result#each but yield every row as a +Struct+.  See
+ * Pg::Result#struct.
+ */
+VALUE
+pgresult_each_struct( VALUE self)
+{
+    RETURN_ENUMERATOR( self, 0, 0);
+    return pg_result_each_as( self, PG_ROW_STRUCT);
+}
+
+/*
+ * call-seq:
+ *    res.struct  ->  class
+ *
+ * The +Struct+ class Pg::Result#each_struct yields.  Its members are the
+ * field names; a name that appears again gets a suffix, as in
+ * +id+, +id_2+.  Results with the same field names from the same
+ * connection share the class.
+ */
+VALUE
+pgresult_struct( VALUE self)
+{
+    struct pgresult_data *r;
+
+    TypedData_Get_Struct( self, struct pgresult_data, &pgresult_data_data_type, r);
+    return shape_struct( row_shape( r));
+}
+
+
+/*
+ * call-seq:
+ *    conn.query_hash( sql, *bind_values)    -> ary
+ *    conn.query_hash( sql, *bind_values) { |hash| ... }   -> int or nil
+ *
+ * Like Pg::Conn#query but rows are hashes with the field names as keys.
+ */
+VALUE
+pgconn_query_hash( int argc, VALUE *argv, VALUE self)
+{
+    VALUE cmd, par;
+    VALUE res;
+
+    pg_parse_parameters( argc, argv, &cmd, &par);
+    res = pg_statement_exec( self, cmd, par);
+    if (rb_block_given_p())
+        return rb_ensure( query_hash_each, res, pgresult_clear, res);
+    else {
+        struct pgresult_data *r;
+        VALUE ret;
+        int m, j;
+
+        TypedData_Get_Struct( res, struct pgresult_data, &pgresult_data_data_type, r);
+        m = PQntuples( r->res);
+        ret = rb_ary_new_capa( m);
+        if (m > 0) {
+            struct pgconn_data *c;
+            VALUE keys;
+
+            c = get_pgconn( r->conn);
+            keys = row_keys( r, PG_ROW_HASH);
+            for (j = 0; j < m; ++j)
+                rb_ary_push( ret, row_hash( r, c, j, keys));
+        }
+        pgresult_clear( res);
+        return ret;
+    }
+}
+
+VALUE
+query_hash_each( VALUE res)
+{
+    return pg_result_each_as( res, PG_ROW_HASH);
+}
+
+
+
+void
+pgrow_mark( void *ptr)
+{
+    struct pgrow_data *w = ptr;
+    int i;
+
+    rb_gc_mark( w->result);
+    if (w->vals != NULL)
+        for (i = 0; i < w->n; ++i)
+            rb_gc_mark( w->vals[ i]);
+}
+
+void
+pgrow_free( void *ptr)
+{
+    struct pgrow_data *w = ptr;
+
+    ruby_xfree( w->vals);
+    ruby_xfree( ptr);
+}
+
+size_t
+pgrow_memsize( const void *ptr)
+{
+    const struct pgrow_data *w = ptr;
+
+    return sizeof (struct pgrow_data) + w->n * sizeof (VALUE);
+}
+
+struct pgrow_data *
+get_pgrow( VALUE obj)
+{
+    struct pgrow_data *w;
+
+    TypedData_Get_Struct( obj, struct pgrow_data, &pgrow_data_data_type, w);
+    return w;
+}
+
+struct pgresult_data *
+pgrow_result( struct pgrow_data *w)
+{
+    struct pgresult_data *r;
+
+    TypedData_Get_Struct( w->result, struct pgresult_data, &pgresult_data_data_type, r);
+    if (r->res == NULL)
+        rb_raise( rb_ePgError, "The row's result was cleared.");
+    return r;
+}
+
+/*
+ * The column number for an Integer, String or Symbol key, or -1.
+ */
+int
+pgrow_index( struct pgrow_data *w, VALUE key)
+{
+    struct pgresult_data *r;
+    VALUE i;
+    int n;
+
+    if (RB_INTEGER_TYPE_P( key)) {
+        n = NUM2INT( key);
+        if (n < 0)
+            n += w->n;
+        return n >= 0 && n < w->n ? n : -1;
+    }
+    if (SYMBOL_P( key))
+        key = rb_sym2str( key);
+    TypedData_Get_Struct( w->result, struct pgresult_data, &pgresult_data_data_type, r);
+    if (NIL_P( r->indices))
+        r = pgrow_result( w);
+    i = rb_hash_lookup( pg_result_indices( r), key);
+    return NIL_P( i) ? -1 : FIX2INT( i);
+}
+
+VALUE
+pgrow_value( struct pgrow_data *w, int i)
+{
+    struct pgresult_data *r;
+
+    if (w->vals[ i] == Qundef) {
+        r = pgrow_result( w);
+        w->vals[ i] = pg_fetchcell( r, get_pgconn( r->conn), w->num, i);
+    }
+    return w->vals[ i];
+}
+
+
+/*
+ * Document-class: Pg::Row
+ *
+ * A row of a result that decodes its values only when they are asked
+ * for, and only once.  Reading a few columns of a wide row is cheap.
+ *
+ *   res.each lazy: true do |row|
+ *     puts row[ "name"] if row[ :active]
+ *   end
+ *
+ * The row refers to its result.  Once the result is cleared, only values
+ * that have already been read are available.
+ */
+
+/*
+ * call-seq:
+ *    row[ key]  ->  obj or nil
+ *
+ * The value of the field +key+: a column number, a field name or a
+ * Symbol.  Returns +nil+ for unknown keys.
+ */
+VALUE
+pgrow_aref( VALUE self, VALUE key)
+{
+    struct pgrow_data *w;
+    int i;
+
+    w = get_pgrow( self);
+    i = pgrow_index( w, key);
+    return i < 0 ? Qnil : pgrow_value( w, i);
+}
+
+/*
+ * call-seq:
+ *    row.fetch( key)                  ->  obj
+ *    row.fetch( key, default)         ->  obj
+ *    row.fetch( key) { |key| ... }    ->  obj
+ *
+ * Like Pg::Row#[] but handle unknown keys like <code>Hash#fetch</code>.
+ */
+VALUE
+pgrow_fetch( int argc, VALUE *argv, VALUE self)
+{
+    struct pgrow_data *w;
+    VALUE key, def;
+    int i;
+
+    w = get_pgrow( self);
+    if (rb_scan_args( argc, argv, "11", &key, &def) == 1)
+        def = Qundef;
+    i = pgrow_index( w, key);
+    if (i >= 0)
+        return pgrow_value( w, i);
+    if (rb_block_given_p())
+        return rb_yield( key);
+    if (def != Qundef)
+        return def;
+    rb_raise( rb_eKeyError, "Unknown field: %"PRIsVALUE, rb_inspect( key));
+    return Qnil;
+}
+
+/*
+ * call-seq:
+ *    row.dig( key, *keys)  ->  obj or nil
+ *
+ * Like <code>Hash#dig</code>.  Handy with +json+ columns.
+ */
+VALUE
+pgrow_dig( int argc, VALUE *argv, VALUE self)
+{
+    VALUE v;
+
+    rb_check_arity( argc, 1, UNLIMITED_ARGUMENTS);
+    v = pgrow_aref( self, argv[ 0]);
+    if (argc == 1 || NIL_P( v))
+        return v;
+    return rb_funcallv( v, id_dig, argc - 1, argv + 1);
+}
+
+/*
+ * call-seq:
+ *    row.fields  ->  ary
+ *
+ * The field names, see Pg::Result#fields.
+ */
+VALUE
+pgrow_fields( VALUE self)
+{
+    struct pgrow_data *w;
+    struct pgresult_data *r;
+
+    w = get_pgrow( self);
+    TypedData_Get_Struct( w->result, struct pgresult_data, &pgresult_data_data_type, r);
+    if (NIL_P( r->fields))
+        r = pgrow_result( w);
+    return pg_result_fields( r);
+}
+
+/*
+ * call-seq:
+ *    row.size  ->  int
+ *
+ * The number of fields.
+ */
+VALUE
+pgrow_size( VALUE self)
+{
+    return INT2FIX( get_pgrow( self)->n);
+}
+
+/*
+ * call-seq:
+ *    row.to_a  ->  ary
+ *
+ * All values, like Pg::Result#each would have yielded them.
+ */
+VALUE
+pgrow_to_a( VALUE self)
+{
+    struct pgrow_data *w;
+    VALUE ary;
+    int i;
+
+    w = get_pgrow( self);
+    ary = rb_ary_new_capa( w->n);
+    for (i = 0; i < w->n; ++i)
+        rb_ary_push( ary, pgrow_value( w, i));
+    return ary;
+}
+
+/*
+ * call-seq:
+ *    row.to_h  ->  hash
+ *
+ * All values with the field names as keys, like Pg::Result#each_hash
+ * would have yielded them.
+ */
+VALUE
+pgrow_to_h( VALUE self)
+{
+    struct pgrow_data *w;
+    VALUE fields, h;
+    int i;
+
+    w = get_pgrow( self);
+    fields = pgrow_fields( self);
+    h = rb_hash_new();
+    for (i = 0; i < w->n; ++i)
+        rb_hash_aset( h, RARRAY_AREF( fields, i), pgrow_value( w, i));
+    return h;
+}
+
+/*
+ * call-seq:
+ *    row.inspect  ->  str
+ */
+VALUE
+pgrow_inspect( VALUE self)
+{
+    return rb_sprintf( "#<%"PRIsVALUE" %"PRIsVALUE">",
+                        rb_class_name( CLASS_OF( self)), rb_inspect( pgrow_to_h( self)));
+}
+
+
+void
+Init_pgsql_row( void)
+{
+#ifdef RDOC_NEEDS_THIS
+    rb_cPgConn   = rb_define_class_under( rb_mPg, "Conn", rb_cObject);
+    rb_cPgResult = rb_define_class_under( rb_mPg, "Result", rb_cObject);
+#endif
+
+    rb_define_method( rb_cPgResult, "each_hash", &pgresult_each_hash, -1);
+    rb_define_method( rb_cPgResult, "each_struct", &pgresult_each_struct, 0);
+    rb_define_method( rb_cPgResult, "struct", &pgresult_struct, 0);
+
+    rb_define_method( rb_cPgConn, "query_hash", &pgconn_query_hash, -1);
+
+    rb_cPgRow = rb_define_class_under( rb_mPg, "Row", rb_cObject);
+    rb_undef_alloc_func( rb_cPgRow);
+    rb_define_method( rb_cPgRow, "[]", &pgrow_aref, 1);
+    rb_define_method( rb_cPgRow, "fetch", &pgrow_fetch, -1);
+    rb_define_method( rb_cPgRow, "dig", &pgrow_dig, -1);
+    rb_define_method( rb_cPgRow, "fields", &pgrow_fields, 0);
+    rb_define_alias( rb_cPgRow, "keys", "fields");
+    rb_define_method( rb_cPgRow, "size", &pgrow_size, 0);
+    rb_define_alias( rb_cPgRow, "length", "size");
+    rb_define_method( rb_cPgRow, "to_a", &pgrow_to_a, 0);
+    rb_define_method( rb_cPgRow, "to_h", &pgrow_to_h, 0);
+    rb_define_method( rb_cPgRow, "inspect", &pgrow_inspect, 0);
+
+    sym_array       = ID2SYM( rb_intern( "array"));
+    sym_hash        = ID2SYM( rb_intern( "hash"));
+    sym_symbol_hash = ID2SYM( rb_intern( "symbol_hash"));
+    sym_struct      = ID2SYM( rb_intern( "struct"));
+    sym_lazy        = ID2SYM( rb_intern( "lazy"));
+
+    id_new = rb_intern( "new");
+    id_dig = rb_intern( "dig");
+}
+
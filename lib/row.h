@@ -0,0 +1,30 @@
+/*
+ *  row.h  --  Rows as hashes, structs and lazy views
+ */
+
+#ifndef __ROW_H
+#define __ROW_H
+
+#include "result.h"
+
+
+/* The shape rows are yielded in. */
+#define PG_ROW_ARRAY        0
+#define PG_ROW_HASH         1
+#define PG_ROW_SYMBOL_HASH  2
+#define PG_ROW_STRUCT       3
+#define PG_ROW_LAZY         4
+
+
+extern VALUE rb_cPgRow;
+
+
+extern int   pg_row_as( VALUE sym);
+extern VALUE pg_row_fetch( struct pgresult_data *r, int num, int as);
+extern VALUE pg_result_each_as( VALUE res, int as);
+extern VALUE pg_row_new( VALUE res, int num);
+
+extern void Init_pgsql_row( void);
+
+#endif
+
@@ -0,0 +1,504 @@
+/*
+ *  typemap.c  --  Per-connection type translation
+ */
+
+
+#include "typemap.h"
+
+#include "conn_exec.h"
+#include "result.h"
+
+
+#define FIRST_NORMAL_OID  16384
+
+
+struct pgtypemap_data {
+    VALUE conn;
+    VALUE registered;   /* oid => builtin oid, :json, :hstore or callable */
+    VALUE resolved;     /* the same, found in pg_type; composites map to
+                           their attribute type oids */
+    VALUE arrays;       /* array oid => element oid */
+    VALUE names;        /* type name => oid */
+    VALUE encoders;     /* class => callable */
+};
+
+
+static void   pgtypemap_mark( void *ptr);
+static size_t pgtypemap_memsize( const void *ptr);
+static VALUE  pgtypemap_alloc( VALUE cls);
+static struct pgtypemap_data *get_pgtypemap( VALUE obj);
+
+static VALUE pgconn_type_map( VALUE self);
+
+static VALUE pgtypemap_load( VALUE self);
+static VALUE typemap_attributes( const char *s);
+static VALUE pgtypemap_register( int argc, VALUE *argv, VALUE self);
+static VALUE pgtypemap_encode( int argc, VALUE *argv, VALUE self);
+static VALUE pgtypemap_aref( VALUE self, VALUE type);
+static VALUE pgtypemap_oid( VALUE self, VALUE name);
+static Oid   typemap_oid( struct pgtypemap_data *t, VALUE type);
+static VALUE typemap_builtin( VALUE sym);
+
+extern VALUE pg_typemap_decoder( VALUE map, Oid typ);
+extern Oid   pg_typemap_element( VALUE map, Oid typ);
+extern VALUE pg_typemap_encode(  VALUE map, VALUE obj);
+
+
+static VALUE rb_cPgTypeMap;
+
+static VALUE sym_json;
+static VALUE sym_hstore;
+
+static ID id_call;
+
+
+static const rb_data_type_t pgtypemap_data_data_type = {
+    "pgsql:typemap",
+    { &pgtypemap_mark, RUBY_TYPED_DEFAULT_FREE, &pgtypemap_memsize,},
+    0, 0, RUBY_TYPED_FREE_IMMEDIATELY
+};
+
+static const struct {
+    const char *name;
+    Oid         oid;
+} builtins[] = {
+    { "text",        TEXTOID        },
+    { "string",      TEXTOID        },
+    { "integer",     INT8OID        },
+    { "float",       FLOAT8OID      },
+    { "numeric",     NUMERICOID     },
+    { "bool",        BOOLOID        },
+    { "boolean",     BOOLOID        },
+    { "bytea",       BYTEAOID       },
+    { "date",        DATEOID        },
+    { "time",        TIMEOID        },
+    { "timetz",      TIMETZOID      },
+    { "timestamp",   TIMESTAMPOID   },
+    { "timestamptz", TIMESTAMPTZOID },
+    { NULL,          InvalidOid     }
+};
+
+
+
+void
+pgtypemap_mark( void *ptr)
+{
+    struct pgtypemap_data *t = ptr;
+
+    rb_gc_mark( t->conn);
+    rb_gc_mark( t->registered);
+    rb_gc_mark( t->resolved);
+    rb_gc_mark( t->arrays);
+    rb_gc_mark( t->names);
+    rb_gc_mark( t->encoders);
+}
+
+size_t
+pgtypemap_memsize( const void *ptr)
+{
+    return sizeof (struct pgtypemap_data);
+}
+
+VALUE
+pgtypemap_alloc( VALUE cls)
+{
+    struct pgtypemap_data *t;
+    VALUE obj;
+
+    obj = TypedData_Make_Struct( cls, struct pgtypemap_data, &pgtypemap_data_data_type, t);
+    t->conn       = Qnil;
+    t->registered = rb_hash_new();
+    t->resolved   = rb_hash_new();
+    t->arrays     = rb_hash_new();
+    t->names      = rb_hash_new();
+    t->encoders   = rb_hash_new();
+    return obj;
+}
+
+struct pgtypemap_data *
+get_pgtypemap( VALUE obj)
+{
+    struct pgtypemap_data *t;
+
+    TypedData_Get_Struct( obj, struct pgtypemap_data, &pgtypemap_data_data_type, t);
+    return t;
+}
+
+
+/*
+ * Document-class: Pg::TypeMap
+ *
+ * How values of a connection's result columns are translated, beyond
+ * the builtin types.  Get it by Pg::Conn#type_map.
+ *
+ * When the type map is created, +pg_type+ is read once and the
+ * following will be resolved automatically:
+ *
+ *   * domains are translated like their base type,
+ *   * enums become strings,
+ *   * arrays of any type become arrays,
+ *   * composite types become arrays of their attributes, each translated
+ *     by its own type.
+ *
+ * Extension types like +citext+, +hstore+ or +ltree+ can be assigned a
+ * builtin decoder or your own:
+ *
+ *   tm = conn.type_map
+ *   tm.register "citext", :text
+ *   tm.register "hstore", :hstore
+ *   tm.register "ltree" do |str| str.split "." end
+ *   tm.encode IPAddr do |a| a.to_s end
+ */
+
+/*
+ * call-seq:
+ *    conn.type_map   ->  typemap
+ *
+ * The connection's Pg::TypeMap.  It will be created and loaded from
+ * +pg_type+ on first access.  Results read before will not see it.
+ */
+VALUE
+pgconn_type_map( VALUE self)
+{
+    struct pgconn_data *c;
+    VALUE tm;
+
+    c = get_pgconn( self);
+    if (NIL_P( c->type_map)) {
+        tm = pgtypemap_alloc( rb_cPgTypeMap);
+        get_pgtypemap( tm)->conn = self;
+        pgtypemap_load( tm);
+        c->type_map = tm;
+    }
+    return c->type_map;
+}
+
+
+/*
+ * call-seq:
+ *    typemap.load   ->  self
+ *
+ * Read +pg_type+ again, e.g. after new types have been created.  Types
+ * registered by hand will be kept.
+ */
+VALUE
+pgtypemap_load( VALUE self)
+{
+    static const char sql[] =
+        "SELECT t.oid, n.nspname, t.typname, t.typtype, t.typbasetype,"
+        "       t.typelem,"
+        "       t.typcategory = 'A' AND t.typlen = -1 AND"
+        "         ( SELECT e.typdelim FROM pg_type e WHERE e.oid = t.typelem) = ',',"
+        "       CASE WHEN t.typtype = 'c' AND t.oid >= 16384 THEN"
+        "         ARRAY( SELECT a.atttypid FROM pg_attribute a"
+        "                 WHERE a.attrelid = t.typrelid AND a.attnum > 0"
+        "                   AND NOT a.attisdropped ORDER BY a.attnum)"
+        "       END"
+        "  FROM pg_type t JOIN pg_namespace n ON n.oid = t.typnamespace;";
+    struct pgtypemap_data *t;
+    struct pgconn_data *c;
+    struct pgresult_data *r;
+    VALUE res, domains, keys;
+    PGresult *p;
+    int n, i, k;
+
+    t = get_pgtypemap( self);
+    c = get_pgconn( t->conn);
+    /* Text representation, whatever Pg::Conn#translate_results says. */
+    if ((p = PQexec( c->conn, sql)) == NULL)
+        pg_raise_connexec( c);
+    res = pgresult_new( p, t->conn, rb_str_new( sql, sizeof sql - 1), Qnil);
+    TypedData_Get_Struct( res, struct pgresult_data, &pgresult_data_data_type, r);
+    p = r->res;
+
+    rb_hash_clear( t->resolved);
+    rb_hash_clear( t->arrays);
+    rb_hash_clear( t->names);
+    domains = rb_hash_new();
+    for (i = 0, n = PQntuples( p); i < n; ++i) {
+        Oid oid, base, elem;
+        VALUE o, name;
+
+        oid  = (Oid) strtoul( PQgetvalue( p, i, 0), NULL, 10);
+        base = (Oid) strtoul( PQgetvalue( p, i, 4), NULL, 10);
+        elem = (Oid) strtoul( PQgetvalue( p, i, 5), NULL, 10);
+        o = UINT2NUM( oid);
+
+        name = rb_str_new2( PQgetvalue( p, i, 2));
+        if (NIL_P( rb_hash_lookup( t->names, name)))
+            rb_hash_aset( t->names, rb_str_freeze( name), o);
+        name = rb_sprintf( "%s.%s", PQgetvalue( p, i, 1), PQgetvalue( p, i, 2));
+        rb_hash_aset( t->names, rb_str_freeze( name), o);
+
+        switch (*PQgetvalue( p, i, 3)) {
+        case 'b':
+            /* The vector types' text form is not an array literal, and
+               decode_array only splits at commas. */
+            if (elem != InvalidOid && *PQgetvalue( p, i, 6) == 't' &&
+                    oid != INT2VECTOROID && oid != OIDVECTOROID)
+                rb_hash_aset( t->arrays, o, UINT2NUM( elem));
+            break;
+        case 'e':
+            rb_hash_aset( t->resolved, o, UINT2NUM( TEXTOID));
+            break;
+        case 'c':
+            if (oid >= FIRST_NORMAL_OID && !PQgetisnull( p, i, 7))
+                rb_hash_aset( t->resolved, o,
+                                typemap_attributes( PQgetvalue( p, i, 7)));
+            break;
+        case 'd':
+            rb_hash_aset( domains, o, UINT2NUM( base));
+            break;
+        default:
+            break;
+        }
+    }
+    pgresult_clear( res);
+
+    /* Domains may be based on domains. */
+    keys = rb_funcall( domains, rb_intern( "keys"), 0);
+    for (i = 0, n = RARRAY_LEN( keys); i < n; ++i) {
+        VALUE o, b, nb;
+
+        o = RARRAY_AREF( keys, i);
+        b = rb_hash_aref( domains, o);
+        for (k = 0; k < 32 && !NIL_P( nb = rb_hash_lookup( domains, b)); ++k)
+            b = nb;
+        if (!NIL_P( nb = rb_hash_lookup( t->arrays, b)))
+            rb_hash_aset( t->arrays, o, nb);
+        else if (!NIL_P( nb = rb_hash_lookup( t->resolved, b)))
+            rb_hash_aset( t->resolved, o, nb);
+        else
+            rb_hash_aset( t->resolved, o, b);
+    }
+    return self;
+}
+
+VALUE
+typemap_attributes( const char *s)
+{
+    VALUE ary;
+    char *e;
+
+    ary = rb_ary_new();
+    for (; *s; s = e) {
+        if (*s < '0' || *s > '9') {
+            e = (char *) s + 1;
+            continue;
+        }
+        rb_ary_push( ary, ULONG2NUM( strtoul( s, &e, 10)));
+    }
+    return rb_ary_freeze( ary);
+}
+
+
+/*
+ * call-seq:
+ *    typemap.register( type, decoder)             ->  self
+ *    typemap.register( type) { |str| ... }        ->  self
+ *    typemap.register( type, nil)                 ->  self
+ *
+ * Translate values of +type+ (an oid or a type name, optionally
+ * schema-qualified) by +decoder+:
+ *
+ *   Symbol         ::  a builtin decoder: +:text+, +:integer+, +:float+,
+ *                      +:numeric+, +:bool+, +:bytea+, +:date+, +:time+,
+ *                      +:timetz+, +:timestamp+, +:timestamptz+, +:json+
+ *                      (parse always), +:hstore+ (to a +Hash+)
+ *   String/Integer ::  translate like that type
+ *   callable       ::  call it with the value's text
+ *
+ * +nil+ removes the registration.
+ */
+VALUE
+pgtypemap_register( int argc, VALUE *argv, VALUE self)
+{
+    struct pgtypemap_data *t;
+    VALUE type, dec, o;
+
+    t = get_pgtypemap( self);
+    if (rb_scan_args( argc, argv, "11", &type, &dec) < 2 && rb_block_given_p())
+        dec = rb_block_proc();
+    o = UINT2NUM( typemap_oid( t, type));
+    if (argc < 2 && NIL_P( dec))
+        rb_raise( rb_eArgError, "No decoder given.");
+    if (NIL_P( dec))
+        rb_hash_delete( t->registered, o);
+    else {
+        if (SYMBOL_P( dec))
+            dec = typemap_builtin( dec);
+        else if (RB_TYPE_P( dec, T_STRING) || RB_INTEGER_TYPE_P( dec))
+            dec = UINT2NUM( typemap_oid( t, dec));
+        else if (!rb_respond_to( dec, id_call))
+            rb_raise( rb_eTypeError, "Decoder must respond to call.");
+        rb_hash_aset( t->registered, o, dec);
+    }
+    return self;
+}
+
+/*
+ * call-seq:
+ *    typemap.encode( cls, encoder)             ->  self
+ *    typemap.encode( cls) { |obj| ... }        ->  self
+ *
+ * Make query parameters and Pg::Conn#stringize call +encoder+ for
+ * objects of class +cls+ and its subclasses.  It has to return a
+ * string.
+ */
+VALUE
+pgtypemap_encode( int argc, VALUE *argv, VALUE self)
+{
+    struct pgtypemap_data *t;
+    VALUE cls, enc;
+
+    t = get_pgtypemap( self);
+    if (rb_scan_args( argc, argv, "11", &cls, &enc) < 2)
+        enc = rb_block_proc();
+    Check_Type( cls, T_CLASS);
+    if (NIL_P( enc))
+        rb_hash_delete( t->encoders, cls);
+    else
+        rb_hash_aset( t->encoders, cls, enc);
+    return self;
+}
+
+/*
+ * call-seq:
+ *    typemap[ type]   ->  obj or nil
+ *
+ * The decoder registered for +type+, or what has been found in
+ * +pg_type+.
+ */
+VALUE
+pgtypemap_aref( VALUE self, VALUE type)
+{
+    struct pgtypemap_data *t;
+    VALUE o, r;
+
+    t = get_pgtypemap( self);
+    o = UINT2NUM( typemap_oid( t, type));
+    r = rb_hash_lookup( t->registered, o);
+    if (NIL_P( r))
+        r = rb_hash_lookup( t->resolved, o);
+    return r;
+}
+
+/*
+ * call-seq:
+ *    typemap.oid( name)   ->  int or nil
+ *
+ * Look up a type's oid by its name.
+ */
+VALUE
+pgtypemap_oid( VALUE self, VALUE name)
+{
+    return rb_hash_lookup( get_pgtypemap( self)->names, StringValue( name));
+}
+
+Oid
+typemap_oid( struct pgtypemap_data *t, VALUE type)
+{
+    VALUE o;
+
+    if (RB_INTEGER_TYPE_P( type))
+        return NUM2UINT( type);
+    o = rb_hash_lookup( t->names, StringValue( type));
+    if (NIL_P( o))
+        rb_raise( rb_eArgError, "Unknown type: %"PRIsVALUE".", type);
+    return NUM2UINT( o);
+}
+
+VALUE
+typemap_builtin( VALUE sym)
+{
+    const char *s;
+    int i;
+
+    if (sym == sym_json || sym == sym_hstore)
+        return sym;
+    s = rb_id2name( SYM2ID( sym));
+    for (i = 0; builtins[ i].name != NULL; ++i)
+        if (strcmp( builtins[ i].name, s) == 0)
+            return UINT2NUM( builtins[ i].oid);
+    rb_raise( rb_eArgError, "Unknown builtin decoder: %"PRIsVALUE".", sym);
+    return Qnil;
+}
+
+
+/*
+ * What the result column plan needs: the entry for +typ+ or +Qundef+.
+ */
+VALUE
+pg_typemap_decoder( VALUE map, Oid typ)
+{
+    struct pgtypemap_data *t;
+    VALUE o, r;
+
+    t = get_pgtypemap( map);
+    o = UINT2NUM( typ);
+    r = rb_hash_lookup2( t->registered, o, Qundef);
+    if (r == Qundef)
+        r = rb_hash_lookup2( t->resolved, o, Qundef);
+    return r;
+}
+
+Oid
+pg_typemap_element( VALUE map, Oid typ)
+{
+    VALUE e;
+
+    e = rb_hash_lookup( get_pgtypemap( map)->arrays, UINT2NUM( typ));
+    return NIL_P( e) ? InvalidOid : NUM2UINT( e);
+}
+
+/*
+ * The string for +obj+ if an encoder is registered for its class or a
+ * superclass, else +Qundef+.
+ */
+VALUE
+pg_typemap_encode( VALUE map, VALUE obj)
+{
+    struct pgtypemap_data *t;
+    VALUE cls, enc, r;
+
+    if (NIL_P( map))
+        return Qundef;
+    t = get_pgtypemap( map);
+    if (RHASH_SIZE( t->encoders) == 0)
+        return Qundef;
+    for (cls = rb_obj_class( obj); !NIL_P( cls); cls = rb_class_superclass( cls)) {
+        enc = rb_hash_lookup2( t->encoders, cls, Qundef);
+        if (enc != Qundef) {
+            r = rb_funcall( enc, id_call, 1, obj);
+            return StringValue( r);
+        }
+    }
+    return Qundef;
+}
+
+
+void
+Init_pgsql_typemap( void)
+{
+    rb_cPgTypeMap = rb_define_class_under( rb_mPg, "TypeMap", rb_cObject);
+    rb_undef_alloc_func( rb_cPgTypeMap);
+
+#ifdef RDOC_NEEDS_THIS
+    rb_cPgConn = rb_define_class_under( rb_mPg, "Conn", rb_cObject);
+#endif
+
+    rb_define_method( rb_cPgConn, "type_map", &pgconn_type_map, 0);
+
+    rb_define_method( rb_cPgTypeMap, "load", &pgtypemap_load, 0);
+    rb_define_alias( rb_cPgTypeMap, "reload", "load");
+    rb_define_method( rb_cPgTypeMap, "register", &pgtypemap_register, -1);
+    rb_define_method( rb_cPgTypeMap, "encode", &pgtypemap_encode, -1);
+    rb_define_method( rb_cPgTypeMap, "[]", &pgtypemap_aref, 1);
+    rb_define_method( rb_cPgTypeMap, "oid", &pgtypemap_oid, 1);
+
+    sym_json   = ID2SYM( rb_intern( "json"));
+    sym_hstore = ID2SYM( rb_intern( "hstore"));
+
+    id_call = rb_intern( "call");
+}
+
@@ -0,0 +1,18 @@
+/*
+ *  typemap.h  --  Per-connection type translation
+ */
+
+#ifndef __TYPEMAP_H
+#define __TYPEMAP_H
+
+#include "conn.h"
+
+
+extern VALUE pg_typemap_decoder( VALUE map, Oid typ);
+extern Oid   pg_typemap_element( VALUE map, Oid typ);
+extern VALUE pg_typemap_encode(  VALUE map, VALUE obj);
+
+extern void Init_pgsql_typemap( void);
+
+#endif
+